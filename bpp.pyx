@@ -8,11 +8,148 @@ from  smart_ptr cimport shared_ptr
 from  AutowrapRefHolder cimport AutowrapRefHolder
 from  libcpp cimport bool
 from  libc.string cimport const_char
+from cpython.buffer cimport PyBUF_WRITABLE
 from cython.operator cimport dereference as deref, preincrement as inc, address as address
 from bpp_h cimport Alignment as _Alignment
+from bpp_h cimport AlignmentList as _AlignmentList
+from bpp_h cimport CondensedMatrix as _CondensedMatrix
+from bpp_h cimport PhyloTree as _PhyloTree
+from bpp_h cimport SiteLikelihoods as _SiteLikelihoods
 cdef extern from "autowrap_tools.hpp":
     char * _cast_const_away(char *)
-from numpy import array
+from numpy import array, asarray, empty
+
+
+cdef class CondensedMatrix:
+    """
+    Upper triangle of a symmetric matrix, in scipy.spatial.distance's
+    condensed order. Exposes its C++ buffer through the buffer protocol,
+    read-only, so numpy.asarray(m) is a view, not a copy.
+    """
+
+    cdef shared_ptr[_CondensedMatrix] inst
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+
+    def __dealloc__(self):
+         self.inst.reset()
+
+    def __len__(self):
+        return self.inst.get().get_number_of_pairs()
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError('CondensedMatrix buffers are read-only')
+        self.shape[0] = self.inst.get().get_number_of_pairs()
+        self.strides[0] = sizeof(double)
+        buffer.buf = <char *>self.inst.get().data()
+        buffer.format = 'd'
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(double)
+        buffer.len = self.shape[0] * sizeof(double)
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 1
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+    def get_names(self):
+        _r = self.inst.get().get_names()
+        cdef list py_result = _r
+        return py_result
+
+    def get_square(self):
+        cdef size_t n = self.inst.get().size()
+        result = empty((n, n))
+        cdef double[:, ::1] view = result
+        if n > 0:
+            self.inst.get().fill_square(&view[0, 0])
+        return result
+
+cdef class SiteLikelihoodArray:
+    """
+    One of the arrays of a C++ SiteLikelihoods, exposed through the buffer
+    protocol: the per-site lnL, shape (nsites,), or the rate category
+    posteriors, shape (nsites, ncat). numpy.asarray(a) is a view, not a
+    copy, and keeps the C++ buffers alive.
+    """
+
+    cdef shared_ptr[_SiteLikelihoods] inst
+    cdef bint posteriors
+    cdef Py_ssize_t shape[2]
+    cdef Py_ssize_t strides[2]
+
+    def __dealloc__(self):
+         self.inst.reset()
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        cdef size_t ncat = self.inst.get().get_number_of_categories()
+        self.shape[0] = self.inst.get().get_number_of_sites()
+        self.shape[1] = ncat
+        self.strides[0] = ncat * sizeof(double) if self.posteriors else sizeof(double)
+        self.strides[1] = sizeof(double)
+        buffer.buf = <char *>(self.inst.get().posteriors() if self.posteriors else self.inst.get().log_likelihoods())
+        buffer.format = 'd'
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(double)
+        buffer.len = self.shape[0] * (ncat if self.posteriors else 1) * sizeof(double)
+        buffer.ndim = 2 if self.posteriors else 1
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+cdef class PhyloTree:
+    """
+    A parsed tree, as returned by the *_phylo_tree methods of Alignment.
+    Alignment methods that take a Newick string also take a PhyloTree,
+    which skips writing and re-reading the Newick.
+    """
+
+    cdef shared_ptr[_PhyloTree] inst
+
+    def __dealloc__(self):
+         self.inst.reset()
+
+    @staticmethod
+    def from_newick(bytes newick):
+        """
+        Parse a Newick string, or the name of a file holding one
+        """
+        return _wrap_phylo_tree(_PhyloTree.from_newick(<libcpp_string>newick))
+
+    def get_number_of_leaves(self):
+        cdef size_t _r = self.inst.get().get_number_of_leaves()
+        py_result = <size_t>_r
+        return py_result
+
+    def get_leaf_names(self):
+        _r = self.inst.get().get_leaf_names()
+        cdef list py_result = _r
+        return py_result
+
+    def has_support(self):
+        cdef bool _r = self.inst.get().has_support()
+        py_result = <bool>_r
+        return py_result
+
+    def to_newick(self):
+        cdef libcpp_string _r = self.inst.get().to_newick()
+        py_result = <libcpp_string>_r
+        return py_result
+
+cdef PhyloTree _wrap_phylo_tree(_PhyloTree tree):
+    cdef PhyloTree result = PhyloTree.__new__(PhyloTree)
+    result.inst = shared_ptr[_PhyloTree](new _PhyloTree(tree))
+    return result
 
 cdef class Alignment:
 
@@ -39,8 +176,8 @@ cdef class Alignment:
         py_result = <libcpp_string>_r
         return py_result
 
-    def compute_distances(self):
-        self.inst.get().compute_distances()
+    def compute_distances(self, double screen_tolerance=0):
+        self.inst.get().compute_distances(screen_tolerance)
 
     def get_rates(self, bytes order ):
         assert isinstance(order, bytes), 'arg order wrong type'
@@ -59,9 +196,12 @@ cdef class Alignment:
         self.inst.get().write_alignment((<libcpp_string>filename), (<libcpp_string>file_format), (<bool>interleaved))
 
     def get_variances(self):
-        _r = self.inst.get().get_variances()
-        cdef list py_result = _r
-        return array(py_result)
+        cdef size_t n = self.inst.get().get_number_of_sequences()
+        result = empty((n, n))
+        cdef double[:, ::1] view = result
+        if n > 0:
+            self.inst.get().fill_variances(&view[0, 0])
+        return result
 
     def get_sequences(self):
         _r = self.inst.get().get_sequences()
@@ -74,6 +214,19 @@ cdef class Alignment:
         cdef list py_result = _r
         return array(py_result)
 
+    def get_p_matrices(self, times):
+        """
+        P(t) for each of times, as one array of shape (len(times), nstates,
+        nstates), filled in place by the C++ side.
+        """
+        cdef libcpp_vector[double] _times = [float(t) for t in times]
+        cdef size_t s = self.inst.get().get_number_of_states()
+        result = empty((_times.size(), s, s))
+        cdef double[:, :, ::1] view = result
+        if _times.size() > 0:
+            self.inst.get().fill_p_matrices(_times, &view[0, 0, 0])
+        return result
+
     def get_q_matrix(self):
         _r = self.inst.get().get_q_matrix()
         cdef list py_result = _r
@@ -116,11 +269,21 @@ cdef class Alignment:
 
         self.inst.get().initialise_likelihood((<libcpp_string>tree))
 
+    def _initialise_likelihood_2(self, PhyloTree tree ):
+        self.inst.get().initialise_likelihood(deref(tree.inst.get()))
+
     def initialise_likelihood(self, *args):
+        """
+        Set up the likelihood calculator on a tree (newick bytes or PhyloTree).
+        With no tree, starts from the BioNJ tree of the current distances; pass
+        get_bme_phylo_tree() for a balanced minimum evolution start.
+        """
         if not args:
             return self._initialise_likelihood_0(*args)
         elif (len(args)==1) and (isinstance(args[0], bytes)):
             return self._initialise_likelihood_1(*args)
+        elif (len(args)==1) and (isinstance(args[0], PhyloTree)):
+            return self._initialise_likelihood_2(*args)
         else:
                raise Exception('can not handle type of %s' % (args,))
 
@@ -143,16 +306,23 @@ cdef class Alignment:
                                        (<bool>interleaved))
 
 
-    def initialise_parsimony(self, bytes tree, verbose, include_gaps):
+    def initialise_parsimony(self, tree, verbose, include_gaps):
         """
-        Create the parsimony model
+        Create the parsimony model from a Newick string or a PhyloTree
         """
-        assert isinstance(tree, bytes), 'arg tree wrong type'
+        assert isinstance(tree, (bytes, PhyloTree)), 'arg tree wrong type'
         assert isinstance(verbose, (int, long)), 'arg verbose wrong type (expected a bool)'
         assert isinstance(include_gaps, (int, long)), 'arg include_gaps wrong type (expected a bool)'
-        self.inst.get().initialise_parsimony((<libcpp_string>tree),
-                                             (<bool>verbose),
-                                             (<bool>include_gaps))
+        cdef PhyloTree handle
+        if isinstance(tree, PhyloTree):
+            handle = tree
+            self.inst.get().initialise_parsimony(deref(handle.inst.get()),
+                                                 (<bool>verbose),
+                                                 (<bool>include_gaps))
+        else:
+            self.inst.get().initialise_parsimony((<libcpp_string>tree),
+                                                 (<bool>verbose),
+                                                 (<bool>include_gaps))
 
 
     def get_parsimony_score(self):
@@ -176,6 +346,9 @@ cdef class Alignment:
         py_result = <libcpp_string>_r
         return py_result
 
+    def get_parsimony_phylo_tree(self):
+        return _wrap_phylo_tree(self.inst.get().get_parsimony_phylo_tree())
+
     
     def optimise_parsimony(self, verbose):
         assert isinstance(verbose, (int, long)), 'arg verbose wrong type (expected uint)'
@@ -220,6 +393,16 @@ cdef class Alignment:
 
         self.inst.get().sort_alignment((<bool>ascending))
 
+    def add_sequences(self, list headers_sequences ):
+        assert isinstance(headers_sequences, list) and all(isinstance(elemt_rec, (tuple, list)) and len(elemt_rec) == 2 and isinstance(elemt_rec[0], bytes) and isinstance(elemt_rec[1], bytes) for elemt_rec in headers_sequences), 'arg headers_sequences wrong type'
+        cdef libcpp_vector[libcpp_pair[libcpp_string,libcpp_string]] v0 = headers_sequences
+        self.inst.get().add_sequences(v0)
+
+    def remove_sequences(self, list names ):
+        assert isinstance(names, list) and all(isinstance(elemt_rec, bytes) for elemt_rec in names), 'arg names wrong type'
+        cdef libcpp_vector[libcpp_string] v0 = names
+        self.inst.get().remove_sequences(v0)
+
     def get_sites(self):
         _r = self.inst.get().get_sites()
         cdef list py_result = _r
@@ -239,13 +422,67 @@ cdef class Alignment:
         py_result = <size_t>_r
         return py_result
 
-    def optimise_branch_lengths(self):
-        self.inst.get().optimise_branch_lengths()
+    def optimise_branch_lengths(self, bytes method=b'newton', polish=True):
+        """
+        Optimises branch lengths by per-branch Newton sweeps (b'newton') or
+        jointly by projected L-BFGS (b'lbfgs'), optionally polished by a Newton
+        sweep.
+        """
+        assert isinstance(method, bytes), 'arg method wrong type'
+        assert isinstance(polish, (int, long)), 'arg polish wrong type'
 
-    def optimise_topology(self,  fix_model_params ):
+        self.inst.get().optimise_branch_lengths((<libcpp_string>method), (<bool>polish))
+
+    def get_optimisation_stats(self):
+        """
+        What the last optimise_branch_lengths cost, as a dict of the final lnL,
+        L-BFGS iterations, Newton sweeps, full likelihood evaluations, gradient
+        evaluations, single-branch evaluations and seconds.
+        """
+        cdef libcpp_vector[double] _r = self.inst.get().get_optimisation_stats()
+        return {'lnl': _r[0], 'iterations': int(_r[1]), 'sweeps': int(_r[2]), 'evaluations': int(_r[3]),
+                'gradients': int(_r[4]), 'branch_evaluations': int(_r[5]), 'seconds': _r[6]}
+
+    def optimise_topology(self,  fix_model_params , spr_radius=0):
+        """
+        NNI search, with SPR moves up to spr_radius branches away if that is
+        not zero. Unless fix_model_params is set, model parameters are
+        re-optimised between searches until lnL stops improving.
+        """
         assert isinstance(fix_model_params, (int, long)), 'arg fix_model_params wrong type'
+        assert isinstance(spr_radius, (int, long)), 'arg spr_radius wrong type'
 
-        self.inst.get().optimise_topology((<bool>fix_model_params))
+        self.inst.get().optimise_topology((<bool>fix_model_params), (<size_t>spr_radius))
+
+    def get_topology_log(self):
+        """
+        The rounds of the last optimise_topology, as dicts of the lnL at the
+        end of the round, the number of improving moves found, the NNI and SPR
+        moves applied, and the seconds elapsed.
+        """
+        cdef libcpp_vector[libcpp_vector[double]] _r = self.inst.get().get_topology_log()
+        return [{'lnl': row[0], 'improving_moves': int(row[1]), 'nni_moves': int(row[2]),
+                 'spr_moves': int(row[3]), 'seconds': row[4]} for row in _r]
+
+    def select_model(self, tree, bytes criterion=b'bic', skip=True):
+        """
+        Fits every model for this alphabet, with and without +G (and, for
+        proteins, +F), on the topology of tree (Newick bytes or a PhyloTree),
+        without changing this alignment's model. Returns dicts of model, lnl,
+        parameters, aic, aicc, bic and skipped, best first by criterion
+        (b'aic', b'aicc' or b'bic'). A skipped model could not have won, and
+        has NaN lnl and scores.
+        """
+        cdef libcpp_vector[libcpp_pair[libcpp_string, libcpp_vector[double]]] _r
+        if isinstance(tree, bytes):
+            _r = self.inst.get().select_model((<libcpp_string>tree), (<libcpp_string>criterion), (<bool>skip))
+        elif isinstance(tree, PhyloTree):
+            _r = self.inst.get().select_model(deref((<PhyloTree>tree).inst.get()), (<libcpp_string>criterion), (<bool>skip))
+        else:
+            raise Exception('can not handle type of %s' % (tree,))
+        return [{'model': row.first, 'lnl': row.second[0], 'parameters': int(row.second[1]),
+                 'aic': row.second[2], 'aicc': row.second[3], 'bic': row.second[4],
+                 'skipped': row.second[0] != row.second[0]} for row in _r]
 
     def get_number_of_free_parameters(self):
         cdef size_t _r = self.inst.get().get_number_of_free_parameters()
@@ -257,6 +494,19 @@ cdef class Alignment:
         py_result = <size_t>_r
         return py_result
 
+    def set_number_of_threads(self,  nthreads ):
+        """
+        Set the number of threads used by the distance engine (0 = all cores)
+        """
+        assert isinstance(nthreads, (int, long)), 'arg nthreads wrong type'
+
+        self.inst.get().set_number_of_threads((<size_t>nthreads))
+
+    def get_number_of_threads(self):
+        cdef size_t _r = self.inst.get().get_number_of_threads()
+        py_result = <size_t>_r
+        return py_result
+
     def _print_params(self):
         self.inst.get()._print_params()
 
@@ -295,9 +545,26 @@ cdef class Alignment:
         return py_result
 
     def get_distances(self):
-        _r = self.inst.get().get_distances()
-        cdef list py_result = _r
-        return array(py_result)
+        cdef size_t n = self.inst.get().get_number_of_sequences()
+        result = empty((n, n))
+        cdef double[:, ::1] view = result
+        if n > 0:
+            self.inst.get().fill_distances(&view[0, 0])
+        return result
+
+    def get_condensed_distances(self):
+        """
+        Distances as a scipy.spatial.distance condensed vector, viewing the
+        C++ buffer directly.
+        """
+        cdef CondensedMatrix m = CondensedMatrix.__new__(CondensedMatrix)
+        m.inst = self.inst.get().get_condensed_distances()
+        return asarray(m)
+
+    def get_condensed_variances(self):
+        cdef CondensedMatrix m = CondensedMatrix.__new__(CondensedMatrix)
+        m.inst = self.inst.get().get_condensed_variances()
+        return asarray(m)
 
     def get_tree(self):
         cdef libcpp_string _r = self.inst.get().get_tree()
@@ -309,10 +576,35 @@ cdef class Alignment:
         py_result = <libcpp_string>_r
         return py_result
 
+    def get_phylo_tree(self):
+        return _wrap_phylo_tree(self.inst.get().get_phylo_tree())
+
+    def get_abayes_phylo_tree(self):
+        return _wrap_phylo_tree(self.inst.get().get_abayes_phylo_tree())
+
+    def get_alrt_tree(self, nreplicates=1000, seed=1):
+        """
+        The likelihood tree labelled with SH-like aLRT supports, from
+        nreplicates RELL bootstraps of the per-site likelihoods.
+        """
+        assert isinstance(nreplicates, (int, long)), 'arg nreplicates wrong type'
+        assert isinstance(seed, (int, long)), 'arg seed wrong type'
+        cdef libcpp_string _r = self.inst.get().get_alrt_tree((<size_t>nreplicates), (<size_t>seed))
+        py_result = <libcpp_string>_r
+        return py_result
+
+    def get_alrt_phylo_tree(self, nreplicates=1000, seed=1):
+        assert isinstance(nreplicates, (int, long)), 'arg nreplicates wrong type'
+        assert isinstance(seed, (int, long)), 'arg seed wrong type'
+        return _wrap_phylo_tree(self.inst.get().get_alrt_phylo_tree((<size_t>nreplicates), (<size_t>seed)))
+
     def get_distance_variance_matrix(self):
-        _r = self.inst.get().get_distance_variance_matrix()
-        cdef list py_result = _r
-        return array(py_result)
+        cdef size_t n = self.inst.get().get_number_of_sequences()
+        result = empty((n, n))
+        cdef double[:, ::1] view = result
+        if n > 0:
+            self.inst.get().fill_distance_variance_matrix(&view[0, 0])
+        return result
 
     def _simulate_0(self,  nsites , bytes tree ):
         assert isinstance(nsites, (int, long)), 'arg nsites wrong type'
@@ -330,9 +622,18 @@ cdef class Alignment:
         cdef list py_result = _r
         return py_result
 
+    def _simulate_2(self,  nsites , PhyloTree tree ):
+        assert isinstance(nsites, (int, long)), 'arg nsites wrong type'
+
+        _r = self.inst.get().simulate((<size_t>nsites), deref(tree.inst.get()))
+        cdef list py_result = _r
+        return py_result
+
     def simulate(self, *args):
         if (len(args)==2) and (isinstance(args[0], (int, long))) and (isinstance(args[1], bytes)):
             return self._simulate_0(*args)
+        elif (len(args)==2) and (isinstance(args[0], (int, long))) and (isinstance(args[1], PhyloTree)):
+            return self._simulate_2(*args)
         elif (len(args)==1) and (isinstance(args[0], (int, long))):
             return self._simulate_1(*args)
         else:
@@ -353,6 +654,28 @@ cdef class Alignment:
         cdef list py_result = _r
         return py_result
 
+    def get_bootstrap_trees(self, nreplicates, seed=1, bytes method=b'jc', double alpha=0):
+        """
+        BioNJ trees of nreplicates bootstrap replicates, computed from site
+        weights without copying the sequences.
+        """
+        assert isinstance(nreplicates, (int, long)), 'arg nreplicates wrong type'
+        assert isinstance(seed, (int, long)), 'arg seed wrong type'
+        _r = self.inst.get().get_bootstrap_trees((<size_t>nreplicates), (<size_t>seed), (<libcpp_string>method), alpha)
+        cdef list py_result = _r
+        return py_result
+
+    def get_bootstrap_support_tree(self, nreplicates, seed=1, bytes method=b'jc', double alpha=0):
+        """
+        BioNJ tree of the full alignment, with branch support from
+        nreplicates bootstrap replicates.
+        """
+        assert isinstance(nreplicates, (int, long)), 'arg nreplicates wrong type'
+        assert isinstance(seed, (int, long)), 'arg seed wrong type'
+        cdef libcpp_string _r = self.inst.get().get_bootstrap_support_tree((<size_t>nreplicates), (<size_t>seed), (<libcpp_string>method), alpha)
+        py_result = <libcpp_string>_r
+        return py_result
+
     def get_alpha(self):
         cdef double _r = self.inst.get().get_alpha()
         py_result = <double>_r
@@ -368,9 +691,51 @@ cdef class Alignment:
 
         self.inst.get().set_number_of_gamma_categories((<size_t>ncat))
 
-    def fast_compute_distances(self):
+    def _fast_compute_distances_0(self):
         self.inst.get().fast_compute_distances()
 
+    def _fast_compute_distances_1(self, bytes method, double alpha=0):
+        assert isinstance(method, bytes), 'arg method wrong type'
+        self.inst.get().fast_compute_distances((<libcpp_string>method), alpha)
+
+    def fast_compute_distances(self, *args):
+        """
+        With no arguments, Jukes-Cantor distances. Otherwise a method name
+        (jc, k2p, f84, tn93, logdet for DNA; jc, poisson, kimura for
+        protein) and optionally a gamma shape parameter.
+        """
+        if not args:
+            return self._fast_compute_distances_0(*args)
+        elif (len(args) in (1, 2)) and (isinstance(args[0], bytes)):
+            return self._fast_compute_distances_1(*args)
+        else:
+               raise Exception('can not handle type of %s' % (args,))
+
+    def compute_distances_range(self, first_pair, last_pair, bytes filename, bytes method=b'ml', double alpha=0):
+        """
+        Computes pairs [first_pair, last_pair) of the condensed pair index
+        space and writes them to a binary shard file.
+        """
+        assert isinstance(first_pair, (int, long)), 'arg first_pair wrong type'
+        assert isinstance(last_pair, (int, long)), 'arg last_pair wrong type'
+        self.inst.get().compute_distances_range((<size_t>first_pair), (<size_t>last_pair), (<libcpp_string>filename), (<libcpp_string>method), alpha)
+
+    def compute_distances_shard(self, shard, nshards, bytes filename, bytes method=b'ml', double alpha=0):
+        assert isinstance(shard, (int, long)), 'arg shard wrong type'
+        assert isinstance(nshards, (int, long)), 'arg nshards wrong type'
+        self.inst.get().compute_distances_shard((<size_t>shard), (<size_t>nshards), (<libcpp_string>filename), (<libcpp_string>method), alpha)
+
+    def merge_distance_shards(self, list filenames):
+        """
+        Loads the full distance and variance matrices from shard files.
+        Returns the number of pairs whose estimate did not converge.
+        """
+        assert isinstance(filenames, list) and all(isinstance(elemt_rec, bytes) for elemt_rec in filenames), 'arg filenames wrong type'
+        cdef libcpp_vector[libcpp_string] v0 = filenames
+        cdef size_t _r = self.inst.get().merge_distance_shards(v0)
+        py_result = <size_t>_r
+        return py_result
+
     def set_gamma_rate_model(self,  ncat , double alpha ):
         assert isinstance(ncat, (int, long)), 'arg ncat wrong type'
         assert isinstance(alpha, float), 'arg alpha wrong type'
@@ -410,6 +775,35 @@ cdef class Alignment:
         else:
                raise Exception('can not handle type of %s' % (args,))
 
+    def get_rapid_bionj_tree(self, max_megabytes=16):
+        assert isinstance(max_megabytes, (int, long)), 'arg max_megabytes wrong type'
+        cdef libcpp_string _r = self.inst.get().get_rapid_bionj_tree((<size_t>max_megabytes))
+        py_result = <libcpp_string>_r
+        return py_result
+
+    def get_bionj_visited_fraction(self):
+        cdef double _r = self.inst.get().get_bionj_visited_fraction()
+        py_result = <double>_r
+        return py_result
+
+    def get_bme_tree(self, max_rounds=100):
+        assert isinstance(max_rounds, (int, long)), 'arg max_rounds wrong type'
+        cdef libcpp_string _r = self.inst.get().get_bme_tree((<size_t>max_rounds))
+        py_result = <libcpp_string>_r
+        return py_result
+
+    def get_bme_lengths(self):
+        _r = self.inst.get().get_bme_lengths()
+        cdef list py_result = _r
+        return py_result
+
+    def get_bionj_phylo_tree(self):
+        return _wrap_phylo_tree(self.inst.get().get_bionj_phylo_tree())
+
+    def get_bme_phylo_tree(self, max_rounds=100):
+        assert isinstance(max_rounds, (int, long)), 'arg max_rounds wrong type'
+        return _wrap_phylo_tree(self.inst.get().get_bme_phylo_tree((<size_t>max_rounds)))
+
     def get_number_of_sequences(self):
         cdef size_t _r = self.inst.get().get_number_of_sequences()
         py_result = <size_t>_r
@@ -420,6 +814,21 @@ cdef class Alignment:
         py_result = <double>_r
         return py_result
 
+    def get_site_likelihoods(self):
+        """
+        (lnL of each site, rate category posteriors of each site) as numpy
+        arrays of shape (nsites,) and (nsites, ncat), from the same pass as
+        get_likelihood. Both view the C++ buffers directly.
+        """
+        cdef shared_ptr[_SiteLikelihoods] result = self.inst.get().get_site_likelihoods()
+        cdef SiteLikelihoodArray log_likelihoods = SiteLikelihoodArray.__new__(SiteLikelihoodArray)
+        cdef SiteLikelihoodArray posteriors = SiteLikelihoodArray.__new__(SiteLikelihoodArray)
+        log_likelihoods.inst = result
+        log_likelihoods.posteriors = False
+        posteriors.inst = result
+        posteriors.posteriors = True
+        return asarray(log_likelihoods), asarray(posteriors)
+
     def write_simulation(self,  nsites , bytes filename , bytes file_format ,  interleaved ):
         assert isinstance(nsites, (int, long)), 'arg nsites wrong type'
         assert isinstance(filename, bytes), 'arg filename wrong type'
@@ -431,10 +840,14 @@ cdef class Alignment:
 
         self.inst.get().write_simulation((<size_t>nsites), (<libcpp_string>filename), (<libcpp_string>file_format), (<bool>interleaved))
 
-    def set_simulator(self, bytes tree ):
-        assert isinstance(tree, bytes), 'arg tree wrong type'
-
-        self.inst.get().set_simulator((<libcpp_string>tree))
+    def set_simulator(self, tree ):
+        assert isinstance(tree, (bytes, PhyloTree)), 'arg tree wrong type'
+        cdef PhyloTree handle
+        if isinstance(tree, PhyloTree):
+            handle = tree
+            self.inst.get().set_simulator(deref(handle.inst.get()))
+        else:
+            self.inst.get().set_simulator((<libcpp_string>tree))
 
     def get_frequencies(self):
         _r = self.inst.get().get_frequencies()
@@ -535,3 +948,92 @@ cdef class Alignment:
             self._init_5(*args)
         else:
             raise Exception('can not handle type of %s' % (args,))
+
+cdef class AlignmentList:
+    """
+    Partitioned likelihood over several alignments: one tree with shared
+    branch lengths, and each alignment's own model and rates, which must be
+    set beforehand. Parameters are optimised on copies of the alignments
+    that share their models, so the originals' get_alpha, get_rates etc.
+    report the fitted values, and their likelihoods are refreshed to match.
+    """
+
+    cdef shared_ptr[_AlignmentList] inst
+
+    def __dealloc__(self):
+         self.inst.reset()
+
+    def __init__(self, list alignments):
+        assert all(isinstance(elemt_rec, Alignment) for elemt_rec in alignments), 'arg alignments wrong type'
+        cdef libcpp_vector[_Alignment] * v0 = new libcpp_vector[_Alignment]()
+        cdef Alignment item0
+        for item0 in alignments:
+            v0.push_back(deref(item0.inst.get()))
+        self.inst = shared_ptr[_AlignmentList](new _AlignmentList(deref(v0)))
+        del v0
+
+    def __len__(self):
+        return self.get_number_of_partitions()
+
+    def set_number_of_threads(self,  nthreads ):
+        """
+        Set the number of threads shared by all partitions (0 = all cores).
+        Takes effect at the next initialise_likelihood.
+        """
+        assert isinstance(nthreads, (int, long)), 'arg nthreads wrong type'
+        self.inst.get().set_number_of_threads((<size_t>nthreads))
+
+    def get_number_of_threads(self):
+        cdef size_t _r = self.inst.get().get_number_of_threads()
+        py_result = <size_t>_r
+        return py_result
+
+    def get_number_of_partitions(self):
+        cdef size_t _r = self.inst.get().get_number_of_partitions()
+        py_result = <size_t>_r
+        return py_result
+
+    def get_names(self):
+        _r = self.inst.get().get_names()
+        cdef list py_result = _r
+        return py_result
+
+    def _initialise_likelihood_0(self, bytes tree ):
+        self.inst.get().initialise_likelihood((<libcpp_string>tree))
+
+    def _initialise_likelihood_1(self, PhyloTree tree ):
+        self.inst.get().initialise_likelihood(deref(tree.inst.get()))
+
+    def initialise_likelihood(self, *args):
+        if (len(args)==1) and (isinstance(args[0], bytes)):
+            return self._initialise_likelihood_0(*args)
+        elif (len(args)==1) and (isinstance(args[0], PhyloTree)):
+            return self._initialise_likelihood_1(*args)
+        else:
+               raise Exception('can not handle type of %s' % (args,))
+
+    def optimise_branch_lengths(self):
+        self.inst.get().optimise_branch_lengths()
+
+    def optimise_parameters(self,  fix_branch_lengths ):
+        assert isinstance(fix_branch_lengths, (int, long)), 'arg fix_branch_lengths wrong type'
+        self.inst.get().optimise_parameters((<bool>fix_branch_lengths))
+
+    def get_likelihood(self):
+        cdef double _r = self.inst.get().get_likelihood()
+        py_result = <double>_r
+        return py_result
+
+    def get_partition_likelihoods(self):
+        _r = self.inst.get().get_partition_likelihoods()
+        cdef list py_result = _r
+        return py_result
+
+    def get_tree(self):
+        cdef libcpp_string _r = self.inst.get().get_tree()
+        py_result = <libcpp_string>_r
+        return py_result
+
+    def get_phylo_tree(self):
+        return _wrap_phylo_tree(self.inst.get().get_phylo_tree())
+
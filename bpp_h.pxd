@@ -2,6 +2,34 @@ from  libcpp.string  cimport string as libcpp_string
 from  libcpp.vector  cimport vector as libcpp_vector
 from  libcpp.pair    cimport pair   as libcpp_pair
 from  libcpp cimport bool
+from  smart_ptr cimport shared_ptr
+
+cdef extern from "src/CondensedMatrix.h":
+    cdef cppclass CondensedMatrix:
+        size_t size() except +
+        size_t get_number_of_pairs() except +
+        libcpp_vector[libcpp_string] get_names() except +
+        double* data()
+        void fill_square(double* out) except +
+
+cdef extern from "src/SiteLikelihoods.h":
+    cdef cppclass SiteLikelihoods:
+        size_t get_number_of_sites() except +
+        size_t get_number_of_categories() except +
+        double* log_likelihoods()
+        double* posteriors()
+
+cdef extern from "src/PhyloTree.h":
+    cdef cppclass PhyloTree:
+        PhyloTree() except +
+        PhyloTree(PhyloTree) except +
+        @staticmethod
+        PhyloTree from_newick(libcpp_string newick) except +
+        size_t get_number_of_leaves() except +
+        libcpp_vector[libcpp_string] get_leaf_names() except +
+        bool has_support() except +
+        libcpp_string to_newick() except +
+
 cdef extern from "src/Alignment.h":
     cdef cppclass Alignment:
         Alignment() except +
@@ -13,6 +41,8 @@ cdef extern from "src/Alignment.h":
         void read_alignment(libcpp_string filename, libcpp_string file_format, bool interleaved) except +
         void read_alignment(libcpp_string filename, libcpp_string file_format, libcpp_string datatype, bool interleaved) except +
         void sort_alignment(bool ascending) except +
+        void add_sequences(libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] headers_sequences) except +
+        void remove_sequences(libcpp_vector[libcpp_string] names) except +
         void write_alignment(libcpp_string filename, libcpp_string file_format, bool interleaved) except +
         void set_substitution_model(libcpp_string model_name) except +
         void set_gamma_rate_model(size_t ncat, double alpha) except +
@@ -23,9 +53,11 @@ cdef extern from "src/Alignment.h":
         void set_frequencies(libcpp_vector[double]) except +
         void set_namespace(libcpp_string name) except +
         void set_parameter(libcpp_string name, double) except +
+        void set_number_of_threads(size_t nthreads) except +
         libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] get_sequences() except +
         double get_alpha() except +
         size_t get_number_of_gamma_categories() except +
+        size_t get_number_of_threads() except +
         libcpp_vector[double] get_rates(libcpp_string order) except +
         libcpp_vector[double] get_rate_model_categories() except +
         libcpp_vector[double] get_frequencies() except +
@@ -35,6 +67,8 @@ cdef extern from "src/Alignment.h":
         double get_parameter(libcpp_string name) except +
         libcpp_vector[libcpp_string] get_parameter_names() except +
         libcpp_vector[libcpp_vector[double]] get_p_matrix(double time) except +
+        void fill_p_matrices(libcpp_vector[double] times, double* out) except +
+        size_t get_number_of_states() except +
         libcpp_vector[libcpp_vector[double]] get_q_matrix() except +
         libcpp_vector[libcpp_vector[double]] get_exchangeabilities() except +
         libcpp_string get_namespace() except +
@@ -56,40 +90,73 @@ cdef extern from "src/Alignment.h":
 
         # Distance
         void compute_distances() except +
+        void compute_distances(double screen_tolerance) except +
         void fast_compute_distances() except +
+        void fast_compute_distances(libcpp_string method, double alpha) except +
+        void compute_distances_range(size_t first_pair, size_t last_pair, libcpp_string filename, libcpp_string method, double alpha) except +
+        void compute_distances_shard(size_t shard, size_t nshards, libcpp_string filename, libcpp_string method, double alpha) except +
+        size_t merge_distance_shards(libcpp_vector[libcpp_string] filenames) except +
         void set_distance_matrix(libcpp_vector[libcpp_vector[double]] matrix) except +
         void set_variance_matrix(libcpp_vector[libcpp_vector[double]] matrix) except +
         libcpp_string get_bionj_tree() except +
         libcpp_string get_bionj_tree(libcpp_vector[libcpp_vector[double]] matrix) except +
+        libcpp_string get_rapid_bionj_tree(size_t max_megabytes) except +
+        double get_bionj_visited_fraction() except +
+        libcpp_string get_bme_tree(size_t max_rounds) except +
+        libcpp_vector[double] get_bme_lengths() except +
+        PhyloTree get_bionj_phylo_tree() except +
+        PhyloTree get_bme_phylo_tree(size_t max_rounds) except +
         libcpp_vector[libcpp_vector[double]] get_distances() except +
         libcpp_vector[libcpp_vector[double]] get_variances() except +
         libcpp_vector[libcpp_vector[double]] get_distance_variance_matrix() except +
+        shared_ptr[CondensedMatrix] get_condensed_distances() except +
+        shared_ptr[CondensedMatrix] get_condensed_variances() except +
+        void fill_distances(double* out) except +
+        void fill_variances(double* out) except +
+        void fill_distance_variance_matrix(double* out) except +
 
         # Likelihood
         void initialise_likelihood() except +
         void initialise_likelihood(libcpp_string tree) except +
+        void initialise_likelihood(PhyloTree tree) except +
         void optimise_branch_lengths() except +
+        void optimise_branch_lengths(libcpp_string method, bool polish) except +
+        libcpp_vector[double] get_optimisation_stats() except +
         void optimise_parameters(bool fix_branch_lengths) except +
-        void optimise_topology(bool fix_model_params) except +
+        void optimise_topology(bool fix_model_params, size_t spr_radius) except +
+        libcpp_vector[libcpp_vector[double]] get_topology_log() except +
+        libcpp_vector[libcpp_pair[libcpp_string, libcpp_vector[double]]] select_model(libcpp_string tree, libcpp_string criterion, bool skip) except +
+        libcpp_vector[libcpp_pair[libcpp_string, libcpp_vector[double]]] select_model(PhyloTree tree, libcpp_string criterion, bool skip) except +
         double get_likelihood() except +
+        shared_ptr[SiteLikelihoods] get_site_likelihoods() except +
         libcpp_string get_tree() except +
         libcpp_string get_abayes_tree() except +
+        PhyloTree get_phylo_tree() except +
+        PhyloTree get_abayes_phylo_tree() except +
+        libcpp_string get_alrt_tree(size_t nreplicates, size_t seed) except +
+        PhyloTree get_alrt_phylo_tree(size_t nreplicates, size_t seed) except +
 
         # Parsimony
         void initialise_parsimony(libcpp_string tree, bool verbose, bool include_gaps) except +
+        void initialise_parsimony(PhyloTree tree, bool verbose, bool include_gaps) except +
         int get_parsimony_score() except +
         libcpp_string get_parsimony_tree() except +
+        PhyloTree get_parsimony_phylo_tree() except +
         void optimise_parsimony(unsigned int verbose) except +
 
         # Simulator
         void write_simulation(size_t nsites, libcpp_string filename, libcpp_string file_format, bool interleaved) except +
         void set_simulator(libcpp_string tree) except +
+        void set_simulator(PhyloTree tree) except +
         libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] simulate(size_t nsites, libcpp_string tree) except +
+        libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] simulate(size_t nsites, PhyloTree tree) except +
         libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] simulate(size_t nsites) except +
         libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] get_simulated_sequences() except +
 
         # Bootstrap
         libcpp_vector[libcpp_pair[libcpp_string, libcpp_string]] get_bootstrapped_sequences() except +
+        libcpp_vector[libcpp_string] get_bootstrap_trees(size_t nreplicates, size_t seed, libcpp_string method, double alpha) except +
+        libcpp_string get_bootstrap_support_tree(size_t nreplicates, size_t seed, libcpp_string method, double alpha) except +
 
         # Misc
         libcpp_string get_mrp_supertree(libcpp_vector[libcpp_string]) except +
@@ -97,3 +164,18 @@ cdef extern from "src/Alignment.h":
         # Test
         void chkdst() except +
 
+cdef extern from "src/AlignmentList.h":
+    cdef cppclass AlignmentList:
+        AlignmentList(libcpp_vector[Alignment] alignments) except +
+        void set_number_of_threads(size_t nthreads) except +
+        size_t get_number_of_threads() except +
+        size_t get_number_of_partitions() except +
+        libcpp_vector[libcpp_string] get_names() except +
+        void initialise_likelihood(libcpp_string tree) except +
+        void initialise_likelihood(PhyloTree tree) except +
+        void optimise_branch_lengths() except +
+        void optimise_parameters(bool fix_branch_lengths) except +
+        double get_likelihood() except +
+        libcpp_vector[double] get_partition_likelihoods() except +
+        libcpp_string get_tree() except +
+        PhyloTree get_phylo_tree() except +
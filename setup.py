@@ -27,19 +27,38 @@ class my_build_ext(build_ext):
         build_ext.build_extensions(self)
 
 
-compile_args = ['-std=c++1y']
+compile_args = ['-std=c++1y', '-pthread']
+link_args = ['-pthread']
 
 data_dir = pkg_resources.resource_filename("autowrap", "data_files")
 
 ext = Extension("bpp",
                 sources = ['bpp.pyx',
                            'src/Alignment.cpp',
+                           'src/AlignmentList.cpp',
+                           'src/AnalyticDistances.cpp',
+                           'src/BalancedMinimumEvolution.cpp',
+                           'src/CondensedMatrix.cpp',
+                           'src/DistanceShard.cpp',
+                           'src/JointTableCache.cpp',
                            'src/ModelFactory.cpp',
-                           'src/SiteContainerBuilder.cpp'],
+                           'src/ModelSelection.cpp',
+                           'src/NeighbourJoining.cpp',
+                           'src/PackedSequences.cpp',
+                           'src/PairwiseLikelihood.cpp',
+                           'src/ParallelTreeLikelihood.cpp',
+                           'src/PhyloTree.cpp',
+                           'src/PruningKernels.cpp',
+                           'src/SiteBootstrap.cpp',
+                           'src/SiteContainerBuilder.cpp',
+                           'src/SiteLikelihoods.cpp',
+                           'src/ThreadPool.cpp',
+                           'src/TransitionMatrices.cpp'],
                 language="c++",
                 include_dirs = [data_dir],
                 libraries=['bpp-core', 'bpp-seq', 'bpp-phyl'],
                 extra_compile_args=compile_args,
+                extra_link_args=link_args,
                )
 
 setup(cmdclass={'build_ext':my_build_ext},
@@ -6,8 +6,17 @@
  */
 
 #include "Alignment.h"
+#include "AnalyticDistances.h"
+#include "BalancedMinimumEvolution.h"
+#include "DistanceShard.h"
+#include "JointTableCache.h"
+#include "ModelSelection.h"
 #include "SiteContainerBuilder.h"
 #include "ModelFactory.h"
+#include "NeighbourJoining.h"
+#include "PairwiseLikelihood.h"
+#include "SiteBootstrap.h"
+#include "TiledPairs.h"
 
 #include <Bpp/Numeric/Prob/GammaDiscreteDistribution.h>
 #include <Bpp/Numeric/Prob/ConstantDistribution.h>
@@ -28,11 +37,14 @@
 #include <Bpp/Seq/Container/SiteContainerIterator.h>
 #include <Bpp/Seq/Container/SequenceContainerTools.h>
 #include <Bpp/Seq/Container/SiteContainerTools.h>
+#include <Bpp/Seq/Container/VectorSequenceContainer.h>
 #include <Bpp/Seq/Io/Fasta.h>
 #include <Bpp/Seq/Io/Phylip.h>
 #include <Bpp/Seq/SiteTools.h>
 #include <Bpp/Seq/SymbolListTools.h>
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -46,22 +58,7 @@ using namespace std;
 #define VARMIN  0.000001
 #define DISTMAX  10000
 #define MIN_BRANCH_LENGTH 0.000001
-
-size_t getNumberOfDistinctPositionsWithoutGap(const SymbolList& l1, const SymbolList& l2) {
-      if (l1.getAlphabet()->getAlphabetType() != l2.getAlphabet()->getAlphabetType()) throw AlphabetMismatchException("SymbolListTools::getNumberOfDistinctPositions.", l1.getAlphabet(), l2.getAlphabet());
-      const Alphabet* alpha = l1.getAlphabet();
-      int gapCode = alpha->getGapCharacterCode();
-      size_t n = min(l1.size(), l2.size());
-      size_t count = 0;
-      for (size_t i = 0; i < n; i++) {
-          int x = l1[i];
-          int y = l2[i];
-          if (alpha->isUnresolved(x)) x = gapCode;
-          if (alpha->isUnresolved(x)) y = gapCode;
-          if (x != gapCode && y != gapCode && x != y) count++;
-      }
-      return count;
-}
+#define JOINT_TABLE_CACHE_BYTES (static_cast<size_t>(1) << 29)
 
 void ensure_minval_and_sum(std::vector<double>& v, double minval) {
     double added = 0;
@@ -142,6 +139,7 @@ void Alignment::read_alignment(string filename, string file_format, bool interle
     strip(filename);
     strip(file_format);
     sequences = SiteContainerBuilder::read_alignment(filename, file_format, interleaved);
+    _clear_sequence_caches();
     _clear_distances();
     _clear_likelihood();
 }
@@ -151,6 +149,7 @@ void Alignment::read_alignment(string filename, string file_format, string datat
     strip(file_format);
     strip(datatype);
     sequences = SiteContainerBuilder::read_alignment(filename, file_format, datatype, interleaved);
+    _clear_sequence_caches();
     _clear_distances();
     _clear_likelihood();
 }
@@ -158,6 +157,71 @@ void Alignment::read_alignment(string filename, string file_format, string datat
 void Alignment::sort_alignment(bool ascending) {
     if (!sequences) throw Exception("No sequences to sort");
     sequences = SiteContainerBuilder::construct_sorted_alignment(sequences.get(), ascending);
+    _clear_sequence_caches();
+    _clear_distances();
+}
+
+/*
+Appends sequences to the alignment. If distances were computed by
+compute_distances or either fast_compute_distances, only the pairs involving the
+new sequences are computed (with the current model), so the matrices stay
+ready for get_bionj_tree. Distances that were set by hand are dropped.
+*/
+void Alignment::add_sequences(vector<pair<string, string>>& headers_sequences) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    if (headers_sequences.empty()) return;
+    auto incoming = SiteContainerBuilder::construct_alignment_from_strings(headers_sequences, is_dna() ? "dna" : "protein");
+    if (incoming->getNumberOfSites() != sequences->getNumberOfSites()) throw Exception("New sequences are not the same length as the alignment");
+    vector<string> names = incoming->getSequencesNames();
+    for (auto& name : names) {
+        if (sequences->hasSequence(name)) throw Exception("Sequence already in alignment: " + name);
+    }
+    size_t first_new = sequences->getNumberOfSequences();
+    for (size_t k = 0; k < incoming->getNumberOfSequences(); ++k) {
+        sequences->addSequence(incoming->getSequence(k), true);
+    }
+    _clear_sequence_caches();
+    _clear_likelihood();
+    if (distances && _distance_method != DistanceMethod::NONE && _distance_method != DistanceMethod::USER) {
+        // Grow copies, so that buffers already exported from the old matrices stay valid
+        distances = make_shared<CondensedMatrix>(*distances);
+        variances = make_shared<CondensedMatrix>(*variances);
+        distances->add_names(names);
+        variances->add_names(names);
+        _extend_distances(first_new);
+    }
+    else {
+        _clear_distances();
+    }
+}
+
+// Removes sequences by name; the distances of the remaining pairs are kept
+void Alignment::remove_sequences(vector<string> names) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    vector<string> current = sequences->getSequencesNames();
+    vector<size_t> indices;
+    for (auto& name : names) {
+        auto it = find(current.begin(), current.end(), name);
+        if (it == current.end()) throw Exception("Sequence not in alignment: " + name);
+        size_t index = static_cast<size_t>(it - current.begin());
+        if (find(indices.begin(), indices.end(), index) != indices.end()) {
+            throw Exception("Sequence named more than once: " + name);
+        }
+        indices.push_back(index);
+    }
+    for (auto& name : names) {
+        sequences->deleteSequence(name);
+    }
+    _clear_sequence_caches();
+    _clear_likelihood();
+    if (distances) {
+        distances = make_shared<CondensedMatrix>(*distances);
+        distances->remove(indices);
+    }
+    if (variances) {
+        variances = make_shared<CondensedMatrix>(*variances);
+        variances->remove(indices);
+    }
 }
 
 void Alignment::write_alignment(string filename, string file_format, bool interleaved) {
@@ -179,7 +243,7 @@ void Alignment::set_substitution_model(string model_name) {
     strip(model_name);
     if (sequences) _check_compatible_model(model_name);
     model = ModelFactory::create(model_name);
-    _clear_likelihood();
+    _update_likelihood_model();
 }
 
 void Alignment::set_gamma_rate_model(size_t ncat, double alpha) {
@@ -190,24 +254,25 @@ void Alignment::set_gamma_rate_model(size_t ncat, double alpha) {
     else {
         rates = make_shared<GammaDiscreteDistribution>(ncat, alpha, alpha, 1e-12, 1e-12);
         rates->aliasParameters("alpha", "beta");
+        _update_likelihood_model();
     }
-    _clear_likelihood();
 }
 
 void Alignment::set_constant_rate_model() {
     rates = make_shared<ConstantDistribution>(1.0);
+    _update_likelihood_model();
 }
 
 void Alignment::set_alpha(double alpha) {
     if(!rates) throw Exception("No rate model is set");
     rates->setParameterValue("alpha", alpha);
-    _clear_likelihood();
+    _update_likelihood_model();
 }
 
 void Alignment::set_number_of_gamma_categories(size_t ncat) {
     if (!rates) throw Exception("No rate model is set");
     rates->setNumberOfCategories(ncat);
-    _clear_likelihood();
+    _update_likelihood_model();
 }
 
 void Alignment::set_rates(vector<double>& rates, string order) {
@@ -246,7 +311,7 @@ void Alignment::set_rates(vector<double>& rates, string order) {
         piG = theta2 * theta;
         piT = (1. - theta1) * (1. - theta);
         model = make_shared<GTR>(&AlphabetTools::DNA_ALPHABET, a, b, c, d, e, piA, piC, piG, piT);
-        _clear_likelihood();
+        _update_likelihood_model();
     }
 }
 
@@ -261,7 +326,7 @@ void Alignment::set_frequencies(vector<double> freqs) {
         model = ModelFactory::create(model->getName(), freqs);
     }
     model->setFreq(m);
-    _clear_likelihood();
+    _update_likelihood_model();
 }
 
 void Alignment::set_namespace(string name) {
@@ -271,6 +336,15 @@ void Alignment::set_namespace(string name) {
     //_clear_likelihood();
 }
 
+void Alignment::set_number_of_threads(size_t nthreads) {
+    nthreads = ThreadPool::resolve_number_of_threads(nthreads);
+    if (nthreads != _num_threads) {
+        _num_threads = nthreads;
+        _pool.reset();
+        if (_tree_likelihood) _tree_likelihood->set_thread_pool(&_get_thread_pool());
+    }
+}
+
 double Alignment::get_alpha() {
     if (rates) return rates->getParameterValue("alpha");
     else throw Exception("Gamma distributed rate model not set");
@@ -281,6 +355,10 @@ size_t Alignment::get_number_of_gamma_categories() {
     else throw Exception("Rate model not set");
 }
 
+size_t Alignment::get_number_of_threads() {
+    return _num_threads;
+}
+
 vector<double> Alignment::get_rates(string order) {
     if(!model) throw Exception("Model not set");
     if(model->getAlphabet()->getAlphabetType() != "DNA alphabet") {
@@ -354,8 +432,8 @@ vector<string> Alignment::get_names() {
 
 unique_ptr<ParameterList> Alignment::_get_parameter_list() {
     auto pl = make_unique<ParameterList>();
-    if (likelihood) {
-        pl->addParameters(likelihood->getParameters());
+    if (_tree_likelihood) {
+        pl->addParameters(_get_likelihood().getParameters());
     }
     else {
         if (rates) {
@@ -374,11 +452,21 @@ vector<string> Alignment::get_parameter_names() {
 }
 
 void Alignment::set_parameter(string name, double value) {
+    if (_tree_likelihood) {
+        ParameterList pl = _get_model_parameters();
+        if (pl.hasParameter(name)) {
+            pl.setParameterValue(name, value);
+            rates->matchParametersValues(pl);
+            model->matchParametersValues(pl);
+            _update_likelihood_model();
+            return;
+        }
+    }
     ParameterList pl;
     enum class THING{LIKELIHOOD, RATES, MODEL};  // The 'thing' to update after setting parameter
     THING thing;
-    if (likelihood) {
-        pl = likelihood->getParameters();
+    if (_tree_likelihood) {
+        pl = _get_likelihood().getParameters();
         thing = THING::LIKELIHOOD;
     }
     else if (rates) {
@@ -397,6 +485,7 @@ void Alignment::set_parameter(string name, double value) {
         switch (thing) {
         case THING::LIKELIHOOD:
             likelihood->setParametersValues(pl);
+            _tree_likelihood_stale = true;
             break;
 
         case THING::RATES:
@@ -416,9 +505,12 @@ void Alignment::set_parameter(string name, double value) {
 }
 
 double Alignment::get_parameter(string name) {
-    ParameterList pl;
-    if (likelihood) {
-        pl = likelihood->getParameters();
+    ParameterList pl = _get_model_parameters();
+    if (pl.hasParameter(name)) {
+        return pl.getParameterValue(name);
+    }
+    if (_tree_likelihood) {
+        pl = _get_likelihood().getParameters();
     }
     else if (rates) {
         pl = rates->getIndependentParameters();
@@ -439,7 +531,8 @@ double Alignment::get_parameter(string name) {
 
 double Alignment::test_nni(int nodeid) {
     // Checks:
-    if (!likelihood) throw Exception("This instance has no likelihood model");
+    if (!_tree_likelihood) throw Exception("This instance has no likelihood model");
+    _get_likelihood();
     int num_nodes = likelihood->getTree().getNumberOfNodes() - 1;
     if (nodeid > num_nodes) {
         stringstream ss;
@@ -453,7 +546,8 @@ double Alignment::test_nni(int nodeid) {
 
 void Alignment::do_nni(int nodeid) {
     // Checks:
-    if (!likelihood) throw Exception("This instance has no likelihood model");
+    if (!_tree_likelihood) throw Exception("This instance has no likelihood model");
+    _get_likelihood();
     int num_nodes = likelihood->getTree().getNumberOfNodes() - 1;
     if (nodeid > num_nodes) {
         stringstream ss;
@@ -462,19 +556,22 @@ void Alignment::do_nni(int nodeid) {
     }
     // OK
     likelihood->doNNI(nodeid);
+    _tree_likelihood_stale = true;
 }
 
 void Alignment::commit_topology() {
     // Checks:
-    if (!likelihood) throw Exception("This instance has no likelihood model");
+    if (!_tree_likelihood) throw Exception("This instance has no likelihood model");
     // OK
 
-    likelihood->topologyChangePerformed(TopologyChangeEvent());
+    _get_likelihood().topologyChangePerformed(TopologyChangeEvent());
+    _tree_likelihood_stale = true;
 }
 
 void Alignment::_print_node(int nodeid) {
     // Checks:
-    if (!likelihood) throw Exception("This instance has no likelihood model");
+    if (!_tree_likelihood) throw Exception("This instance has no likelihood model");
+    _get_likelihood();
     int num_nodes = likelihood->getTree().getNumberOfNodes() - 1;
     if (nodeid > num_nodes) {
         stringstream ss;
@@ -517,16 +614,22 @@ size_t Alignment::get_number_of_distinct_sites() {
 
 vector<vector<double>> Alignment::get_p_matrix(double time) {
     if(!model) throw Exception("No model has been set.");
-    RowMatrix<double> pijt = model->getPij_t(time);
-    size_t nrow = pijt.getNumberOfRows();
-    size_t ncol = pijt.getNumberOfColumns();
-    auto p = vector<vector<double>>(nrow, vector<double>(ncol, 0));
-    for (size_t i = 0; i < nrow; ++i) {
-        for (size_t j = 0; j < ncol; ++j) {
-            p[i][j] = pijt(i, j);
-        }
-    }
-    return p;
+    return _get_transition_matrices().get(time);
+}
+
+/*
+P(t) for each of times into out, row-major, one nstates x nstates matrix
+after another. Recent matrices are cached until the model's parameters
+change.
+*/
+void Alignment::fill_p_matrices(const vector<double>& times, double* out) {
+    if(!model) throw Exception("No model has been set.");
+    _get_transition_matrices().fill(times, out);
+}
+
+size_t Alignment::get_number_of_states() {
+    if(!model) throw Exception("No model has been set.");
+    return model->getNumberOfStates();
 }
 
 
@@ -598,16 +701,15 @@ size_t Alignment::get_number_of_informative_sites(bool exclude_gaps) {
 }
 
 size_t Alignment::get_number_of_free_parameters() {
-    if (!likelihood) throw Exception("Likelihood model not initialised");
-    ParameterList pl = likelihood->getBranchLengthsParameters();
-    pl.addParameters(model->getIndependentParameters());
+    if (!_tree_likelihood) throw Exception("Likelihood model not initialised");
+    ParameterList pl = model->getIndependentParameters();
     if (rates->getName() == "Gamma") pl.addParameters(rates->getIndependentParameters());
-    return pl.size();
+    return _get_tree_likelihood().get_number_of_branches() + pl.size();
 }
 
 void Alignment::_print_params() {
-    if (likelihood) {
-        ParameterList pl = likelihood->getParameters();
+    if (_tree_likelihood) {
+        ParameterList pl = _get_likelihood().getParameters();
         pl.printParameters(cout);
     }
     else if (rates && model) {
@@ -627,71 +729,294 @@ bool Alignment::is_protein() {
 }
 
 // Distance
+/*
+Pairs are walked in tiles of 8 x 8 sequences and 4096-site chunks, so the
+chunk of codes for the 16 sequences of a tile stays in cache while the joint
+tables of its 64 pairs are filled in.
+*/
 void Alignment::compute_distances() {
+    compute_distances(0);
+}
+
+/*
+ML distances under the current model. The first call counts the joint code
+table of every pair from the sequences and keeps a sparse copy (up to
+JOINT_TABLE_CACHE_BYTES); later calls, e.g. after the model parameters have
+changed, re-estimate from the copy instead, starting Newton from the previous
+estimate. With screen_tolerance > 0, a pair whose first Newton step from its
+previous estimate is shorter than screen_tolerance keeps that estimate.
+*/
+void Alignment::compute_distances(double screen_tolerance) {
     if (!sequences) throw Exception("This instance has no sequences");
     if (!model) throw Exception("No model of evolution available");
     if (!rates) throw Exception("No rate model available");
-    VectorSiteContainer* sites_ = sequences->clone();
-    SiteContainerTools::changeGapsToUnknownCharacters(*sites_);
-    size_t n = sites_->getNumberOfSequences();
+    PackedSequences& packed = _get_packed_sequences();
+    size_t n = packed.get_number_of_sequences();
+    size_t ncodes = packed.get_number_of_codes();
+    size_t npairs = n > 1 ? n * (n - 1) / 2 : 0;
+    PairwiseLikelihood pairwise(*model, *rates, packed.get_code_masks());
+    ThreadPool& pool = _get_thread_pool();
     vector<string> names = get_names();
-    double var;
+    auto new_distances = make_shared<CondensedMatrix>(names);
+    auto new_variances = make_shared<CondensedMatrix>(names);
+    auto new_warm_start = make_shared<CondensedMatrix>(names);
+    shared_ptr<CondensedMatrix> warm_start = _warm_start && _warm_start->size() == n ? _warm_start : nullptr;
+    vector<vector<size_t>> cells(pool.size());
+    vector<vector<double>> counts(pool.size());
+
+    // Every pair writes to its own cell, so no locking is needed
+    auto estimate_pair = [&](size_t i, size_t j, size_t d, size_t g, size_t t) {
+        double previous = warm_start ? (*warm_start)(i, j) : NAN;
+        bool warm = !std::isnan(previous);
+        double initial = warm ? previous : (g == 0 ? MIN_BRANCH_LENGTH : static_cast<double>(d) / static_cast<double>(g));
+        DistanceEstimate estimate = pairwise.estimate(cells[t], counts[t], initial, 1e-6, warm ? screen_tolerance : 0);
+        new_distances->set(i, j, estimate.distance);
+        new_variances->set(i, j, max(estimate.variance, VARMIN));
+        new_warm_start->set(i, j, estimate.converged ? estimate.distance : NAN);
+    };
+
+    if (_joint_tables && _joint_tables->is_complete()) {
+        shared_ptr<JointTableCache> cache = _joint_tables;
+        pool.parallel_for(0, npairs, [&](size_t k, size_t t) {
+            size_t i, j, d, g;
+            CondensedMatrix::pair_from_index(k, n, i, j);
+            cache->load(k, cells[t], counts[t], d, g);
+            estimate_pair(i, j, d, g, t);
+        });
+    }
+    else {
+        auto cache = make_shared<JointTableCache>(npairs, pool.size(), JOINT_TABLE_CACHE_BYTES);
+        TiledPairs tiles(n, packed.get_number_of_sites(), 8, 4096, pool.size());
+        size_t nslots = tiles.get_number_of_slots();
+        vector<vector<double>> tables(pool.size() * nslots, vector<double>(ncodes * ncodes));
+        vector<size_t> diffs(pool.size() * nslots), comps(pool.size() * nslots);
+        tiles.run(pool,
+            [&](size_t i, size_t j, size_t first, size_t last, size_t slot, size_t t) {
+                size_t s = t * nslots + slot;
+                packed.count_joint(i, j, first, last, tables[s]);
+                packed.count_differences(i, j, first / 64, (last + 63) / 64, diffs[s], comps[s]);
+            },
+            [&](size_t i, size_t j, size_t slot, size_t t) {
+                size_t s = t * nslots + slot;
+                cache->store(CondensedMatrix::index(i, j, n), t, tables[s], diffs[s], comps[s]);
+                PairwiseLikelihood::nonzero_cells(tables[s], cells[t], counts[t]);
+                estimate_pair(i, j, diffs[s], comps[s], t);
+                fill(tables[s].begin(), tables[s].end(), 0);
+                diffs[s] = comps[s] = 0;
+            });
+        _joint_tables = cache->is_complete() ? cache : nullptr;
+    }
 
     _clear_distances();
-    distances = make_shared<DistanceMatrix>(names);
-    variances = make_shared<DistanceMatrix>(names);
-    for (size_t i = 0; i < n; i++) {
-        (*distances)(i, i) = 0;
-        for (size_t j = i + 1; j < n; j++) {
-            auto lik = make_shared<TwoTreeLikelihood>(names[i], names[j], *sites_, model.get(), rates.get(), false);
-            lik->initialize();
-            lik->enableDerivatives(true);
-            size_t d = SymbolListTools::getNumberOfDistinctPositions(sites_->getSequence(i), sites_->getSequence(j));
-            size_t g = SymbolListTools::getNumberOfPositionsWithoutGap(sites_->getSequence(i), sites_->getSequence(j));
-            lik->setParameterValue("BrLen", g == 0 ? lik->getMinimumBranchLength() : std::max(lik->getMinimumBranchLength(), static_cast<double>(d) / static_cast<double>(g)));
-            // Optimization:
-            ParameterList params = lik->getBranchLengthsParameters();
-            OptimizationTools::optimizeNumericalParameters(lik.get(), params, 0, 1, 0.000001, 1000000, NULL, NULL, false, 0, OptimizationTools::OPTIMIZATION_NEWTON, OptimizationTools::OPTIMIZATION_BRENT);
-            // Store results:
-            (*distances)(i, j) = (*distances)(j, i) = lik->getParameterValue("BrLen");
-            var = 1.0 / lik->d2f("BrLen", params);
-            (*variances)(i, j) = (*variances)(j, i) = var > VARMIN ? var : VARMIN;
-        }
-    }
-    delete sites_;
+    distances = new_distances;
+    variances = new_variances;
+    _warm_start = new_warm_start;
+    _distance_method = DistanceMethod::ML;
 }
 
+/*
+Tiles of 32 x 32 sequences and 64-word (4096-site) chunks keep the bit planes
+of a tile in L1/L2 while all of its pairs are counted.
+*/
 void Alignment::fast_compute_distances() {
     if (!sequences) throw Exception("This instance has no sequences");
-    unsigned int s;
-    if (is_dna()) {
-        s = 4;
+    PackedSequences& packed = _get_packed_sequences();
+    double s = static_cast<double>(packed.get_number_of_states());
+    size_t n = packed.get_number_of_sequences();
+    ThreadPool& pool = _get_thread_pool();
+    TiledPairs tiles(n, packed.get_number_of_words(), 32, 64, pool.size());
+    size_t nslots = tiles.get_number_of_slots();
+    vector<size_t> diffs(pool.size() * nslots), comps(pool.size() * nslots);
+
+    _clear_distances();
+    distances = make_shared<CondensedMatrix>(get_names());
+    variances = make_shared<CondensedMatrix>(get_names());
+    tiles.run(pool,
+        [&](size_t i, size_t j, size_t first, size_t last, size_t slot, size_t t) {
+            size_t k = t * nslots + slot;
+            packed.count_differences(i, j, first, last, diffs[k], comps[k]);
+        },
+        [&](size_t i, size_t j, size_t slot, size_t t) {
+            size_t k = t * nslots + slot;
+            _set_jc_distance(i, j, diffs[k], comps[k], s);
+            diffs[k] = comps[k] = 0;
+        });
+    _distance_method = DistanceMethod::FAST;
+}
+
+/*
+Closed-form distances selected by name: "jc", "k2p", "f84", "tn93", "logdet"
+for DNA, and "jc", "poisson", "kimura" for protein. A positive alpha applies
+the gamma-corrected form (except for LogDet). F84 and TN93 use the empirical
+base frequencies of the alignment.
+Methods that need only the number of differences use the same bit-plane
+counts as fast_compute_distances(); the others fill joint code tables in
+8 x 8-sequence tiles of 4096 sites, as compute_distances does.
+*/
+void Alignment::fast_compute_distances(string method, double alpha) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    strip(method);
+    PackedSequences& packed = _get_packed_sequences();
+    size_t n = packed.get_number_of_sequences();
+    vector<double> freqs = is_dna() ? get_empirical_frequencies() : vector<double>();
+    auto analytic = make_shared<AnalyticDistances>(method, packed.get_code_masks(), packed.get_number_of_states(), alpha, freqs);
+    ThreadPool& pool = _get_thread_pool();
+
+    _clear_distances();
+    distances = make_shared<CondensedMatrix>(get_names());
+    variances = make_shared<CondensedMatrix>(get_names());
+    if (analytic->needs_joint_counts()) {
+        size_t ncodes = packed.get_number_of_codes();
+        TiledPairs tiles(n, packed.get_number_of_sites(), 8, 4096, pool.size());
+        size_t nslots = tiles.get_number_of_slots();
+        vector<vector<double>> tables(pool.size() * nslots, vector<double>(ncodes * ncodes));
+        tiles.run(pool,
+            [&](size_t i, size_t j, size_t first, size_t last, size_t slot, size_t t) {
+                packed.count_joint(i, j, first, last, tables[t * nslots + slot]);
+            },
+            [&](size_t i, size_t j, size_t slot, size_t t) {
+                vector<double>& table = tables[t * nslots + slot];
+                _set_analytic_distance(i, j, analytic->from_joint_counts(table));
+                fill(table.begin(), table.end(), 0);
+            });
     }
-    if (is_protein()) {
-        s = 20;
+    else {
+        TiledPairs tiles(n, packed.get_number_of_words(), 32, 64, pool.size());
+        size_t nslots = tiles.get_number_of_slots();
+        vector<size_t> diffs(pool.size() * nslots), comps(pool.size() * nslots);
+        tiles.run(pool,
+            [&](size_t i, size_t j, size_t first, size_t last, size_t slot, size_t t) {
+                size_t k = t * nslots + slot;
+                packed.count_differences(i, j, first, last, diffs[k], comps[k]);
+            },
+            [&](size_t i, size_t j, size_t slot, size_t t) {
+                size_t k = t * nslots + slot;
+                _set_analytic_distance(i, j, analytic->from_differences(diffs[k], comps[k]));
+                diffs[k] = comps[k] = 0;
+            });
+    }
+    _analytic_distances = analytic;
+    _distance_method = DistanceMethod::ANALYTIC;
+}
+
+/*
+Computes the pairs [first_pair, last_pair) of the condensed pair index space
+and writes them to a shard file, leaving this instance's distances alone.
+method is "ml" (the current model and rate distribution, as in
+compute_distances) or any fast_compute_distances method, with alpha.
+*/
+void Alignment::compute_distances_range(size_t first_pair, size_t last_pair, string filename, string method, double alpha) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    strip(filename);
+    strip(method);
+    PackedSequences& packed = _get_packed_sequences();
+    size_t n = packed.get_number_of_sequences();
+    size_t ncodes = packed.get_number_of_codes();
+    DistanceShard shard(get_names(), first_pair, last_pair, method, _distance_settings(method, alpha));
+    vector<ShardRecord>& records = shard.get_records();
+    records.resize(last_pair - first_pair);
+    ThreadPool& pool = _get_thread_pool();
+    vector<vector<double>> tables(pool.size(), vector<double>(ncodes * ncodes));
+
+    if (method == "ml" || method == "ML") {
+        if (!model) throw Exception("No model of evolution available");
+        if (!rates) throw Exception("No rate model available");
+        PairwiseLikelihood pairwise(*model, *rates, packed.get_code_masks());
+        pool.parallel_for(first_pair, last_pair, [&](size_t k, size_t t) {
+            size_t i, j, d, g;
+            CondensedMatrix::pair_from_index(k, n, i, j);
+            vector<double>& table = tables[t];
+            fill(table.begin(), table.end(), 0);
+            packed.count_joint(i, j, table);
+            packed.count_differences(i, j, d, g);
+            DistanceEstimate estimate = _ml_estimate(pairwise, table, d, g);
+            records[k - first_pair] = {k, estimate.distance, estimate.variance, estimate.converged};
+        });
     }
-    size_t n = sequences->getNumberOfSequences();
-    vector<string> names = sequences->getSequencesNames();
-    if (distances) distances.reset();
-    distances = make_shared<DistanceMatrix>(names);
-    variances = make_shared<DistanceMatrix>(names);
-    for (size_t i = 0; i < n; i++) {
-        (*distances)(i, i) = 0;
-        for (size_t j=i+1; j < n; j++) {
-            size_t d = getNumberOfDistinctPositionsWithoutGap(sequences->getSequence(i), sequences->getSequence(j));
-            size_t g = SymbolListTools::getNumberOfPositionsWithoutGap(sequences->getSequence(i), sequences->getSequence(j));
-//            cout << sequences->getSequence(i).toString() << endl << sequences->getSequence(j).toString() << endl;
-            double dist = _jcdist(d, g, s);
-            double var = _jcvar(d, g, s);
-            (*distances)(i, j) = (*distances)(j, i) = dist;
-            (*variances)(i, j) = (*variances)(j, i) = var;
-        }
+    else {
+        vector<double> freqs = is_dna() ? get_empirical_frequencies() : vector<double>();
+        AnalyticDistances analytic(method, packed.get_code_masks(), packed.get_number_of_states(), alpha, freqs);
+        bool joint = analytic.needs_joint_counts();
+        pool.parallel_for(first_pair, last_pair, [&](size_t k, size_t t) {
+            size_t i, j, d, g;
+            CondensedMatrix::pair_from_index(k, n, i, j);
+            DistanceEstimate estimate;
+            if (joint) {
+                vector<double>& table = tables[t];
+                fill(table.begin(), table.end(), 0);
+                packed.count_joint(i, j, table);
+                estimate = analytic.from_joint_counts(table);
+            }
+            else {
+                packed.count_differences(i, j, d, g);
+                estimate = analytic.from_differences(d, g);
+            }
+            records[k - first_pair] = {k, estimate.distance, estimate.variance, estimate.converged};
+        }, joint ? 1 : 64);
+    }
+    shard.write(filename);
+}
+
+/*
+What distances from method depend on besides the sequences, for a shard
+header: the model, rate distribution and their parameter values for ML, and
+alpha otherwise. Values are written to full precision.
+*/
+string Alignment::_distance_settings(string method, double alpha) {
+    ostringstream settings;
+    settings.precision(17);
+    if (method != "ml" && method != "ML") {
+        settings << "alpha=" << alpha;
+        return settings.str();
+    }
+    if (!model) throw Exception("No model of evolution available");
+    if (!rates) throw Exception("No rate model available");
+    settings << model->getName();
+    const ParameterList& model_parameters = model->getParameters();
+    for (size_t i = 0; i < model_parameters.size(); ++i) {
+        settings << " " << model_parameters[i].getName() << "=" << model_parameters[i].getValue();
+    }
+    settings << "; " << rates->getName() << " categories=" << rates->getNumberOfCategories();
+    const ParameterList& rate_parameters = rates->getParameters();
+    for (size_t i = 0; i < rate_parameters.size(); ++i) {
+        settings << " " << rate_parameters[i].getName() << "=" << rate_parameters[i].getValue();
     }
+    return settings.str();
+}
+
+// Shard number `shard` (from 0) of nshards near-equal ranges of pairs
+void Alignment::compute_distances_shard(size_t shard, size_t nshards, string filename, string method, double alpha) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    size_t n = sequences->getNumberOfSequences();
+    size_t first_pair, last_pair;
+    DistanceShard::shard_range(n > 1 ? n * (n - 1) / 2 : 0, shard, nshards, first_pair, last_pair);
+    compute_distances_range(first_pair, last_pair, filename, method, alpha);
+}
+
+/*
+Assembles shard files into the distance and variance matrices, after checking
+they were computed from these sequences and cover every pair exactly once.
+Returns the number of pairs whose estimate did not converge. The result is
+treated like a user-supplied matrix, so add_sequences will not extend it.
+*/
+size_t Alignment::merge_distance_shards(vector<string> filenames) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    for (auto& filename : filenames) strip(filename);
+    vector<string> names = get_names();
+    auto merged_distances = make_shared<CondensedMatrix>(names);
+    auto merged_variances = make_shared<CondensedMatrix>(names);
+    size_t nonconverged = DistanceShard::merge(filenames, names, *merged_distances, *merged_variances);
+    _clear_distances();
+    distances = merged_distances;
+    variances = merged_variances;
+    _distance_method = DistanceMethod::USER;
+    return nonconverged;
 }
 
 void Alignment::set_distance_matrix(vector<vector<double>> matrix) {
     try {
         distances = _create_distance_matrix(matrix);
+        _distance_method = DistanceMethod::USER;
     }
     catch (Exception &e) {
         cout << e.what() << endl;
@@ -722,25 +1047,82 @@ void Alignment::chkdst() {
 }
 
 string Alignment::get_bionj_tree() {
+    return get_bionj_phylo_tree().to_newick();
+}
+
+PhyloTree Alignment::get_bionj_phylo_tree() {
     if (!distances) throw Exception("No distances have been calculated yet");
-    if (!variances) return _computeTree(*distances, *distances);
-    return _computeTree(*distances, *variances);
+    NeighbourJoining nj(*distances, variances ? *variances : *distances, &_get_thread_pool());
+    PhyloTree tree = nj.get_phylo_tree();
+    _bionj_visited_fraction = nj.get_visited_fraction();
+    return tree;
 }
 
 string Alignment::get_bionj_tree(vector<vector<double>> matrix) {
-    shared_ptr<DistanceMatrix> dm = _create_distance_matrix(matrix);
-    return _computeTree(*dm, *dm);
+    shared_ptr<CondensedMatrix> dm = _create_distance_matrix(matrix);
+    NeighbourJoining nj(*dm, *dm, &_get_thread_pool());
+    string tree = nj.get_tree();
+    _bionj_visited_fraction = nj.get_visited_fraction();
+    return tree;
+}
+
+/*
+The same tree as get_bionj_tree, found with the RapidNJ bounded search,
+which skips most of the criterion matrix on large inputs. Each row's sorted
+distances share max_megabytes, but every row keeps at least 64 entries
+(1KB per sequence). Longer lists cost more to sort than they save once past
+a few hundred entries; see NeighbourJoining.
+*/
+string Alignment::get_rapid_bionj_tree(size_t max_megabytes) {
+    if (!distances) throw Exception("No distances have been calculated yet");
+    NeighbourJoining nj(*distances, variances ? *variances : *distances, &_get_thread_pool());
+    nj.set_bounded_search(max_megabytes << 20);
+    string tree = nj.get_tree();
+    _bionj_visited_fraction = nj.get_visited_fraction();
+    return tree;
+}
+
+// Share of the pairs scanned by the last BioNJ tree (1 for get_bionj_tree)
+double Alignment::get_bionj_visited_fraction() {
+    return _bionj_visited_fraction;
+}
+
+/*
+Balanced minimum evolution tree, refined by NNI and SPR moves from the BioNJ
+tree for up to max_rounds rounds. Needs (2n - 2)^2 doubles of working
+memory, which is 128MB at 2000 sequences. With fewer than three sequences
+there is nothing to rearrange and the BioNJ tree is returned.
+*/
+string Alignment::get_bme_tree(size_t max_rounds) {
+    return get_bme_phylo_tree(max_rounds).to_newick();
+}
+
+PhyloTree Alignment::get_bme_phylo_tree(size_t max_rounds) {
+    if (!distances) throw Exception("No distances have been calculated yet");
+    NeighbourJoining nj(*distances, variances ? *variances : *distances, &_get_thread_pool());
+    if (distances->size() < 3) {
+        _bme_lengths.clear();
+        return nj.get_phylo_tree();
+    }
+    BalancedMinimumEvolution bme(*distances, nj.get_edges());
+    bme.optimise(max_rounds);
+    _bme_lengths = bme.get_lengths();
+    return bme.get_phylo_tree();
+}
+
+// BME tree length of the BioNJ start, then after each round of the last get_bme_tree
+vector<double> Alignment::get_bme_lengths() {
+    return _bme_lengths;
 }
 
 vector<vector<double>> Alignment::get_distances() {
     if(!distances) throw Exception("No distances have been calculated yet");
     vector<vector<double>> vec;
-    vector<string> names = sequences->getSequencesNames();
     size_t nrow = distances->size();
     for (size_t i = 0; i < nrow; ++i) {
         vector<double> row;
         for (size_t j = 0; j < nrow; ++j) {
-            row.push_back((*distances)(names[i], names[j]));
+            row.push_back((*distances)(i, j));
         }
         vec.push_back(row);
     }
@@ -750,12 +1132,11 @@ vector<vector<double>> Alignment::get_distances() {
 vector<vector<double>> Alignment::get_variances() {
     if(!variances) throw Exception("No distances have been calculated yet");
     vector<vector<double>> vec;
-    vector<string> names = sequences->getSequencesNames();
     size_t nrow = variances->size();
     for (size_t i = 0; i < nrow; ++i) {
         vector<double> row;
         for (size_t j = 0; j < nrow; ++j) {
-            row.push_back((*variances)(names[i], names[j]));
+            row.push_back((*variances)(i, j));
         }
         vec.push_back(row);
     }
@@ -765,24 +1146,59 @@ vector<vector<double>> Alignment::get_variances() {
 vector<vector<double>> Alignment::get_distance_variance_matrix() {
     if(!variances || !distances) throw Exception("No distances have been calculated yet");
     vector<vector<double>> vec;
-    vector<string> names = sequences->getSequencesNames();
     size_t nrow = variances->size();
     for (size_t i = 0; i < nrow; ++i) {
         vector<double> row;
         for (size_t j = 0; j < nrow; ++j) {
-            if (j < i) row.push_back((*variances)(names[i], names[j]));
-            else row.push_back((*distances)(names[i], names[j]));
+            if (j < i) row.push_back((*variances)(i, j));
+            else row.push_back((*distances)(i, j));
         }
         vec.push_back(row);
     }
     return vec;
 }
 
+/*
+The condensed matrices are shared, not copied, so callers can wrap the buffer
+without a copy. Alignment never resizes a matrix it has handed out: new
+distances go into a new matrix, so an exported buffer stays valid.
+*/
+shared_ptr<CondensedMatrix> Alignment::get_condensed_distances() {
+    if(!distances) throw Exception("No distances have been calculated yet");
+    return distances;
+}
+
+shared_ptr<CondensedMatrix> Alignment::get_condensed_variances() {
+    if(!variances) throw Exception("No distances have been calculated yet");
+    return variances;
+}
+
+// Square matrices written straight into a caller-owned n x n row-major buffer
+void Alignment::fill_distances(double* out) {
+    if(!distances) throw Exception("No distances have been calculated yet");
+    distances->fill_square(out);
+}
+
+void Alignment::fill_variances(double* out) {
+    if(!variances) throw Exception("No distances have been calculated yet");
+    variances->fill_square(out);
+}
+
+void Alignment::fill_distance_variance_matrix(double* out) {
+    if(!variances || !distances) throw Exception("No distances have been calculated yet");
+    distances->fill_square(out);
+    variances->fill_lower(out);
+}
+
 // Likelihood
+/*
+Starts from the BioNJ tree of the current distances. For a BME start, pass
+get_bme_phylo_tree() to initialise_likelihood(tree) instead.
+*/
 void Alignment::initialise_likelihood() {
     if (!distances) fast_compute_distances();
     try {
-        initialise_likelihood(get_bionj_tree());
+        initialise_likelihood(get_bionj_phylo_tree());
     }
     catch (Exception& e) {
         cerr << e.what();
@@ -791,7 +1207,10 @@ void Alignment::initialise_likelihood() {
 }
 
 void Alignment::initialise_likelihood(string tree) {
-    strip(tree);
+    initialise_likelihood(PhyloTree::from_newick(tree));
+}
+
+void Alignment::initialise_likelihood(const PhyloTree& tree) {
     if (!model) {
         cerr << "Model not set" << endl;
         throw Exception("Model not set error");
@@ -804,104 +1223,206 @@ void Alignment::initialise_likelihood(string tree) {
         cerr << "No sequences" << endl;
         throw Exception("This instance has no sequences");
     }
-    unique_ptr<Tree> liktree;
-    auto reader = make_shared<Newick>(false);
-    if (_is_file(tree)) {
-        liktree = unique_ptr<Tree>(reader->read(tree));
-    }
-    else if (_is_tree_string(tree)) {
-        stringstream ss{tree};
-        liktree = unique_ptr<Tree>(reader->read(ss));
-    }
-    else {
-        cerr << "Couldn\'t understand this tree: " << tree << endl;
-        throw Exception("Tree error");
+    _clear_likelihood();
+    _tree_likelihood = make_shared<ParallelTreeLikelihood>(_get_packed_sequences(), get_names(), tree, model, rates, &_get_thread_pool());
+}
+
+/*
+Sets up the likelihood as one partition of a larger analysis (see
+AlignmentList): the leaves are the sequences named in names, in that order,
+with any this alignment lacks given unknown characters throughout, and the
+work runs on pool, which replaces this alignment's own.
+*/
+void Alignment::initialise_likelihood(const PhyloTree& tree, const vector<string>& names, shared_ptr<ThreadPool> pool) {
+    if (!model) throw Exception("Model not set error");
+    if (!rates) throw Exception("Rates not set error");
+    if (!sequences) throw Exception("This instance has no sequences");
+    const Alphabet* alphabet = sequences->getAlphabet();
+    size_t nsites = sequences->getNumberOfSites();
+    VectorSequenceContainer padded(alphabet);
+    for (auto& name : names) {
+        if (sequences->hasSequence(name)) {
+            padded.addSequence(sequences->getSequence(name), false);
+        }
+        else {
+            BasicSequence missing(name, vector<int>(nsites, alphabet->getUnknownCharacterCode()), alphabet);
+            padded.addSequence(missing, false);
+        }
     }
-    auto sites_ = make_unique<CompressedVectorSiteContainer>(*sequences);
-    SiteContainerTools::changeGapsToUnknownCharacters(*sites_);
-    likelihood = make_shared<NNIHomogeneousTreeLikelihood>(*liktree, *sites_, model.get(), rates.get(), true, false);
-    likelihood->initialize();
+    _clear_likelihood();
+    _pool = pool;
+    _num_threads = pool->size();
+    PackedSequences packed{VectorSiteContainer(padded)};
+    _tree_likelihood = make_shared<ParallelTreeLikelihood>(packed, names, tree, model, rates, _pool.get());
 }
 
 void Alignment::optimise_branch_lengths() {
-    if (!likelihood) {
+    if (!_tree_likelihood) {
         cerr << "Likelihood calculator not set - call initialise_likelihood" << endl;
         throw Exception("Uninitialised likelihood error");
     }
-    ParameterList pl;
-    pl = likelihood->getBranchLengthsParameters();
-    OptimizationTools::optimizeNumericalParameters2(likelihood.get(), pl, 0, 0.001, 1000000, NULL, NULL, false, false, 10);
+    _get_tree_likelihood().optimise_branch_lengths(0.001);
+    likelihood.reset();
 }
 
-void Alignment::optimise_parameters(bool fix_branch_lengths) {
-    if (!likelihood) {
-        cerr << "Likelihood calculator not set - call initialise_likelihood" << endl;
-        throw Exception("Uninitialised likelihood error");
+/*
+Optimises the branch lengths by method: "newton", sweeps of per-branch Newton
+steps, or "lbfgs", all lengths at once by projected L-BFGS on the analytic
+gradient, finished with a Newton sweep if polish is set.
+*/
+void Alignment::optimise_branch_lengths(string method, bool polish) {
+    if (!_tree_likelihood) {
+        throw Exception("Likelihood calculator not set - call initialise_likelihood");
     }
-    ParameterList pl;
-    if (fix_branch_lengths) {
-        pl = likelihood->getSubstitutionModelParameters();
-        pl.addParameters(likelihood->getRateDistributionParameters());
+    if (method == "newton") {
+        _get_tree_likelihood().optimise_branch_lengths(0.001);
+    }
+    else if (method == "lbfgs") {
+        _get_tree_likelihood().optimise_branch_lengths_lbfgs(0.001, 1000, polish);
     }
     else {
-        pl = likelihood->getParameters();
+        throw Exception("Unrecognised branch length optimisation method: " + method);
     }
-    OptimizationTools::optimizeNumericalParameters2(likelihood.get(), pl, 0, 0.001, 1000000, NULL, NULL, false, false, 10);
+    likelihood.reset();
 }
 
-void Alignment::optimise_topology(bool fix_model_params) {
-    if (!likelihood) {
+/*
+What the last branch length optimisation cost: the final lnL, the L-BFGS
+iterations and Newton sweeps, the full likelihood evaluations, gradient
+evaluations and single-branch evaluations, and the seconds taken.
+*/
+vector<double> Alignment::get_optimisation_stats() {
+    if (!_tree_likelihood) {
+        throw Exception("Likelihood calculator not set - call initialise_likelihood");
+    }
+    const OptimisationStats& stats = _tree_likelihood->get_optimisation_stats();
+    return {stats.log_likelihood, static_cast<double>(stats.iterations), static_cast<double>(stats.sweeps),
+            static_cast<double>(stats.evaluations), static_cast<double>(stats.gradients),
+            static_cast<double>(stats.branch_evaluations), stats.seconds};
+}
+
+void Alignment::optimise_parameters(bool fix_branch_lengths) {
+    if (!_tree_likelihood) {
         cerr << "Likelihood calculator not set - call initialise_likelihood" << endl;
         throw Exception("Uninitialised likelihood error");
     }
-    ParameterList pl = likelihood->getBranchLengthsParameters();
+    _get_tree_likelihood().optimise_parameters(fix_branch_lengths, 0.001);
+    likelihood.reset();
+}
+
+/*
+Topology search by NNI, and by SPR within spr_radius branches if that is not
+zero, run in parallel by the likelihood engine. Unless the model parameters
+are fixed, rounds of parameter optimisation and topology search alternate
+until lnL stops improving. Each round of the search is appended to the
+topology log, which is cleared first.
+*/
+void Alignment::optimise_topology(bool fix_model_params, size_t spr_radius) {
+    if (!_tree_likelihood) {
+        cerr << "Likelihood calculator not set - call initialise_likelihood" << endl;
+        throw Exception("Uninitialised likelihood error");
+    }
+    ParallelTreeLikelihood& tree_likelihood = _get_tree_likelihood();
+    tree_likelihood.clear_topology_log();
+    double lnl = tree_likelihood.optimise_topology(spr_radius, 0.001);
     if (!fix_model_params) {
-        pl.addParameters(model->getIndependentParameters());
-        if (rates->getName() == "Gamma") pl.addParameters(rates->getIndependentParameters());
+        while (true) {
+            double before = lnl;
+            tree_likelihood.optimise_parameters(false, 0.001);
+            lnl = tree_likelihood.optimise_topology(spr_radius, 0.001);
+            if (lnl - before < 0.001) break;
+        }
+    }
+    likelihood.reset();
+}
+
+/*
+One row per round of the last optimise_topology: lnL at the end of the round,
+the number of improving moves found, the number of NNI and of SPR moves
+applied, and the seconds since its search started.
+*/
+vector<vector<double>> Alignment::get_topology_log() {
+    if (!_tree_likelihood) {
+        throw Exception("Likelihood calculator not set - call initialise_likelihood");
     }
-    likelihood = make_shared<NNIHomogeneousTreeLikelihood>(*OptimizationTools::optimizeTreeNNI2(likelihood.get(), pl, true, 0.001, 0.1, 1000000, 1, NULL, NULL, false, 10));
+    vector<vector<double>> log;
+    for (const TopologyRound& round : _tree_likelihood->get_topology_log()) {
+        log.push_back({round.log_likelihood, static_cast<double>(round.improving_moves), static_cast<double>(round.nni_moves),
+                static_cast<double>(round.spr_moves), round.seconds});
+    }
+    return log;
+}
+
+vector<pair<string, vector<double>>> Alignment::select_model(string tree, string criterion, bool skip) {
+    return select_model(PhyloTree::from_newick(tree), criterion, skip);
+}
+
+/*
+Fits every model for this alphabet, with and without +G (and +F, for
+proteins), on the topology of tree, in parallel, leaving this alignment's
+own model and likelihood alone. One row per candidate, best first by
+criterion ("aic", "aicc" or "bic"): lnL, number of parameters, AIC, AICc and
+BIC, all but the count NaN for a candidate skipped because it could not win
+(see ModelSelection).
+*/
+vector<pair<string, vector<double>>> Alignment::select_model(const PhyloTree& tree, string criterion, bool skip) {
+    if (!sequences) throw Exception("This instance has no sequences");
+    vector<double> freqs = get_empirical_frequencies();
+    ensure_minval_and_sum(freqs, 1.1e-6);
+    ModelSelection selection(_get_packed_sequences(), get_names(), tree, freqs, &_get_thread_pool());
+    vector<pair<string, vector<double>>> rows;
+    for (const ModelFit& fit : selection.run(criterion, skip)) {
+        rows.push_back({fit.name, {fit.log_likelihood, static_cast<double>(fit.parameters), fit.aic, fit.aicc, fit.bic}});
+    }
+    return rows;
 }
 
 double Alignment::get_likelihood() {
-    if (!likelihood) {
+    if (!_tree_likelihood) {
         cerr << "Likelihood calculator not set - call initialise_likelihood" << endl;
         throw Exception("Uninitialised likelihood error");
     }
-    return likelihood->getLogLikelihood();
+    return _get_tree_likelihood().get_log_likelihood();
+}
+
+/*
+lnL of each site, in alignment order, and the posterior probabilities of the
+rate categories at each site, from the same pass as get_likelihood.
+*/
+shared_ptr<SiteLikelihoods> Alignment::get_site_likelihoods() {
+    if (!_tree_likelihood) {
+        throw Exception("Likelihood calculator not set - call initialise_likelihood");
+    }
+    ParallelTreeLikelihood& tree_likelihood = _get_tree_likelihood();
+    auto result = make_shared<SiteLikelihoods>(tree_likelihood.get_number_of_sites(), tree_likelihood.get_number_of_categories());
+    tree_likelihood.fill_site_likelihoods(result->log_likelihoods(), result->posteriors());
+    return result;
 }
 
 string Alignment::get_tree() {
-    if (!likelihood) {
+    return get_phylo_tree().to_newick();
+}
+
+PhyloTree Alignment::get_phylo_tree() {
+    if (!_tree_likelihood) {
         throw Exception("Likelihood calculator not set - call initialise_likelihood");
     }
-    string s = TreeTools::treeToParenthesis(likelihood->getTree());
-    s.erase(s.find_last_not_of(" \n\r\t")+1);
-    return s;
+    return _get_tree_likelihood().get_phylo_tree();
 }
 
 // Parsimony
 void Alignment::initialise_parsimony(string tree, bool verbose, bool include_gaps) {
+    initialise_parsimony(PhyloTree::from_newick(tree), verbose, include_gaps);
+}
+
+void Alignment::initialise_parsimony(const PhyloTree& tree, bool verbose, bool include_gaps) {
     if (!sequences) {
         cerr << "No sequences" << endl;
         throw Exception("This instance has no sequences");
     }
-    unique_ptr<Tree> liktree;
-    auto reader = make_shared<Newick>(false);
-    if (_is_file(tree)) {
-        liktree = unique_ptr<Tree>(reader->read(tree));
-    }
-    else if (_is_tree_string(tree)) {
-        stringstream ss{tree};
-        liktree = unique_ptr<Tree>(reader->read(ss));
-    }
-    else {
-        cerr << "Couldn\'t understand this tree: " << tree << endl;
-        throw Exception("Tree error");
-    }
-    strip(tree);
     auto sites_ = make_unique<CompressedVectorSiteContainer>(*sequences);
     SiteContainerTools::changeGapsToUnknownCharacters(*sites_);
-    parsimony = make_shared<DRTreeParsimonyScore>(*liktree, *sites_, verbose, include_gaps);
+    parsimony = make_shared<DRTreeParsimonyScore>(tree.get_tree(), *sites_, verbose, include_gaps);
 }
 
 unsigned int Alignment::get_parsimony_score() {
@@ -920,6 +1441,13 @@ string Alignment::get_parsimony_tree() {
     return s;
 }
 
+PhyloTree Alignment::get_parsimony_phylo_tree() {
+    if (!parsimony) {
+        throw Exception("Parsimony calculator not set - call initialise_parsimony");
+    }
+    return PhyloTree(new TreeTemplate<Node>(parsimony->getTree()));
+}
+
 void Alignment::optimise_parsimony(unsigned int verbose) {
     parsimony = make_shared<DRTreeParsimonyScore>(*OptimizationTools::optimizeTreeNNI(parsimony.get(), verbose));
 }
@@ -941,6 +1469,10 @@ void Alignment::write_simulation(size_t nsites, string filename, string file_for
 }
 
 void Alignment::set_simulator(string tree) {
+    set_simulator(PhyloTree::from_newick(tree));
+}
+
+void Alignment::set_simulator(const PhyloTree& tree) {
     if (!model) {
         cerr << "Model not set" << endl;
         throw exception();
@@ -949,20 +1481,7 @@ void Alignment::set_simulator(string tree) {
         cerr << "Rates not set" << endl;
         throw exception();
     }
-    unique_ptr<Tree> simtree;
-    unique_ptr<Newick> reader = make_unique<Newick>(false);
-    if (_is_file(tree)) {
-        simtree = unique_ptr<Tree>(reader->read(tree));
-    }
-    else if (_is_tree_string(tree)) {
-        stringstream ss{tree};
-        simtree = unique_ptr<Tree>(reader->read(ss));
-    }
-    else {
-        cerr << "Couldn\'t understand this tree: " << tree << endl;
-        throw exception();
-    }
-    simulator = make_shared<HomogeneousSequenceSimulator>(model.get(), rates.get(), simtree.get());
+    simulator = make_shared<HomogeneousSequenceSimulator>(model.get(), rates.get(), &tree.get_tree());
 }
 
 vector<pair<string, string>> Alignment::simulate(size_t nsites, string tree) {
@@ -970,6 +1489,11 @@ vector<pair<string, string>> Alignment::simulate(size_t nsites, string tree) {
     return simulate(nsites);
 }
 
+vector<pair<string, string>> Alignment::simulate(size_t nsites, const PhyloTree& tree) {
+    set_simulator(tree);
+    return simulate(nsites);
+}
+
 vector<pair<string, string>> Alignment::simulate(size_t nsites) {
     if (!simulator) {
         cout << "Tried to simulate without a simulator" << endl;
@@ -1018,6 +1542,31 @@ vector<pair<string, string>> Alignment::get_bootstrapped_sequences() {
 }
 
 // Misc
+/*
+BioNJ trees of nreplicates bootstrap replicates, drawn from a generator seeded
+with seed. Distances use method: "ml" or any fast_compute_distances method.
+Replicates are site weights, so no sequences are copied; see _bootstrap_trees.
+*/
+vector<string> Alignment::get_bootstrap_trees(size_t nreplicates, size_t seed, string method, double alpha) {
+    vector<string> trees;
+    for (auto& tree : _bootstrap_trees(nreplicates, seed, method, alpha, false)) trees.push_back(tree.to_newick());
+    return trees;
+}
+
+/*
+BioNJ tree of the full alignment, with each branch labelled by the percentage
+of bootstrap replicate trees that contain it.
+*/
+string Alignment::get_bootstrap_support_tree(size_t nreplicates, size_t seed, string method, double alpha) {
+    vector<PhyloTree> trees = _bootstrap_trees(nreplicates + 1, seed, method, alpha, true);
+    // computeBootstrapValues only reads the replicates
+    vector<Tree*> replicates;
+    for (size_t b = 1; b < trees.size(); ++b) replicates.push_back(const_cast<TreeTemplate<Node>*>(&trees[b].get_tree()));
+    auto reference = unique_ptr<TreeTemplate<Node>>(new TreeTemplate<Node>(trees[0].get_tree()));
+    TreeTools::computeBootstrapValues(*reference, replicates, false);
+    return PhyloTree(reference.release(), true).to_newick();
+}
+
 string Alignment::get_mrp_supertree(vector<string> trees) {
     vector<Tree*> input_trees;
     stringstream ss;
@@ -1112,12 +1661,269 @@ void Alignment::_clear_distances() {
     if (variances) {
         variances.reset();
     }
+    _distance_method = DistanceMethod::NONE;
+    _analytic_distances.reset();
+}
+
+/*
+Fills in the pairs (i, j) with j >= first_new, using the method that produced
+the existing distances. This is the O(k.n) part of add_sequences.
+*/
+void Alignment::_extend_distances(size_t first_new) {
+    PackedSequences& packed = _get_packed_sequences();
+    size_t n = packed.get_number_of_sequences();
+    ThreadPool& pool = _get_thread_pool();
+    size_t nrows = n - first_new;
+    if (_distance_method == DistanceMethod::ML) {
+        size_t ncodes = packed.get_number_of_codes();
+        PairwiseLikelihood pairwise(*model, *rates, packed.get_code_masks());
+        vector<vector<double>> tables(pool.size(), vector<double>(ncodes * ncodes));
+        pool.parallel_for(0, nrows * n, [&](size_t k, size_t t) {
+            size_t j = first_new + k / n, i = k % n;
+            if (i >= j) return;
+            size_t d, g;
+            vector<double>& table = tables[t];
+            fill(table.begin(), table.end(), 0);
+            packed.count_joint(i, j, table);
+            packed.count_differences(i, j, d, g);
+            _set_ml_distance(pairwise, i, j, table, d, g);
+        });
+    }
+    else if (_distance_method == DistanceMethod::ANALYTIC && _analytic_distances->needs_joint_counts()) {
+        // New sequences can bring new ambiguity codes, which widen the joint tables
+        _analytic_distances = make_shared<AnalyticDistances>(*_analytic_distances, packed.get_code_masks());
+        size_t ncodes = packed.get_number_of_codes();
+        vector<vector<double>> tables(pool.size(), vector<double>(ncodes * ncodes));
+        pool.parallel_for(0, nrows * n, [&](size_t k, size_t t) {
+            size_t j = first_new + k / n, i = k % n;
+            if (i >= j) return;
+            vector<double>& table = tables[t];
+            fill(table.begin(), table.end(), 0);
+            packed.count_joint(i, j, table);
+            _set_analytic_distance(i, j, _analytic_distances->from_joint_counts(table));
+        });
+    }
+    else if (_distance_method == DistanceMethod::ANALYTIC) {
+        pool.parallel_for(0, nrows * n, [&](size_t k, size_t) {
+            size_t j = first_new + k / n, i = k % n;
+            if (i >= j) return;
+            size_t d, g;
+            packed.count_differences(i, j, d, g);
+            _set_analytic_distance(i, j, _analytic_distances->from_differences(d, g));
+        }, 64);
+    }
+    else {
+        double s = static_cast<double>(packed.get_number_of_states());
+        pool.parallel_for(0, nrows * n, [&](size_t k, size_t) {
+            size_t j = first_new + k / n, i = k % n;
+            if (i >= j) return;
+            size_t d, g;
+            packed.count_differences(i, j, d, g);
+            _set_jc_distance(i, j, d, g, s);
+        }, 64);
+    }
+}
+
+/*
+Every pair's site-pattern data is visited once per batch of replicates:
+SiteBootstrap fills the weighted tables of all replicates in the batch in one
+pass, and the distances of each replicate are estimated from those. Batches
+are sized so their matrices take about 256MB. The trees of a batch are then
+built in parallel.
+*/
+vector<PhyloTree> Alignment::_bootstrap_trees(size_t nreplicates, size_t seed, string method, double alpha, bool include_original) {
+    if (!sequences) throw Exception("No sequences to bootstrap.");
+    strip(method);
+    PackedSequences& packed = _get_packed_sequences();
+    size_t n = packed.get_number_of_sequences();
+    size_t ncodes = packed.get_number_of_codes();
+    if (n < 3) throw Exception("Bootstrap trees need at least three sequences");
+    bool ml = method == "ml" || method == "ML";
+    unique_ptr<PairwiseLikelihood> pairwise;
+    unique_ptr<AnalyticDistances> analytic;
+    if (ml) {
+        if (!model) throw Exception("No model of evolution available");
+        if (!rates) throw Exception("No rate model available");
+        pairwise = unique_ptr<PairwiseLikelihood>(new PairwiseLikelihood(*model, *rates, packed.get_code_masks()));
+    }
+    else {
+        vector<double> freqs = is_dna() ? get_empirical_frequencies() : vector<double>();
+        analytic = unique_ptr<AnalyticDistances>(new AnalyticDistances(method, packed.get_code_masks(),
+                packed.get_number_of_states(), alpha, freqs));
+    }
+    bool joint = ml || analytic->needs_joint_counts();
+    SiteBootstrap bootstrap(packed, nreplicates, seed, include_original);
+    ThreadPool& pool = _get_thread_pool();
+    vector<string> names = get_names();
+    size_t npairs = n * (n - 1) / 2;
+    size_t batch = max(static_cast<size_t>(1), min(nreplicates, (static_cast<size_t>(1) << 28) / (npairs * 2 * sizeof(double))));
+    vector<PhyloTree> trees(nreplicates);
+
+    for (size_t first = 0; first < nreplicates; first += batch) {
+        size_t last = min(first + batch, nreplicates);
+        size_t nb = last - first;
+        vector<CondensedMatrix> dists(nb, CondensedMatrix(names));
+        vector<CondensedMatrix> vars(nb, CondensedMatrix(names));
+        vector<vector<double>> tables(pool.size(), vector<double>(joint ? ncodes * ncodes * nb : 0));
+        vector<vector<double>> table(pool.size(), vector<double>(ncodes * ncodes));
+        vector<vector<double>> diffs(pool.size(), vector<double>(nb)), comps(pool.size(), vector<double>(nb));
+        pool.parallel_for(0, npairs, [&](size_t k, size_t t) {
+            size_t i, j;
+            CondensedMatrix::pair_from_index(k, n, i, j);
+            fill(diffs[t].begin(), diffs[t].end(), 0);
+            fill(comps[t].begin(), comps[t].end(), 0);
+            if (joint) {
+                fill(tables[t].begin(), tables[t].end(), 0);
+                bootstrap.count_joint(i, j, first, last, tables[t]);
+            }
+            if (!joint || ml) bootstrap.count_differences(i, j, first, last, diffs[t], comps[t]);
+            for (size_t b = 0; b < nb; ++b) {
+                size_t d = static_cast<size_t>(diffs[t][b]), g = static_cast<size_t>(comps[t][b]);
+                DistanceEstimate estimate;
+                if (joint) {
+                    for (size_t c = 0; c < table[t].size(); ++c) table[t][c] = tables[t][c * nb + b];
+                    estimate = ml ? _ml_estimate(*pairwise, table[t], d, g) : analytic->from_joint_counts(table[t]);
+                }
+                else {
+                    estimate = analytic->from_differences(d, g);
+                }
+                dists[b].set(i, j, estimate.distance);
+                vars[b].set(i, j, estimate.variance);
+            }
+        });
+        pool.parallel_for(0, nb, [&](size_t b, size_t) {
+            trees[first + b] = NeighbourJoining(dists[b], vars[b]).get_phylo_tree();
+        });
+    }
+    return trees;
+}
+
+// ML estimate from a joint table, starting from the p-distance
+DistanceEstimate Alignment::_ml_estimate(const PairwiseLikelihood& pairwise, const vector<double>& table, size_t d, size_t g) {
+    double initial = g == 0 ? MIN_BRANCH_LENGTH : static_cast<double>(d) / static_cast<double>(g);
+    DistanceEstimate estimate = pairwise.estimate(table, initial);
+    if (estimate.variance < VARMIN) estimate.variance = VARMIN;
+    return estimate;
+}
+
+// Drops everything derived from the sequences themselves
+void Alignment::_clear_sequence_caches() {
+    packed_sequences.reset();
+    _joint_tables.reset();
+    _warm_start.reset();
+}
+
+void Alignment::_set_ml_distance(const PairwiseLikelihood& pairwise, size_t i, size_t j, const vector<double>& table, size_t d, size_t g) {
+    DistanceEstimate estimate = _ml_estimate(pairwise, table, d, g);
+    distances->set(i, j, estimate.distance);
+    variances->set(i, j, estimate.variance);
+}
+
+void Alignment::_set_analytic_distance(size_t i, size_t j, const DistanceEstimate& estimate) {
+    distances->set(i, j, estimate.distance);
+    variances->set(i, j, estimate.variance);
+}
+
+void Alignment::_set_jc_distance(size_t i, size_t j, size_t d, size_t g, double s) {
+    distances->set(i, j, _jcdist(d, g, s));
+    variances->set(i, j, _jcvar(d, g, s));
+}
+
+// The P(t) service for the current model, made again if the model object has been replaced
+TransitionMatrices& Alignment::_get_transition_matrices() {
+    if (!_transition_matrices || _transition_matrices->get_model() != model) {
+        _transition_matrices = make_shared<TransitionMatrices>(model);
+    }
+    return *_transition_matrices;
+}
+
+/*
+The independent parameters of the rate distribution and substitution model,
+which can be read and set without going through the bpp likelihood.
+*/
+ParameterList Alignment::_get_model_parameters() {
+    ParameterList pl;
+    if (rates) {
+        pl.addParameters(rates->getIndependentParameters());
+    }
+    if (model) {
+        pl.addParameters(model->getIndependentParameters());
+    }
+    return pl;
+}
+
+/*
+Passes a new model or rate distribution, or new values of their parameters,
+to the likelihood engine, which keeps its tree and compressed patterns and
+only recomputes the transition matrices. Topology changes made through the
+bpp likelihood are synced first; the bpp likelihood is then dropped, to be
+rebuilt on next use.
+*/
+void Alignment::_update_likelihood_model() {
+    if (!_tree_likelihood) return;
+    _get_tree_likelihood().set_model(model, rates);
+    likelihood.reset();
 }
 
 void Alignment::_clear_likelihood() {
     if (likelihood) {
         likelihood.reset();
     }
+    _tree_likelihood.reset();
+    _tree_likelihood_stale = false;
+}
+
+/*
+The bpp likelihood, used for parameter access by name and for the NNI
+methods. It is rebuilt from _tree_likelihood after anything that changed the
+tree or parameters there.
+*/
+NNIHomogeneousTreeLikelihood& Alignment::_get_likelihood() {
+    if (!_tree_likelihood) throw Exception("Likelihood calculator not set - call initialise_likelihood");
+    if (!likelihood) {
+        PhyloTree tree = _tree_likelihood->get_phylo_tree();
+        auto sites_ = make_unique<CompressedVectorSiteContainer>(*sequences);
+        SiteContainerTools::changeGapsToUnknownCharacters(*sites_);
+        likelihood = make_shared<NNIHomogeneousTreeLikelihood>(tree.get_tree(), *sites_, model.get(), rates.get(), true, false);
+        likelihood->initialize();
+    }
+    return *likelihood;
+}
+
+/*
+The multithreaded likelihood, for callers that change it directly, such as
+AlignmentList. The bpp likelihood is rebuilt from it when next needed.
+*/
+ParallelTreeLikelihood& Alignment::get_tree_likelihood() {
+    ParallelTreeLikelihood& tree_likelihood = _get_tree_likelihood();
+    likelihood.reset();
+    return tree_likelihood;
+}
+
+/*
+Brings both likelihoods up to date with the model and rates after their
+parameters were changed through another Alignment sharing them, as
+AlignmentList's copies do. Unlike _update_likelihood_model, this keeps the
+likelihood objects, which other copies of this Alignment may share.
+*/
+void Alignment::refresh_likelihood_model() {
+    if (_tree_likelihood) _tree_likelihood->update_model();
+    if (likelihood) {
+        ParameterList pl = likelihood->getParameters();
+        pl.matchParametersValues(_get_model_parameters());
+        likelihood->setParametersValues(pl);
+    }
+}
+
+// The multithreaded likelihood, brought up to date with changes made through the bpp one
+ParallelTreeLikelihood& Alignment::_get_tree_likelihood() {
+    if (!_tree_likelihood) throw Exception("Likelihood calculator not set - call initialise_likelihood");
+    if (_tree_likelihood_stale) {
+        _tree_likelihood->set_tree(PhyloTree(new TreeTemplate<Node>(likelihood->getTree())));
+        _tree_likelihood->update_model();
+        _tree_likelihood_stale = false;
+    }
+    return *_tree_likelihood;
 }
 
 /*
@@ -1144,194 +1950,58 @@ double Alignment::_jcvar(double d, double g, double s) {
     return var > VARMIN ? var : VARMIN;
 }
 
-shared_ptr<DistanceMatrix> Alignment::_create_distance_matrix(vector<vector<double>> matrix) {
+shared_ptr<CondensedMatrix> Alignment::_create_distance_matrix(vector<vector<double>> matrix) {
     if (!sequences) throw Exception("This instance has no sequences");
     size_t n = sequences->getNumberOfSequences();
     if (matrix.size() != n) throw Exception("Matrix wrong size error");
     vector<string> names = sequences->getSequencesNames();
-    auto dm = make_shared<DistanceMatrix>(names);
+    auto dm = make_shared<CondensedMatrix>(names);
     for (size_t i=0; i < matrix.size(); ++i) {
         auto row = matrix[i];
         for (size_t j=i+1; j < row.size(); ++j) {
-            (*dm)(i, j) = (*dm)(j, i) = row[j];
+            dm->set(i, j, row[j]);
         }
     }
     return dm;
 }
 
-bool Alignment::_is_file(string filename) {
-    ifstream fl(filename.c_str());
-    bool result = true;
-    if (!fl) {
-        result = false;
-    }
-    fl.close();
-    return result;
+PackedSequences& Alignment::_get_packed_sequences() {
+    if (!sequences) throw Exception("This instance has no sequences");
+    if (!packed_sequences) packed_sequences = make_shared<PackedSequences>(*sequences);
+    return *packed_sequences;
 }
 
-bool Alignment::_is_tree_string(string tree_string) {
-    size_t l = tree_string.length();
-    return (tree_string[0]=='(' && tree_string[l-1]==';');
+ThreadPool& Alignment::_get_thread_pool() {
+    if (!_pool) _pool = make_shared<ThreadPool>(_num_threads);
+    return *_pool;
 }
 
-string Alignment::_computeTree(DistanceMatrix dists, DistanceMatrix vars) throw (Exception) {
-    // Initialization:
-    std::map<size_t, Node*> currentNodes_;
-    std::vector<double> sumDist_(dists.size());
-    double lambda_;
-
-    for (size_t i = 0; i < dists.size(); i++) {
-        currentNodes_[i] = new Node(static_cast<int>(i), dists.getName(i));
-    }
-    int idNextNode = dists.size();
-    vector<double> newDist(dists.size());
-    vector<double> newVar(dists.size());
-
-    // Build tree:
-    while (currentNodes_.size() > 3) {
-        // get best pair
-        for (std::map<size_t, Node*>::iterator i = currentNodes_.begin(); i != currentNodes_.end(); i++) {
-            size_t id = i->first;
-            sumDist_[id] = 0;
-            for (map<size_t, Node*>::iterator j = currentNodes_.begin(); j != currentNodes_.end(); j++) {
-                size_t jd = j->first;
-                sumDist_[id] += dists(id, jd);
-            }
-        }
-        vector<size_t> bestPair(2);
-        double critMax = std::log(0.);
-        for (map<size_t, Node*>::iterator i = currentNodes_.begin(); i != currentNodes_.end(); i++) {
-            size_t id = i->first;
-            map<size_t, Node*>::iterator j = i;
-            j++;
-            for ( ; j != currentNodes_.end(); j++) {
-                size_t jd = j->first;
-                double crit = sumDist_[id] + sumDist_[jd] - static_cast<double>(currentNodes_.size() - 2) * dists(id, jd);
-                // cout << "\t" << id << "\t" << jd << "\t" << crit << endl;
-                if (crit > critMax) {
-                    critMax = crit;
-                    bestPair[0] = id;
-                    bestPair[1] = jd;
-                }
-            }
-        }
-        if (critMax == std::log(0.)) throw Exception("Unexpected error: no maximum criterium found.");
-
-        // get branch lengths for pair
-        double ratio = (sumDist_[bestPair[0]] - sumDist_[bestPair[1]]) / static_cast<double>(currentNodes_.size() - 2);
-        vector<double> d(2);
-
-        d[0] = std::max(.5 * (dists(bestPair[0], bestPair[1]) + ratio), MIN_BRANCH_LENGTH);
-        d[1] = std::max(.5 * (dists(bestPair[0], bestPair[1]) - ratio), MIN_BRANCH_LENGTH);
-
-        Node* best1 = currentNodes_[bestPair[0]];
-        Node* best2 = currentNodes_[bestPair[1]];
-
-        // Distances may be used by getParentNodes (PGMA for instance).
-        best1->setDistanceToFather(d[0]);
-        best2->setDistanceToFather(d[1]);
-        Node* parent = new Node(idNextNode++);
-        parent->addSon(best1);
-        parent->addSon(best2);
+string Alignment::get_abayes_tree() {
+    return get_abayes_phylo_tree().to_newick();
+}
 
-        // compute lambda
-        lambda_ = 0;
-        if (vars(bestPair[0], bestPair[1]) == 0) lambda_ = .5;
-        else {
-            for (map<size_t, Node*>::iterator i = currentNodes_.begin(); i != currentNodes_.end(); i++) {
-                size_t id = i->first;
-                if (id != bestPair[0] && id != bestPair[1]) lambda_ += (vars(bestPair[1], id) - vars(bestPair[0], id));
-            }
-            double div = 2 * static_cast<double>(currentNodes_.size() - 2) * vars(bestPair[0], bestPair[1]);
-            lambda_ /= div;
-            lambda_ += .5;
-        }
-        if (lambda_ < 0.) lambda_ = 0.;
-        if (lambda_ > 1.) lambda_ = 1.;
-
-        for (map<size_t, Node*>::iterator i = currentNodes_.begin(); i != currentNodes_.end(); i++) {
-            size_t id = i->first;
-            if (id != bestPair[0] && id != bestPair[1]) {
-                newDist[id] = std::max(lambda_ * (dists(bestPair[0], id) - d[0]) + (1 - lambda_) * (dists(bestPair[1], id) - d[1]), 0.);
-                newVar[id] = lambda_ * vars(bestPair[0], id) + (1 - lambda_) * vars(bestPair[1], id) - lambda_ * (1 - lambda_) * vars(bestPair[0], bestPair[1]);
-            }
-          else newDist[id] = 0;
-        }
-        // Actualize currentNodes_:
-        currentNodes_[bestPair[0]] = parent;
-        currentNodes_.erase(bestPair[1]);
-        for (map<size_t, Node*>::iterator i = currentNodes_.begin(); i != currentNodes_.end(); i++) {
-            size_t id = i->first;
-            dists(bestPair[0], id) = dists(id, bestPair[0]) = newDist[id];
-            vars(bestPair[0], id) =  vars(id, bestPair[0]) = newVar[id];
-        }
-    }
-    // final step
-    Node* root = new Node(idNextNode);
-    map<size_t, Node* >::iterator it = currentNodes_.begin();
-    size_t i1 = it->first;
-    Node* n1       = it->second;
-    it++;
-    size_t i2 = it->first;
-    Node* n2       = it->second;
-    if (currentNodes_.size() == 2) {
-        // Rooted
-        double d = dists(i1, i2) / 2;
-        root->addSon(n1);
-        root->addSon(n2);
-        n1->setDistanceToFather(d);
-        n2->setDistanceToFather(d);
+// The likelihood tree with each internal branch labelled by its aBayes support
+PhyloTree Alignment::get_abayes_phylo_tree() {
+    if (!_tree_likelihood) {
+        throw Exception("Likelihood calculator not set - call initialise_likelihood");
     }
-    else {
-        // Unrooted
-        it++;
-        size_t i3 = it->first;
-        Node* n3       = it->second;
-        double d1 = std::max(dists(i1, i2) + dists(i1, i3) - dists(i2, i3), MIN_BRANCH_LENGTH);
-        double d2 = std::max(dists(i2, i1) + dists(i2, i3) - dists(i1, i3), MIN_BRANCH_LENGTH);
-        double d3 = std::max(dists(i3, i1) + dists(i3, i2) - dists(i1, i2), MIN_BRANCH_LENGTH);
-        root->addSon(n1);
-        root->addSon(n2);
-        root->addSon(n3);
-        n1->setDistanceToFather(d1 / 2.);
-        n2->setDistanceToFather(d2 / 2.);
-        n3->setDistanceToFather(d3 / 2.);
-    }
-    Tree *tree_ = new TreeTemplate<Node>(root);
-    stringstream ss;
-    Newick treeWriter;
-    if (!tree_) throw Exception("The tree is empty");
-    treeWriter.write(*tree_, ss);
-    delete tree_;
-    string s{ss.str()};
-    s.erase(s.find_last_not_of(" \n\r\t")+1);
-    return s;
+    vector<double> abayes, alrt;
+    ParallelTreeLikelihood& tree_likelihood = _get_tree_likelihood();
+    tree_likelihood.compute_branch_support(abayes, alrt, 0);
+    return tree_likelihood.get_phylo_tree(abayes);
 }
 
-string Alignment::get_abayes_tree() {
-    TreeTemplate<Node> tree = TreeTemplate<Node>(likelihood->getTree());
-    std::map<int, nniIDs> nniMap;
-
-    for (auto& node : tree.getNodes()) {
-        if (node->hasFather() && node->getFather()->hasFather()) {
-            auto search = nniMap.find(node->getFatherId());
-            if (search == nniMap.end()) {
-                nniMap[node->getFatherId()].rearr1 = node->getId();
-            }
-            else {
-                search->second.rearr2 = node->getId();
-            };
-        }
-    }
+string Alignment::get_alrt_tree(size_t nreplicates, size_t seed) {
+    return get_alrt_phylo_tree(nreplicates, seed).to_newick();
+}
 
-    for (auto entry : nniMap) {
-        double lnl1 = -likelihood->testNNI(entry.second.rearr1);
-        double lnl2 = -likelihood->testNNI(entry.second.rearr2);
-        bpp::Number<double> abayes = 1 / (1 + exp(lnl1) + exp(lnl2));
-        tree.setBranchProperty(entry.first, TreeTools::BOOTSTRAP, abayes);
+// The likelihood tree with each internal branch labelled by its SH-like aLRT support, from nreplicates RELL replicates
+PhyloTree Alignment::get_alrt_phylo_tree(size_t nreplicates, size_t seed) {
+    if (!_tree_likelihood) {
+        throw Exception("Likelihood calculator not set - call initialise_likelihood");
     }
-
-    string s = TreeTools::treeToParenthesis(tree, true, TreeTools::BOOTSTRAP);
-    s.erase(s.find_last_not_of(" \n\r\t")+1);
-    return s;
+    vector<double> abayes, alrt;
+    ParallelTreeLikelihood& tree_likelihood = _get_tree_likelihood();
+    tree_likelihood.compute_branch_support(abayes, alrt, nreplicates, seed);
+    return tree_likelihood.get_phylo_tree(alrt);
 }
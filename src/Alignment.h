@@ -16,6 +16,14 @@
 #include <Bpp/Phyl/Simulation/HomogeneousSequenceSimulator.h>
 #include <Bpp/Phyl/Parsimony/DRTreeParsimonyScore.h>
 
+#include "CondensedMatrix.h"
+#include "PackedSequences.h"
+#include "ParallelTreeLikelihood.h"
+#include "PhyloTree.h"
+#include "SiteLikelihoods.h"
+#include "ThreadPool.h"
+#include "TransitionMatrices.h"
+
 #include <iostream>
 #include <map>
 #include <memory>
@@ -24,10 +32,10 @@
 using namespace std;
 using namespace bpp;
 
-struct nniIDs {
-    int rearr1;
-    int rearr2;
-};
+class AnalyticDistances;
+class JointTableCache;
+class PairwiseLikelihood;
+struct DistanceEstimate;
 
 class Alignment {
     public :
@@ -40,6 +48,8 @@ class Alignment {
         void read_alignment(string filename, string file_format, bool interleaved);
         void read_alignment(string filename, string file_format, string datatype, bool interleaved=true);
         void sort_alignment(bool ascending=true);
+        void add_sequences(vector<pair<string, string>>& headers_sequences);
+        void remove_sequences(vector<string> names);
         void write_alignment(string filename, string file_format, bool interleaved=true);
         void set_substitution_model(string model_name);
         void set_gamma_rate_model(size_t ncat=4, double alpha=1.0);
@@ -50,9 +60,11 @@ class Alignment {
         void set_frequencies(vector<double>);
         void set_namespace(string name);
         void set_parameter(string name, double value);
+        void set_number_of_threads(size_t nthreads);
         vector<pair<string, string>> get_sequences();
         double get_alpha();
         size_t get_number_of_gamma_categories();
+        size_t get_number_of_threads();
         vector<double> get_rates(string order);
         vector<double> get_rate_model_categories();
         vector<double> get_frequencies();
@@ -69,6 +81,8 @@ class Alignment {
         vector<vector<double>> get_exchangeabilities();
         vector<vector<double>> get_q_matrix();
         vector<vector<double>> get_p_matrix(double time);
+        void fill_p_matrices(const vector<double>& times, double* out);
+        size_t get_number_of_states();
         string get_namespace();
         vector<string> get_informative_sites(bool exclude_gaps);
         size_t get_number_of_informative_sites(bool exclude_gaps);
@@ -80,43 +94,79 @@ class Alignment {
         void do_nni(int nodeid);
         void commit_topology();
         void _print_node(int nodeid);
+        ParallelTreeLikelihood& get_tree_likelihood();
+        void refresh_likelihood_model();
 
         // Distance
         void compute_distances();
+        void compute_distances(double screen_tolerance);
         void fast_compute_distances();
+        void fast_compute_distances(string method, double alpha=0);
+        void compute_distances_range(size_t first_pair, size_t last_pair, string filename, string method="ml", double alpha=0);
+        void compute_distances_shard(size_t shard, size_t nshards, string filename, string method="ml", double alpha=0);
+        size_t merge_distance_shards(vector<string> filenames);
         void set_distance_matrix(vector<vector<double>> matrix);
         void set_variance_matrix(vector<vector<double>> matrix);
         string get_bionj_tree();
         string get_bionj_tree(vector<vector<double>> matrix);
+        string get_rapid_bionj_tree(size_t max_megabytes=16);
+        double get_bionj_visited_fraction();
+        string get_bme_tree(size_t max_rounds=100);
+        PhyloTree get_bionj_phylo_tree();
+        PhyloTree get_bme_phylo_tree(size_t max_rounds=100);
+        vector<double> get_bme_lengths();
         vector<vector<double>> get_distances();
         vector<vector<double>> get_variances();
         vector<vector<double>> get_distance_variance_matrix();
+        shared_ptr<CondensedMatrix> get_condensed_distances();
+        shared_ptr<CondensedMatrix> get_condensed_variances();
+        void fill_distances(double* out);
+        void fill_variances(double* out);
+        void fill_distance_variance_matrix(double* out);
 
         // Likelihood
         void initialise_likelihood();
         void initialise_likelihood(string tree);
+        void initialise_likelihood(const PhyloTree& tree);
+        void initialise_likelihood(const PhyloTree& tree, const vector<string>& names, shared_ptr<ThreadPool> pool);
         void optimise_branch_lengths();
+        void optimise_branch_lengths(string method, bool polish);
+        vector<double> get_optimisation_stats();
         void optimise_parameters(bool fix_branch_lengths);
-        void optimise_topology(bool fix_model_params);
+        void optimise_topology(bool fix_model_params, size_t spr_radius=0);
+        vector<vector<double>> get_topology_log();
+        vector<pair<string, vector<double>>> select_model(string tree, string criterion="bic", bool skip=true);
+        vector<pair<string, vector<double>>> select_model(const PhyloTree& tree, string criterion="bic", bool skip=true);
         double get_likelihood();
+        shared_ptr<SiteLikelihoods> get_site_likelihoods();
         string get_tree();
         string get_abayes_tree();
+        PhyloTree get_phylo_tree();
+        PhyloTree get_abayes_phylo_tree();
+        string get_alrt_tree(size_t nreplicates=1000, size_t seed=1);
+        PhyloTree get_alrt_phylo_tree(size_t nreplicates=1000, size_t seed=1);
 
         // Parsimony
         void initialise_parsimony(string tree, bool verbose=true, bool include_gaps=true);
+        void initialise_parsimony(const PhyloTree& tree, bool verbose=true, bool include_gaps=true);
         unsigned int get_parsimony_score();
         string get_parsimony_tree();
+        PhyloTree get_parsimony_phylo_tree();
         void optimise_parsimony(unsigned int verbose=1);
 
         // Simulator
         void write_simulation(size_t nsites, string filename, string file_format, bool interleaved=true);
         void set_simulator(string tree);
+        void set_simulator(const PhyloTree& tree);
         vector<pair<string, string>> simulate(size_t nsites, string tree);
+        vector<pair<string, string>> simulate(size_t nsites, const PhyloTree& tree);
         vector<pair<string, string>> simulate(size_t nsites);
         vector<pair<string, string>> get_simulated_sequences();
 
         // Bootstrap
         vector<pair<string, string>> get_bootstrapped_sequences();
+        vector<string> get_bootstrap_trees(size_t nreplicates, size_t seed=1, string method="jc", double alpha=0);
+        string get_bootstrap_support_tree(size_t nreplicates, size_t seed=1, string method="jc", double alpha=0);
         void chkdst();
 
         // Misc
@@ -130,24 +180,49 @@ class Alignment {
         map<int, double> _vector_to_map(vector<double>);
         void _check_compatible_model(string model);
         void _clear_distances();
+        void _clear_sequence_caches();
+        void _extend_distances(size_t first_new);
+        vector<PhyloTree> _bootstrap_trees(size_t nreplicates, size_t seed, string method, double alpha, bool include_original);
+        string _distance_settings(string method, double alpha);
+        DistanceEstimate _ml_estimate(const PairwiseLikelihood& pairwise, const vector<double>& table, size_t d, size_t g);
+        void _set_ml_distance(const PairwiseLikelihood& pairwise, size_t i, size_t j, const vector<double>& table, size_t d, size_t g);
+        void _set_analytic_distance(size_t i, size_t j, const DistanceEstimate& estimate);
+        void _set_jc_distance(size_t i, size_t j, size_t d, size_t g, double s);
+        ParameterList _get_model_parameters();
+        void _update_likelihood_model();
         void _clear_likelihood();
-        bool _is_file(string filename);
-        bool _is_tree_string(string tree_string);
+        NNIHomogeneousTreeLikelihood& _get_likelihood();
+        ParallelTreeLikelihood& _get_tree_likelihood();
+        ThreadPool& _get_thread_pool();
+        PackedSequences& _get_packed_sequences();
+        TransitionMatrices& _get_transition_matrices();
         double _jcdist(double d, double g, double s);
         double _jcvar(double d, double g, double s);
-        shared_ptr<DistanceMatrix> _create_distance_matrix(vector<vector<double>> matrix);
+        shared_ptr<CondensedMatrix> _create_distance_matrix(vector<vector<double>> matrix);
         shared_ptr<VectorSiteContainer> sequences;
         shared_ptr<VectorSiteContainer> simulated_sequences;
+        shared_ptr<PackedSequences> packed_sequences;
         shared_ptr<AbstractSubstitutionModel> model;
         shared_ptr<AbstractDiscreteDistribution> rates;
-        shared_ptr<DistanceMatrix> distances;
-        shared_ptr<DistanceMatrix> variances;
-        shared_ptr<NNIHomogeneousTreeLikelihood> likelihood;
+        shared_ptr<CondensedMatrix> distances;
+        shared_ptr<CondensedMatrix> variances;
+        enum class DistanceMethod {NONE, FAST, ML, ANALYTIC, USER};
+        DistanceMethod _distance_method = DistanceMethod::NONE;
+        shared_ptr<AnalyticDistances> _analytic_distances;  // Kept for add_sequences
+        shared_ptr<JointTableCache> _joint_tables;          // Kept for re-estimating ML distances
+        shared_ptr<CondensedMatrix> _warm_start;            // Last converged ML distances, NaN otherwise
+        shared_ptr<NNIHomogeneousTreeLikelihood> likelihood;            // Built from _tree_likelihood when first needed
+        shared_ptr<ParallelTreeLikelihood> _tree_likelihood;
+        shared_ptr<TransitionMatrices> _transition_matrices;             // For the current model object
+        bool _tree_likelihood_stale = false;                            // likelihood has changed since _tree_likelihood
         shared_ptr<HomogeneousSequenceSimulator> simulator;
         shared_ptr<DRTreeParsimonyScore> parsimony;
         unique_ptr<ParameterList> _get_parameter_list();
         string _name;
-        string _computeTree(DistanceMatrix dists, DistanceMatrix vars) throw (Exception);
+        size_t _num_threads = 1;
+        double _bionj_visited_fraction = 1;
+        vector<double> _bme_lengths;
+        shared_ptr<ThreadPool> _pool;
 };
 
 #endif /* _ALIGNMENT_H_ */
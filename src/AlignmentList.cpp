@@ -1,5 +1,13 @@
 #include "AlignmentList.h"
 
+#include <Bpp/Exceptions.h>
+
+#include <algorithm>
+#include <set>
+
+#define PARTITION_TOLERANCE 0.001
+#define MAX_ROUNDS 100
+
 using namespace std;
 using namespace bpp;
 
@@ -7,15 +15,124 @@ AlignmentList::AlignmentList() {}
 
 AlignmentList::AlignmentList(vector<Alignment> alignments) {
     _alignments = vector<Alignment>(alignments);
+    _sources = alignments;
+}
+
+AlignmentList::~AlignmentList() {}
+
+Alignment& AlignmentList::operator[](const size_t idx) {
+    if (idx >= _alignments.size()) throw Exception("AlignmentList: index out of range");
+    return _alignments[idx];
 }
 
-Alignment AlignmentList::operator[](const size_t idx) {return _alignments[idx];}
+// Takes effect at the next initialise_likelihood
+void AlignmentList::set_number_of_threads(size_t nthreads) {
+    _num_threads = ThreadPool::resolve_number_of_threads(nthreads);
+}
 
-void Alignment::initialise_likelihood(string tree) {
+size_t AlignmentList::get_number_of_threads() {
+    return _num_threads;
+}
 
-    VectorSiteContainer* sites_ = sequences->clone();
-    SiteContainerTools::changeGapsToUnknownCharacters(*sites_);
-    likelihood = make_shared<NNIHomogeneousTreeLikelihood>(*liktree, *sites_, model.get(), rates.get(), true, true);
-    likelihood->initialize();
-    delete liktree;
-}
\ No newline at end of file
+size_t AlignmentList::get_number_of_partitions() {
+    return _alignments.size();
+}
+
+// Every sequence name in any of the alignments, sorted: the leaves of the tree
+vector<string> AlignmentList::get_names() {
+    set<string> names;
+    for (auto& alignment : _alignments) {
+        for (auto& name : alignment.get_names()) names.insert(name);
+    }
+    return vector<string>(names.begin(), names.end());
+}
+
+void AlignmentList::initialise_likelihood(string tree) {
+    initialise_likelihood(PhyloTree::from_newick(tree));
+}
+
+/*
+Sets up each alignment's likelihood on tree, sharing a new thread pool. Each
+alignment must already have its model and rates set.
+*/
+void AlignmentList::initialise_likelihood(const PhyloTree& tree) {
+    if (_alignments.empty()) throw Exception("AlignmentList: no alignments");
+    _initialised = false;
+    _pool = make_shared<ThreadPool>(_num_threads);
+    vector<string> names = get_names();
+    for (auto& alignment : _alignments) alignment.initialise_likelihood(tree, names, _pool);
+    _initialised = true;
+}
+
+/*
+Optimises the shared branch lengths on the summed lnL, with each alignment's
+model fixed.
+*/
+void AlignmentList::optimise_branch_lengths() {
+    ParallelTreeLikelihood::optimise_shared_branch_lengths(_get_partitions(), PARTITION_TOLERANCE);
+}
+
+/*
+Optimises each alignment's model and rate parameters, all at once across the
+pool, then, unless fix_branch_lengths, the shared branch lengths, and repeats
+until a round improves the summed lnL by less than PARTITION_TOLERANCE.
+The models are shared with the alignments passed in, so the likelihoods
+those had when the list was built are refreshed at the end.
+*/
+void AlignmentList::optimise_parameters(bool fix_branch_lengths) {
+    vector<ParallelTreeLikelihood*> partitions = _get_partitions();
+    double lnl = ParallelTreeLikelihood::get_total_log_likelihood(partitions);
+    for (size_t round = 0; round < MAX_ROUNDS; ++round) {
+        _pool->parallel_for(0, partitions.size(), [&](size_t i, size_t) {
+            partitions[i]->optimise_parameters(true, PARTITION_TOLERANCE);
+        });
+        if (!fix_branch_lengths) {
+            ParallelTreeLikelihood::optimise_shared_branch_lengths(partitions, PARTITION_TOLERANCE);
+        }
+        double next = ParallelTreeLikelihood::get_total_log_likelihood(partitions);
+        bool done = fix_branch_lengths || next - lnl < PARTITION_TOLERANCE;
+        lnl = next;
+        if (done) break;
+    }
+    for (auto& source : _sources) source.refresh_likelihood_model();
+}
+
+double AlignmentList::get_likelihood() {
+    return ParallelTreeLikelihood::get_total_log_likelihood(_get_partitions());
+}
+
+// lnL of each alignment, in list order
+vector<double> AlignmentList::get_partition_likelihoods() {
+    _get_partitions();
+    vector<double> lnls(_alignments.size());
+    _pool->parallel_for(0, _alignments.size(), [&](size_t i, size_t) { lnls[i] = _alignments[i].get_likelihood(); });
+    return lnls;
+}
+
+string AlignmentList::get_tree() {
+    return get_phylo_tree().to_newick();
+}
+
+PhyloTree AlignmentList::get_phylo_tree() {
+    return _get_partitions()[0]->get_phylo_tree();
+}
+
+/*
+The alignments' likelihoods, largest first by the work in a traversal
+(patterns x categories x states^2), which is the order the pool takes them in.
+*/
+vector<ParallelTreeLikelihood*> AlignmentList::_get_partitions() {
+    if (!_initialised) throw Exception("Likelihood calculator not set - call initialise_likelihood");
+    vector<pair<double, ParallelTreeLikelihood*>> sized;
+    for (auto& alignment : _alignments) {
+        ParallelTreeLikelihood& partition = alignment.get_tree_likelihood();
+        size_t nstates = alignment.is_dna() ? 4 : 20;
+        double cost = static_cast<double>(partition.get_number_of_patterns()) * partition.get_number_of_categories() * nstates * nstates;
+        sized.push_back(make_pair(cost, &partition));
+    }
+    stable_sort(sized.begin(), sized.end(), [](const pair<double, ParallelTreeLikelihood*>& a,
+            const pair<double, ParallelTreeLikelihood*>& b) { return a.first > b.first; });
+    vector<ParallelTreeLikelihood*> partitions;
+    for (auto& entry : sized) partitions.push_back(entry.second);
+    return partitions;
+}
@@ -2,24 +2,54 @@
 #define _ALIGNMENT_LIST_H_
 
 #include "Alignment.h"
+#include "PhyloTree.h"
+#include "ThreadPool.h"
+
+#include <memory>
+#include <string>
+#include <vector>
 
 using namespace std;
 using namespace bpp;
 
+/*
+A partitioned likelihood: one tree, with linked branch lengths, over several
+alignments (genes), each keeping its own substitution model and rate
+distribution. The sequences need not match between genes: the tree has a
+leaf for every name in any of them, and each gene treats the sequences it
+lacks as unknown.
+Every gene's likelihood runs on one shared work-stealing pool. Genes are
+handed out largest first, and threads left without a gene steal pattern
+chunks from those still running, so a few long genes among thousands of
+short ones do not hold the rest up.
+*/
 class AlignmentList {
     public :
         AlignmentList();
-        AlignmentList(vector<Alignment>);
+        AlignmentList(vector<Alignment> alignments);
         virtual ~AlignmentList();
-        void initialise_likelihood();
+        void set_number_of_threads(size_t nthreads);
+        size_t get_number_of_threads();
+        size_t get_number_of_partitions();
+        vector<string> get_names();
+        void initialise_likelihood(string tree);
+        void initialise_likelihood(const PhyloTree& tree);
+        void optimise_branch_lengths();
         void optimise_parameters(bool fix_branch_lengths);
-        void optimise_topology(bool fix_model_params);
+        double get_likelihood();
+        vector<double> get_partition_likelihoods();
+        string get_tree();
+        PhyloTree get_phylo_tree();
         Alignment& operator[](size_t idx);
 
     private :
+        vector<ParallelTreeLikelihood*> _get_partitions();
         vector<Alignment> _alignments;
-        shared_ptr<NNIHomogeneousTreeLikelihood> likelihood = nullptr;
+        vector<Alignment> _sources;    // As passed in, sharing the callers' models and likelihoods
+        shared_ptr<ThreadPool> _pool;
+        size_t _num_threads = 1;
+        bool _initialised = false;
 };
 
 
-#endif // _ALIGNMENT_LIST_H_
\ No newline at end of file
+#endif // _ALIGNMENT_LIST_H_
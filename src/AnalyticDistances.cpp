@@ -0,0 +1,301 @@
+/*
+ * AnalyticDistances.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "AnalyticDistances.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <map>
+
+#define DISTMIN 0.000001
+#define DISTMAX 10000
+#define VARMIN  0.000001
+#define FREQMIN 0.0000011
+
+// DNA states, in Bio++ alphabet order
+enum DnaState {A = 0, C = 1, G = 2, T = 3};
+
+map<string, AnalyticMethod> AnalyticMethodMap{
+    {"jc", AnalyticMethod::JC},
+    {"jc69", AnalyticMethod::JC},
+    {"k2p", AnalyticMethod::K2P},
+    {"k80", AnalyticMethod::K2P},
+    {"f84", AnalyticMethod::F84},
+    {"tn93", AnalyticMethod::TN93},
+    {"logdet", AnalyticMethod::LogDet},
+    {"paralinear", AnalyticMethod::LogDet},
+    {"poisson", AnalyticMethod::Poisson},
+    {"kimura", AnalyticMethod::Kimura},
+};
+
+AnalyticMethod string_to_analytic_method(string name) throw (Exception) {
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (AnalyticMethodMap.find(name) == AnalyticMethodMap.end()) {
+        throw Exception("AnalyticDistances - unknown distance method \"" + name + "\"");
+    }
+    return AnalyticMethodMap[name];
+}
+
+AnalyticDistances::AnalyticDistances(string method, const vector<uint32_t>& code_masks, size_t nstates, double alpha,
+        const vector<double>& frequencies) throw (Exception) :
+        _method(string_to_analytic_method(method)), _nstates(nstates), _ncodes(code_masks.size()),
+        _alpha(alpha), _frequencies(frequencies) {
+    bool dna_only = _method == AnalyticMethod::K2P || _method == AnalyticMethod::F84 || _method == AnalyticMethod::TN93;
+    bool protein_only = _method == AnalyticMethod::Poisson || _method == AnalyticMethod::Kimura;
+    if (dna_only && nstates != 4) throw Exception("AnalyticDistances - " + method + " is a DNA distance");
+    if (protein_only && nstates != 20) throw Exception("AnalyticDistances - " + method + " is a protein distance");
+    if ((_method == AnalyticMethod::F84 || _method == AnalyticMethod::TN93) && frequencies.size() != 4) {
+        throw Exception("AnalyticDistances - " + method + " needs the four base frequencies");
+    }
+    // A base missing from the data would divide by zero in F84 and TN93
+    if (!_frequencies.empty()) {
+        double sum = 0;
+        for (double& pi : _frequencies) sum += pi = max(pi, FREQMIN);
+        for (double& pi : _frequencies) pi /= sum;
+    }
+    _index_codes(code_masks);
+}
+
+// Same method, alpha and frequencies, for an alignment whose codes have changed
+AnalyticDistances::AnalyticDistances(const AnalyticDistances& other, const vector<uint32_t>& code_masks) :
+        _method(other._method), _nstates(other._nstates), _ncodes(code_masks.size()),
+        _alpha(other._alpha), _frequencies(other._frequencies) {
+    _index_codes(code_masks);
+}
+
+AnalyticDistances::~AnalyticDistances() {}
+
+AnalyticMethod AnalyticDistances::get_method() const {
+    return _method;
+}
+
+bool AnalyticDistances::needs_joint_counts() const {
+    return !(_method == AnalyticMethod::JC || _method == AnalyticMethod::Poisson || _method == AnalyticMethod::Kimura);
+}
+
+// JC, Poisson and Kimura, which only depend on the proportion of differences
+DistanceEstimate AnalyticDistances::from_differences(size_t differences, size_t comparable) const {
+    if (comparable == 0) return {DISTMIN, VARMIN, true};
+    double n = static_cast<double>(comparable);
+    return _from_proportion(static_cast<double>(differences) / n, n);
+}
+
+DistanceEstimate AnalyticDistances::from_joint_counts(const vector<double>& table) const {
+    size_t s = _nstates;
+    vector<double> f(s * s, 0);
+    double n = 0;
+    for (size_t x = 0; x < _ncodes; ++x) {
+        if (_state_of_code[x] < 0) continue;
+        for (size_t y = 0; y < _ncodes; ++y) {
+            if (_state_of_code[y] < 0) continue;
+            double count = table[x * _ncodes + y];
+            f[_state_of_code[x] * s + _state_of_code[y]] += count;
+            n += count;
+        }
+    }
+    if (n == 0) return {0, VARMIN, true};
+    for (auto& cell : f) cell /= n;
+
+    switch (_method) {
+        case AnalyticMethod::K2P: return _k2p(f, n);
+        case AnalyticMethod::F84: return _f84(f, n);
+        case AnalyticMethod::TN93: return _tn93(f, n);
+        case AnalyticMethod::LogDet: return _logdet(f, n);
+        default: {
+            double p = 1;
+            for (size_t i = 0; i < s; ++i) p -= f[i * s + i];
+            return _from_proportion(p, n);
+        }
+    }
+}
+
+void AnalyticDistances::_index_codes(const vector<uint32_t>& code_masks) {
+    _state_of_code.clear();
+    for (uint32_t mask : code_masks) {
+        int state = -1;
+        if (mask != 0 && (mask & (mask - 1)) == 0) {
+            state = 0;
+            while (!(mask >> state & 1)) ++state;
+        }
+        _state_of_code.push_back(state);
+    }
+}
+
+// -log(w), or its gamma form, and the derivative
+double AnalyticDistances::_f(double w) const {
+    if (_alpha > 0) return _alpha * (pow(w, -1 / _alpha) - 1);
+    return -log(w);
+}
+
+double AnalyticDistances::_df(double w) const {
+    if (_alpha > 0) return -pow(w, -1 / _alpha - 1);
+    return -1 / w;
+}
+
+DistanceEstimate AnalyticDistances::_from_proportion(double p, double n) const {
+    double w, dw;  // d = f(w), and dw = dw/dp
+    double b = (static_cast<double>(_nstates) - 1) / static_cast<double>(_nstates);
+    switch (_method) {
+        case AnalyticMethod::Poisson:
+            w = 1 - p;
+            dw = -1;
+            break;
+        case AnalyticMethod::Kimura:
+            w = 1 - p - 0.2 * p * p;
+            dw = -1 - 0.4 * p;
+            break;
+        default:
+            w = 1 - p / b;
+            dw = -1 / b;
+            break;
+    }
+    if (w <= 0) return _saturated();
+    double scale = _method == AnalyticMethod::JC ? b : 1;
+    double g = scale * _df(w) * dw;
+    return {max(scale * _f(w), DISTMIN), _delta_variance({p}, {g}, n), true};
+}
+
+// Kimura (1980), with P transitions and Q transversions
+DistanceEstimate AnalyticDistances::_k2p(const vector<double>& f, double n) const {
+    double P = f[A * 4 + G] + f[G * 4 + A] + f[C * 4 + T] + f[T * 4 + C];
+    double Q = 1 - f[A * 4 + A] - f[C * 4 + C] - f[G * 4 + G] - f[T * 4 + T] - P;
+    double w1 = 1 - 2 * P - Q, w2 = 1 - 2 * Q;
+    if (w1 <= 0 || w2 <= 0) return _saturated();
+    double d = 0.5 * _f(w1) + 0.25 * _f(w2);
+    double gP = -_df(w1);
+    double gQ = -0.5 * _df(w1) - 0.5 * _df(w2);
+    return {d, _delta_variance({P, Q}, {gP, gQ}, n), true};
+}
+
+// Felsenstein (1984), in the form of Tamura and Nei (1993)
+DistanceEstimate AnalyticDistances::_f84(const vector<double>& f, double n) const {
+    const vector<double>& pi = _frequencies;
+    double piR = pi[A] + pi[G], piY = pi[C] + pi[T];
+    double a = pi[C] * pi[T] / piY + pi[A] * pi[G] / piR;
+    double b = pi[C] * pi[T] + pi[A] * pi[G];
+    double c = piR * piY;
+    double P = f[A * 4 + G] + f[G * 4 + A] + f[C * 4 + T] + f[T * 4 + C];
+    double Q = 1 - f[A * 4 + A] - f[C * 4 + C] - f[G * 4 + G] - f[T * 4 + T] - P;
+    double w1 = 1 - P / (2 * a) - (a - b) * Q / (2 * a * c);
+    double w2 = 1 - Q / (2 * c);
+    if (w1 <= 0 || w2 <= 0) return _saturated();
+    double d = 2 * a * _f(w1) - 2 * (a - b - c) * _f(w2);
+    double gP = -_df(w1);
+    double gQ = -_df(w1) * (a - b) / c + _df(w2) * (a - b - c) / c;
+    return {d, _delta_variance({P, Q}, {gP, gQ}, n), true};
+}
+
+// Tamura and Nei (1993), with P1 purine and P2 pyrimidine transitions
+DistanceEstimate AnalyticDistances::_tn93(const vector<double>& f, double n) const {
+    const vector<double>& pi = _frequencies;
+    double piR = pi[A] + pi[G], piY = pi[C] + pi[T];
+    double k1 = 2 * pi[A] * pi[G] / piR;
+    double k2 = 2 * pi[C] * pi[T] / piY;
+    double k3 = 2 * (piR * piY - pi[A] * pi[G] * piY / piR - pi[C] * pi[T] * piR / piY);
+    double P1 = f[A * 4 + G] + f[G * 4 + A];
+    double P2 = f[C * 4 + T] + f[T * 4 + C];
+    double Q = 1 - f[A * 4 + A] - f[C * 4 + C] - f[G * 4 + G] - f[T * 4 + T] - P1 - P2;
+    double w1 = 1 - P1 / k1 - Q / (2 * piR);
+    double w2 = 1 - P2 / k2 - Q / (2 * piY);
+    double w3 = 1 - Q / (2 * piR * piY);
+    if (w1 <= 0 || w2 <= 0 || w3 <= 0) return _saturated();
+    double d = k1 * _f(w1) + k2 * _f(w2) + k3 * _f(w3);
+    double gP1 = -_df(w1);
+    double gP2 = -_df(w2);
+    double gQ = -k1 * _df(w1) / (2 * piR) - k2 * _df(w2) / (2 * piY) - k3 * _df(w3) / (2 * piR * piY);
+    return {d, _delta_variance({P1, P2, Q}, {gP1, gP2, gQ}, n), true};
+}
+
+/*
+Paralinear distance (Lake 1994),
+    d = -1/s [log det F - (log det Px + log det Py) / 2]
+where F is the joint frequency matrix and Px, Py hold its row and column sums.
+The gradient with respect to F_xy is -1/s [(F^-1)_yx - (1/px_x + 1/py_y) / 2].
+*/
+DistanceEstimate AnalyticDistances::_logdet(const vector<double>& f, double n) const {
+    size_t s = _nstates;
+    vector<double> px(s, 0), py(s, 0);
+    for (size_t x = 0; x < s; ++x) {
+        for (size_t y = 0; y < s; ++y) {
+            px[x] += f[x * s + y];
+            py[y] += f[x * s + y];
+        }
+    }
+    double log_marginals = 0;
+    for (size_t x = 0; x < s; ++x) {
+        if (px[x] <= 0 || py[x] <= 0) return _saturated();
+        log_marginals += log(px[x]) + log(py[x]);
+    }
+
+    // Gauss-Jordan elimination with partial pivoting, for det F and F^-1
+    vector<double> m(f), inv(s * s, 0);
+    for (size_t i = 0; i < s; ++i) inv[i * s + i] = 1;
+    double log_det = 0;
+    int sign = 1;
+    for (size_t col = 0; col < s; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < s; ++row) {
+            if (fabs(m[row * s + col]) > fabs(m[pivot * s + col])) pivot = row;
+        }
+        if (m[pivot * s + col] == 0) return _saturated();
+        if (pivot != col) {
+            for (size_t k = 0; k < s; ++k) {
+                swap(m[col * s + k], m[pivot * s + k]);
+                swap(inv[col * s + k], inv[pivot * s + k]);
+            }
+            sign = -sign;
+        }
+        double diag = m[col * s + col];
+        if (diag < 0) sign = -sign;
+        log_det += log(fabs(diag));
+        for (size_t k = 0; k < s; ++k) {
+            m[col * s + k] /= diag;
+            inv[col * s + k] /= diag;
+        }
+        for (size_t row = 0; row < s; ++row) {
+            if (row == col) continue;
+            double factor = m[row * s + col];
+            if (factor == 0) continue;
+            for (size_t k = 0; k < s; ++k) {
+                m[row * s + k] -= factor * m[col * s + k];
+                inv[row * s + k] -= factor * inv[col * s + k];
+            }
+        }
+    }
+    if (sign < 0) return _saturated();
+
+    double ds = static_cast<double>(s);
+    double d = -(log_det - 0.5 * log_marginals) / ds;
+    vector<double> g(s * s);
+    for (size_t x = 0; x < s; ++x) {
+        for (size_t y = 0; y < s; ++y) {
+            g[x * s + y] = -(inv[y * s + x] - 0.5 * (1 / px[x] + 1 / py[y])) / ds;
+        }
+    }
+    return {max(d, 0.0), _delta_variance(f, g, n), true};
+}
+
+/*
+Delta-method variance of a function of multinomial proportions p (which need
+not sum to one: the remaining category has zero gradient), from its gradient g
+    var = [sum g_i^2 p_i - (sum g_i p_i)^2] / n
+*/
+double AnalyticDistances::_delta_variance(const vector<double>& p, const vector<double>& g, double n) {
+    double first = 0, second = 0;
+    for (size_t i = 0; i < p.size(); ++i) {
+        first += g[i] * p[i];
+        second += g[i] * g[i] * p[i];
+    }
+    double var = (second - first * first) / n;
+    return var > VARMIN ? var : VARMIN;
+}
+
+// Too divergent for the formula to be defined
+DistanceEstimate AnalyticDistances::_saturated() {
+    return {DISTMAX, DISTMAX, false};
+}
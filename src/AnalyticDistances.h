@@ -0,0 +1,80 @@
+/*
+ * AnalyticDistances.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef ANALYTICDISTANCES_H_
+#define ANALYTICDISTANCES_H_
+
+#include "PairwiseLikelihood.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+enum class AnalyticMethod {
+    JC,
+    K2P,
+    F84,
+    TN93,
+    LogDet,
+    Poisson,
+    Kimura,
+};
+
+AnalyticMethod string_to_analytic_method(string name) throw (Exception);
+
+/*
+Closed-form pairwise distances, each with its delta-method variance:
+  DNA     - K2P, F84, TN93, LogDet (paralinear)
+  Protein - Poisson, Kimura
+  Both    - JC
+JC, Poisson and Kimura only need the number of differences and comparable
+sites; the others need the table of joint code counts from PackedSequences.
+Only cells where both codes are resolved states are used.
+JC, Poisson and Kimura distances are raised to at least DISTMIN, as
+Alignment's own JC distances are.
+With alpha > 0 the gamma-corrected forms are used, replacing -log(w) by
+alpha (w^(-1/alpha) - 1). LogDet has no gamma form and ignores alpha.
+F84 and TN93 take their base frequencies from the constructor, each raised
+to at least FREQMIN and the set rescaled to sum to 1.
+Instances are read-only after construction and can be shared between threads.
+*/
+class AnalyticDistances {
+public:
+    AnalyticDistances(string method, const vector<uint32_t>& code_masks, size_t nstates, double alpha=0,
+            const vector<double>& frequencies=vector<double>()) throw (Exception);
+    AnalyticDistances(const AnalyticDistances& other, const vector<uint32_t>& code_masks);
+    virtual ~AnalyticDistances();
+    AnalyticMethod get_method() const;
+    bool needs_joint_counts() const;
+    DistanceEstimate from_differences(size_t differences, size_t comparable) const;
+    DistanceEstimate from_joint_counts(const vector<double>& table) const;
+
+private:
+    void _index_codes(const vector<uint32_t>& code_masks);
+    double _f(double w) const;
+    double _df(double w) const;
+    DistanceEstimate _from_proportion(double p, double n) const;
+    DistanceEstimate _k2p(const vector<double>& f, double n) const;
+    DistanceEstimate _f84(const vector<double>& f, double n) const;
+    DistanceEstimate _tn93(const vector<double>& f, double n) const;
+    DistanceEstimate _logdet(const vector<double>& f, double n) const;
+    static double _delta_variance(const vector<double>& p, const vector<double>& g, double n);
+    static DistanceEstimate _saturated();
+    AnalyticMethod _method;
+    size_t _nstates;
+    size_t _ncodes;
+    double _alpha;
+    vector<double> _frequencies;
+    vector<int> _state_of_code;  // -1 for ambiguity codes
+};
+
+#endif /* ANALYTICDISTANCES_H_ */
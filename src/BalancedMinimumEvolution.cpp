@@ -0,0 +1,361 @@
+/*
+ * BalancedMinimumEvolution.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "BalancedMinimumEvolution.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <algorithm>
+#include <cmath>
+
+#define MIN_BRANCH_LENGTH 0.000001
+#define RELATIVE_TOLERANCE 1e-12
+
+/*
+edges is an unrooted binary tree on the n taxa of distances, as (parent, child)
+pairs in any orientation, such as NeighbourJoining::get_edges returns. Taxa
+are nodes 0..n-1; the internal nodes can carry any other ids.
+*/
+BalancedMinimumEvolution::BalancedMinimumEvolution(const CondensedMatrix& distances, const vector<pair<size_t, size_t>>& edges) :
+        _distances(distances), _n(distances.size()), _nnodes(2 * _n - 2), _length(0) {
+    if (_n < 3) throw Exception("BalancedMinimumEvolution: at least three sequences are needed");
+    if (edges.size() != 2 * _n - 3) throw Exception("BalancedMinimumEvolution: the starting tree must be binary and unrooted");
+
+    // Number the internal nodes n..2n-3 in order of appearance
+    vector<size_t> ids;
+    size_t next = _n;
+    auto renumber = [&](size_t node) {
+        if (node < _n) return node;
+        if (node >= ids.size()) ids.resize(node + 1, string::npos);
+        if (ids[node] == string::npos) ids[node] = next++;
+        return ids[node];
+    };
+    vector<vector<size_t>> neighbours(_nnodes);
+    for (auto& edge : edges) {
+        size_t u = renumber(edge.first), v = renumber(edge.second);
+        if (u >= _nnodes || v >= _nnodes) throw Exception("BalancedMinimumEvolution: the starting tree must be binary and unrooted");
+        neighbours[u].push_back(v);
+        neighbours[v].push_back(u);
+    }
+
+    // Hang the tree from taxon 0
+    _parent.assign(_nnodes, string::npos);
+    _children.assign(_nnodes, make_pair(string::npos, string::npos));
+    vector<char> seen(_nnodes, 0);
+    vector<size_t> stack{0};
+    seen[0] = 1;
+    while (!stack.empty()) {
+        size_t u = stack.back();
+        stack.pop_back();
+        if (neighbours[u].size() != (_is_leaf(u) ? 1u : 3u)) {
+            throw Exception("BalancedMinimumEvolution: the starting tree must be binary and unrooted");
+        }
+        vector<size_t> below;
+        for (size_t v : neighbours[u]) {
+            if (v == _parent[u]) continue;
+            if (seen[v]) throw Exception("BalancedMinimumEvolution: the starting tree has a cycle");
+            seen[v] = 1;
+            _parent[v] = u;
+            below.push_back(v);
+            stack.push_back(v);
+        }
+        if (below.size() > 0) _children[u].first = below[0];
+        if (below.size() > 1) _children[u].second = below[1];
+    }
+    if (count(seen.begin(), seen.end(), 1) != static_cast<long>(_nnodes)) {
+        throw Exception("BalancedMinimumEvolution: the starting tree is not connected");
+    }
+
+    _averages.resize(_nnodes * _nnodes);
+    _update_orders();
+    _update_averages();
+    _length = _tree_length();
+    _lengths.push_back(_length);
+}
+
+BalancedMinimumEvolution::~BalancedMinimumEvolution() {}
+
+/*
+Runs up to max_rounds rounds of moves, stopping early once no NNI or SPR
+shortens the tree by more than a relative RELATIVE_TOLERANCE.
+*/
+void BalancedMinimumEvolution::optimise(size_t max_rounds) {
+    for (size_t round = 0; round < max_rounds; ++round) {
+        double tolerance = RELATIVE_TOLERANCE * fabs(_length);
+        vector<Move> moves = _nni_moves();
+        moves.erase(remove_if(moves.begin(), moves.end(), [&](const Move& m) { return m.gain <= tolerance; }), moves.end());
+        if (moves.empty()) {
+            Move move = _best_spr();
+            if (move.gain <= tolerance) break;
+            _apply_spr(move);
+            _update_orders();
+            _update_averages();
+        }
+        else {
+            stable_sort(moves.begin(), moves.end(), [](const Move& a, const Move& b) { return a.gain > b.gain; });
+            vector<size_t> parents(_parent);
+            vector<pair<size_t, size_t>> children(_children);
+            vector<char> used(_nnodes, 0);
+            size_t applied = 0;
+            for (auto& move : moves) {
+                size_t p = _parent[move.node];
+                if (used[p] || used[move.node]) continue;
+                used[p] = used[move.node] = 1;
+                _apply_nni(move);
+                ++applied;
+            }
+            _update_orders();
+            _update_averages();
+            if (applied > 1 && _tree_length() > _length - tolerance) {
+                _parent.swap(parents);
+                _children.swap(children);
+                _apply_nni(moves[0]);
+                _update_orders();
+                _update_averages();
+            }
+        }
+        _length = _tree_length();
+        _lengths.push_back(_length);
+    }
+}
+
+double BalancedMinimumEvolution::get_length() const {
+    return _length;
+}
+
+// Tree length of the starting tree, then after each round
+const vector<double>& BalancedMinimumEvolution::get_lengths() const {
+    return _lengths;
+}
+
+// Newick string of the tree, with balanced OLS branch lengths
+string BalancedMinimumEvolution::get_tree() const {
+    return get_phylo_tree().to_newick();
+}
+
+PhyloTree BalancedMinimumEvolution::get_phylo_tree() const {
+    const vector<string>& names = _distances.get_names();
+    vector<Node*> nodes(_nnodes);
+    for (size_t v = 0; v < _nnodes; ++v) {
+        nodes[v] = _is_leaf(v) ? new Node(static_cast<int>(v), names[v]) : new Node(static_cast<int>(v));
+    }
+
+    // Unrooted, with the trifurcation at taxon 0's neighbour
+    size_t c0 = _children[0].first;
+    nodes[0]->setDistanceToFather(max(_edge_length(c0), MIN_BRANCH_LENGTH));
+    nodes[c0]->addSon(nodes[0]);
+    for (size_t i = 2; i < _preorder.size(); ++i) {
+        size_t v = _preorder[i];
+        nodes[v]->setDistanceToFather(max(_edge_length(v), MIN_BRANCH_LENGTH));
+        nodes[_parent[v]]->addSon(nodes[v]);
+    }
+
+    return PhyloTree(new TreeTemplate<Node>(nodes[c0]));
+}
+
+size_t BalancedMinimumEvolution::_sibling(size_t v) const {
+    const pair<size_t, size_t>& children = _children[_parent[v]];
+    return children.first == v ? children.second : children.first;
+}
+
+// Whether v is in D(u)
+bool BalancedMinimumEvolution::_contains(size_t u, size_t v) const {
+    return _position[v] >= _position[u] && _position[v] < _position[u] + _size[u];
+}
+
+// Balanced average distance between two disjoint subtrees
+double BalancedMinimumEvolution::_average(const Subtree& a, const Subtree& b) const {
+    if (b.up) return _averages[b.node * _nnodes + a.node];
+    return _averages[a.node * _nnodes + b.node];
+}
+
+void BalancedMinimumEvolution::_replace_child(size_t parent, size_t child, size_t replacement) {
+    pair<size_t, size_t>& children = _children[parent];
+    if (children.first == child) children.first = replacement;
+    else children.second = replacement;
+    _parent[replacement] = parent;
+}
+
+void BalancedMinimumEvolution::_update_orders() {
+    _preorder.clear();
+    _position.assign(_nnodes, 0);
+    _size.assign(_nnodes, 1);
+    vector<size_t> stack{0};
+    while (!stack.empty()) {
+        size_t u = stack.back();
+        stack.pop_back();
+        _position[u] = _preorder.size();
+        _preorder.push_back(u);
+        if (_children[u].second != string::npos) stack.push_back(_children[u].second);
+        if (_children[u].first != string::npos) stack.push_back(_children[u].first);
+    }
+    for (size_t i = _preorder.size(); i-- > 1;) {
+        _size[_parent[_preorder[i]]] += _size[_preorder[i]];
+    }
+}
+
+/*
+Fills the averages matrix. Row u holds, for v in D(u), the average between
+U(u) and D(v), and for every other v apart from u's ancestors, the average
+between D(u) and D(v). Taxon 0 is U(c0), c0 being its only child.
+*/
+void BalancedMinimumEvolution::_update_averages() {
+    size_t N = _nnodes;
+    double* A = _averages.data();
+
+    // Disjoint pairs, children before parents
+    vector<size_t> post(_preorder.rbegin(), _preorder.rend() - 1);
+    for (size_t iu = 0; iu < post.size(); ++iu) {
+        size_t u = post[iu];
+        double* row = A + u * N;
+        for (size_t iv = 0; iv < iu; ++iv) {
+            size_t v = post[iv];
+            if (_contains(u, v)) continue;
+            double average;
+            if (!_is_leaf(v)) average = .5 * (row[_children[v].first] + row[_children[v].second]);
+            else if (!_is_leaf(u)) average = .5 * (A[_children[u].first * N + v] + A[_children[u].second * N + v]);
+            else average = _distances(u, v);
+            row[v] = average;
+            A[v * N + u] = average;
+        }
+    }
+
+    // Taxon 0 against every subtree below it
+    size_t c0 = _children[0].first;
+    double* row = A + c0 * N;
+    for (size_t v : post) {
+        row[v] = _is_leaf(v) ? _distances(0, v) : .5 * (row[_children[v].first] + row[_children[v].second]);
+    }
+
+    // U(u) is made of U(parent) and D(sibling), parents before children
+    for (size_t iu = 2; iu < _preorder.size(); ++iu) {
+        size_t u = _preorder[iu];
+        double* out = A + u * N;
+        const double* up = A + _parent[u] * N;
+        const double* side = A + _sibling(u) * N;
+        for (size_t iv = iu; iv < iu + _size[u]; ++iv) {
+            size_t v = _preorder[iv];
+            out[v] = .5 * (up[v] + side[v]);
+        }
+    }
+}
+
+// Balanced OLS length of the edge above v
+double BalancedMinimumEvolution::_edge_length(size_t v) const {
+    const double* A = _averages.data();
+    size_t N = _nnodes;
+    size_t p = _parent[v];
+    if (p == 0) {
+        size_t c1 = _children[v].first, c2 = _children[v].second;
+        return .5 * (A[v * N + c1] + A[v * N + c2] - A[c1 * N + c2]);
+    }
+    size_t s = _sibling(v);
+    if (_is_leaf(v)) return .5 * (A[p * N + v] + A[v * N + s] - A[p * N + s]);
+    size_t a = _children[v].first, b = _children[v].second;
+    return .25 * (A[a * N + s] + A[p * N + b] + A[p * N + a] + A[b * N + s]) - .5 * (A[a * N + b] + A[p * N + s]);
+}
+
+double BalancedMinimumEvolution::_tree_length() const {
+    double length = 0;
+    for (size_t v = 1; v < _nnodes; ++v) length += _edge_length(v);
+    return length;
+}
+
+/*
+Around the edge above v, with v's children a and b, v's sibling s and the
+rest of the tree above: the better of the two NNIs that swap s with one of
+v's children, for every internal edge.
+*/
+vector<BalancedMinimumEvolution::Move> BalancedMinimumEvolution::_nni_moves() const {
+    const double* A = _averages.data();
+    size_t N = _nnodes;
+    vector<Move> moves;
+    for (size_t v = _n; v < _nnodes; ++v) {
+        size_t p = _parent[v];
+        if (p == 0) continue;
+        size_t s = _sibling(v), a = _children[v].first, b = _children[v].second;
+        double ab_cd = A[a * N + b] + A[p * N + s];
+        double swap_b = .25 * (ab_cd - A[a * N + s] - A[p * N + b]);
+        double swap_a = .25 * (ab_cd - A[b * N + s] - A[p * N + a]);
+        if (swap_b >= swap_a) moves.push_back({swap_b, v, b});
+        else moves.push_back({swap_a, v, a});
+    }
+    return moves;
+}
+
+/*
+Best SPR over every pruned subtree X = D(x) and every regraft edge. X first
+sits between O, the rest of the tree on one side of its old place, and a
+subtree Q on the other. Moving X onto the edge above Q1, one of Q's two
+parts, is an NNI on the tree that has X just above Q; the averages it needs
+between P, the tree minus X and Q, and Q2 are those of R, the complement of Q
+in the current tree, with X taken out and O lifted one level.
+*/
+BalancedMinimumEvolution::Move BalancedMinimumEvolution::_best_spr() const {
+    struct Step {
+        Subtree q;
+        Subtree r;
+        Subtree o;
+        double scale;   // Weight of X and O within R
+        double xp;      // Average between X and P
+        double gain;
+    };
+    auto parts = [&](const Subtree& q, Subtree* out) {
+        if (!q.up) {
+            if (_is_leaf(q.node)) return false;
+            out[0] = {_children[q.node].first, false};
+            out[1] = {_children[q.node].second, false};
+            return true;
+        }
+        size_t b = _parent[q.node];
+        if (b == 0) return false;
+        out[0] = {b, true};
+        out[1] = {_sibling(q.node), false};
+        return true;
+    };
+
+    Move best{0, string::npos, string::npos};
+    vector<Step> stack;
+    for (size_t i = 2; i < _preorder.size(); ++i) {
+        size_t x = _preorder[i], p = _parent[x], y = _sibling(x);
+        Subtree X{x, false};
+        stack.push_back({{y, false}, {y, true}, {p, true}, .5, _average({p, true}, X), 0});
+        stack.push_back({{p, true}, {p, false}, {y, false}, .5, _average({y, false}, X), 0});
+        while (!stack.empty()) {
+            Step step = stack.back();
+            stack.pop_back();
+            Subtree q[2];
+            if (!parts(step.q, q)) continue;
+            for (int k = 0; k < 2; ++k) {
+                const Subtree& q1 = q[k];
+                const Subtree& q2 = q[1 - k];
+                double xq2 = _average(X, q2);
+                double pq2 = _average(step.r, q2) + step.scale * (_average(step.o, q2) - xq2);
+                double gain = step.gain + .25 * (step.xp + _average(q1, q2) - _average(X, q1) - pq2);
+                if (gain > best.gain) best = {gain, x, q1.node};
+                stack.push_back({q1, {q1.node, !q1.up}, step.o, .5 * step.scale, .5 * (step.xp + xq2), gain});
+            }
+        }
+    }
+    return best;
+}
+
+// Swaps move.other, a child of move.node, with move.node's sibling
+void BalancedMinimumEvolution::_apply_nni(const Move& move) {
+    size_t v = move.node, p = _parent[v], s = _sibling(v);
+    _replace_child(p, s, move.other);
+    _replace_child(v, move.other, s);
+}
+
+// Prunes D(move.node) with its parent and regrafts it on the edge above move.other
+void BalancedMinimumEvolution::_apply_spr(const Move& move) {
+    size_t x = move.node, p = _parent[x], y = _sibling(x), w = move.other;
+    _replace_child(_parent[p], p, y);
+    _replace_child(_parent[w], w, p);
+    _children[p] = make_pair(x, w);
+    _parent[w] = p;
+}
@@ -0,0 +1,85 @@
+/*
+ * BalancedMinimumEvolution.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef BALANCEDMINIMUMEVOLUTION_H_
+#define BALANCEDMINIMUMEVOLUTION_H_
+
+#include "CondensedMatrix.h"
+#include "PhyloTree.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+Balanced minimum evolution (Desper & Gascuel 2002, FastME) refinement of a
+starting tree by NNI and SPR moves.
+The tree length minimised is Pauplin's sum over pairs of 2^(1 - tau_ij) d_ij,
+tau_ij being the number of edges between taxa i and j. The tree is held
+rooted at taxon 0, so every edge splits off a subtree below it, D(v), and one
+above it, U(v). Each round computes the balanced average distance between
+every pair of disjoint subtrees of this kind (O(n^2) time, and memory for
+(2n - 2)^2 doubles), from which the tree length, every NNI and every SPR can
+be scored exactly:
+- an NNI around edge AB|CD gains [(A,B) + (C,D) - (A,C) - (B,D)] / 4;
+- an SPR is a chain of such swaps walking the pruned subtree X away from
+  its place, and the averages of the subtree left behind, which no longer
+  holds X, follow from those of the full tree, so each regraft position costs
+  O(1) and all SPRs O(n^2).
+A round applies the improving NNIs that touch disjoint parts of the tree,
+or, if there are none, the best SPR. A batch of NNIs that fails to shorten
+the tree (their gains interact) is undone and only the best is applied.
+*/
+class BalancedMinimumEvolution {
+public:
+    BalancedMinimumEvolution(const CondensedMatrix& distances, const vector<pair<size_t, size_t>>& edges);
+    virtual ~BalancedMinimumEvolution();
+    void optimise(size_t max_rounds);
+    double get_length() const;
+    const vector<double>& get_lengths() const;
+    string get_tree() const;
+    PhyloTree get_phylo_tree() const;
+
+private:
+    struct Subtree {
+        size_t node;
+        bool up;        // U(node) rather than D(node)
+    };
+    struct Move {
+        double gain;
+        size_t node;    // NNI: lower end of the edge; SPR: root of the pruned subtree
+        size_t other;   // NNI: child of node swapped with its sibling; SPR: child end of the new edge
+    };
+    bool _is_leaf(size_t v) const { return v < _n; }
+    size_t _sibling(size_t v) const;
+    bool _contains(size_t u, size_t v) const;
+    double _average(const Subtree& a, const Subtree& b) const;
+    void _replace_child(size_t parent, size_t child, size_t replacement);
+    void _update_orders();
+    void _update_averages();
+    double _edge_length(size_t v) const;
+    double _tree_length() const;
+    vector<Move> _nni_moves() const;
+    Move _best_spr() const;
+    void _apply_nni(const Move& move);
+    void _apply_spr(const Move& move);
+    const CondensedMatrix& _distances;
+    size_t _n;
+    size_t _nnodes;
+    vector<size_t> _parent;            // npos for taxon 0, the root
+    vector<pair<size_t, size_t>> _children;  // npos for taxa; taxon 0 has one child
+    vector<size_t> _preorder;
+    vector<size_t> _position;          // Index of each node in _preorder
+    vector<size_t> _size;              // Nodes in D(v)
+    vector<double> _averages;          // _nnodes x _nnodes, see _update_averages
+    double _length;
+    vector<double> _lengths;
+};
+
+#endif /* BALANCEDMINIMUMEVOLUTION_H_ */
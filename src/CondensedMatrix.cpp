@@ -0,0 +1,146 @@
+/*
+ * CondensedMatrix.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "CondensedMatrix.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+CondensedMatrix::CondensedMatrix(const vector<string>& names) : _names(names) {
+    size_t n = names.size();
+    _values.assign(n > 1 ? n * (n - 1) / 2 : 0, 0);
+}
+
+CondensedMatrix::~CondensedMatrix() {}
+
+size_t CondensedMatrix::size() const {
+    return _names.size();
+}
+
+size_t CondensedMatrix::get_number_of_pairs() const {
+    return _values.size();
+}
+
+const vector<string>& CondensedMatrix::get_names() const {
+    return _names;
+}
+
+double CondensedMatrix::operator()(size_t i, size_t j) const {
+    if (i == j) return 0;
+    if (i > j) swap(i, j);
+    return _values[index(i, j, _names.size())];
+}
+
+void CondensedMatrix::set(size_t i, size_t j, double value) {
+    if (i == j) return;
+    if (i > j) swap(i, j);
+    _values[index(i, j, _names.size())] = value;
+}
+
+double* CondensedMatrix::data() {
+    return _values.data();
+}
+
+const double* CondensedMatrix::data() const {
+    return _values.data();
+}
+
+/*
+Appends rows and columns for new names. Existing values keep their pairs and
+the new cells are zero. Each old row is copied across in one block.
+*/
+void CondensedMatrix::add_names(const vector<string>& names) {
+    size_t n = _names.size();
+    size_t m = n + names.size();
+    vector<double> values(m > 1 ? m * (m - 1) / 2 : 0, 0);
+    for (size_t i = 0; i + 1 < n; ++i) {
+        copy(&_values[index(i, i + 1, n)], &_values[index(i, i + 1, n)] + (n - i - 1), &values[index(i, i + 1, m)]);
+    }
+    _names.insert(_names.end(), names.begin(), names.end());
+    _values.swap(values);
+}
+
+// Drops the rows and columns in indices, keeping the rest in their original order
+void CondensedMatrix::remove(const vector<size_t>& indices) {
+    size_t n = _names.size();
+    vector<bool> drop(n, false);
+    for (size_t i : indices) {
+        if (i >= n) throw Exception("CondensedMatrix: index out of range");
+        drop[i] = true;
+    }
+    vector<size_t> keep;
+    for (size_t i = 0; i < n; ++i) {
+        if (!drop[i]) keep.push_back(i);
+    }
+    size_t m = keep.size();
+    vector<double> values(m > 1 ? m * (m - 1) / 2 : 0);
+    vector<string> names;
+    for (size_t a = 0; a < m; ++a) {
+        names.push_back(_names[keep[a]]);
+        for (size_t b = a + 1; b < m; ++b) {
+            values[index(a, b, m)] = _values[index(keep[a], keep[b], n)];
+        }
+    }
+    _names.swap(names);
+    _values.swap(values);
+}
+
+// Writes the full n x n matrix, row-major, into out
+void CondensedMatrix::fill_square(double* out) const {
+    size_t n = _names.size();
+    for (size_t i = 0; i < n; ++i) {
+        out[i * n + i] = 0;
+        for (size_t j = i + 1; j < n; ++j) {
+            out[i * n + j] = out[j * n + i] = _values[index(i, j, n)];
+        }
+    }
+}
+
+// Writes only the strictly lower triangle of the n x n row-major matrix in out
+void CondensedMatrix::fill_lower(double* out) const {
+    size_t n = _names.size();
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = i + 1; j < n; ++j) {
+            out[j * n + i] = _values[index(i, j, n)];
+        }
+    }
+}
+
+// Square Bio++ copy, for code that still works on DistanceMatrix
+shared_ptr<DistanceMatrix> CondensedMatrix::to_distance_matrix() const {
+    size_t n = _names.size();
+    auto dm = make_shared<DistanceMatrix>(_names);
+    for (size_t i = 0; i < n; ++i) {
+        (*dm)(i, i) = 0;
+        for (size_t j = i + 1; j < n; ++j) {
+            (*dm)(i, j) = (*dm)(j, i) = _values[index(i, j, n)];
+        }
+    }
+    return dm;
+}
+
+// Position of pair (i, j), i < j, in the condensed buffer
+size_t CondensedMatrix::index(size_t i, size_t j, size_t n) {
+    return i * n - i * (i + 1) / 2 + (j - i - 1);
+}
+
+/*
+Maps k, an index into the n(n-1)/2 pairs (i, j) with i < j taken in row order,
+back to its row and column.
+*/
+void CondensedMatrix::pair_from_index(size_t k, size_t n, size_t& i, size_t& j) {
+    double nn = static_cast<double>(n);
+    double root = sqrt(4 * nn * (nn - 1) - 8 * static_cast<double>(k) - 7);
+    i = static_cast<size_t>(nn - 2 - floor(root / 2 - 0.5));
+    // Guard against rounding in the square root
+    while (i > 0 && i * n - i * (i + 1) / 2 > k) --i;
+    while ((i + 1) * n - (i + 1) * (i + 2) / 2 <= k) ++i;
+    j = k - (i * n - i * (i + 1) / 2) + i + 1;
+}
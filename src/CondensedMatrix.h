@@ -0,0 +1,49 @@
+/*
+ * CondensedMatrix.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef CONDENSEDMATRIX_H_
+#define CONDENSEDMATRIX_H_
+
+#include <Bpp/Seq/DistanceMatrix.h>
+
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+/*
+Symmetric matrix with a zero diagonal, stored as its upper triangle in one
+contiguous buffer of n(n-1)/2 doubles. Pairs (i, j), i < j, are laid out
+row by row, the same order as scipy.spatial.distance's condensed form.
+Distinct cells can be written from different threads without locking.
+*/
+class CondensedMatrix {
+public:
+    CondensedMatrix(const vector<string>& names);
+    virtual ~CondensedMatrix();
+    size_t size() const;
+    size_t get_number_of_pairs() const;
+    const vector<string>& get_names() const;
+    double operator()(size_t i, size_t j) const;
+    void set(size_t i, size_t j, double value);
+    void add_names(const vector<string>& names);
+    void remove(const vector<size_t>& indices);
+    double* data();
+    const double* data() const;
+    void fill_square(double* out) const;
+    void fill_lower(double* out) const;
+    shared_ptr<DistanceMatrix> to_distance_matrix() const;
+    static size_t index(size_t i, size_t j, size_t n);
+    static void pair_from_index(size_t k, size_t n, size_t& i, size_t& j);
+
+private:
+    vector<string> _names;
+    vector<double> _values;
+};
+
+#endif /* CONDENSEDMATRIX_H_ */
@@ -0,0 +1,213 @@
+/*
+ * DistanceShard.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "DistanceShard.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#define SHARD_VERSION 2
+#define MAX_SETTINGS_LENGTH 65536
+#define BYTE_ORDER_MARK 0x01020304
+
+static const char SHARD_MAGIC[8] = {'P', 'D', 'S', 'H', 'A', 'R', 'D', '\0'};
+
+template<typename T>
+void write_value(ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+T read_value(ifstream& in, const string& filename) {
+    T value;
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    if (!in) throw Exception("DistanceShard: " + filename + " is truncated");
+    return value;
+}
+
+DistanceShard::DistanceShard() : _nseq(0), _fingerprint(0), _first(0), _last(0) {}
+
+DistanceShard::DistanceShard(const vector<string>& names, size_t first_pair, size_t last_pair, string method,
+        string settings) :
+        _nseq(names.size()), _fingerprint(fingerprint(names)), _first(first_pair), _last(last_pair), _method(method),
+        _settings(settings) {
+    size_t npairs = _nseq > 1 ? _nseq * (_nseq - 1) / 2 : 0;
+    if (first_pair > last_pair || last_pair > npairs) throw Exception("DistanceShard: pair range out of bounds");
+}
+
+DistanceShard::~DistanceShard() {}
+
+size_t DistanceShard::get_number_of_sequences() const {
+    return _nseq;
+}
+
+uint64_t DistanceShard::get_fingerprint() const {
+    return _fingerprint;
+}
+
+size_t DistanceShard::get_first_pair() const {
+    return _first;
+}
+
+size_t DistanceShard::get_last_pair() const {
+    return _last;
+}
+
+string DistanceShard::get_method() const {
+    return _method;
+}
+
+string DistanceShard::get_settings() const {
+    return _settings;
+}
+
+vector<ShardRecord>& DistanceShard::get_records() {
+    return _records;
+}
+
+const vector<ShardRecord>& DistanceShard::get_records() const {
+    return _records;
+}
+
+void DistanceShard::write(string filename) const {
+    ofstream out(filename, ios::binary | ios::trunc);
+    if (!out) throw Exception("DistanceShard: can't open " + filename + " for writing");
+    out.write(SHARD_MAGIC, sizeof(SHARD_MAGIC));
+    write_value<uint32_t>(out, SHARD_VERSION);
+    write_value<uint32_t>(out, BYTE_ORDER_MARK);
+    write_value<uint64_t>(out, _nseq);
+    write_value<uint64_t>(out, _fingerprint);
+    write_value<uint64_t>(out, _first);
+    write_value<uint64_t>(out, _last);
+    write_value<uint64_t>(out, _records.size());
+    write_value<uint32_t>(out, static_cast<uint32_t>(_method.size()));
+    out.write(_method.data(), _method.size());
+    write_value<uint32_t>(out, static_cast<uint32_t>(_settings.size()));
+    out.write(_settings.data(), _settings.size());
+    for (auto& record : _records) {
+        write_value<uint64_t>(out, record.pair);
+        write_value<double>(out, record.distance);
+        write_value<double>(out, record.variance);
+        write_value<uint8_t>(out, record.converged ? 1 : 0);
+    }
+    out.close();
+    if (!out) throw Exception("DistanceShard: error writing " + filename);
+}
+
+DistanceShard DistanceShard::read(string filename) {
+    ifstream in(filename, ios::binary);
+    if (!in) throw Exception("DistanceShard: can't open " + filename);
+    char magic[sizeof(SHARD_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, SHARD_MAGIC, sizeof(magic)) != 0) throw Exception("DistanceShard: " + filename + " is not a distance shard");
+    if (read_value<uint32_t>(in, filename) != SHARD_VERSION) throw Exception("DistanceShard: " + filename + " has an unsupported version");
+    if (read_value<uint32_t>(in, filename) != BYTE_ORDER_MARK) throw Exception("DistanceShard: " + filename + " was written with a different byte order");
+    DistanceShard shard;
+    shard._nseq = read_value<uint64_t>(in, filename);
+    shard._fingerprint = read_value<uint64_t>(in, filename);
+    shard._first = read_value<uint64_t>(in, filename);
+    shard._last = read_value<uint64_t>(in, filename);
+    uint64_t nrecords = read_value<uint64_t>(in, filename);
+    uint32_t method_length = read_value<uint32_t>(in, filename);
+    if (method_length > 256) throw Exception("DistanceShard: " + filename + " is corrupt");
+    shard._method.resize(method_length);
+    in.read(&shard._method[0], method_length);
+    uint32_t settings_length = read_value<uint32_t>(in, filename);
+    if (settings_length > MAX_SETTINGS_LENGTH) throw Exception("DistanceShard: " + filename + " is corrupt");
+    shard._settings.resize(settings_length);
+    in.read(&shard._settings[0], settings_length);
+    if (!in) throw Exception("DistanceShard: " + filename + " is truncated");
+    size_t npairs = shard._nseq > 1 ? shard._nseq * (shard._nseq - 1) / 2 : 0;
+    if (shard._first > shard._last || shard._last > npairs || nrecords != shard._last - shard._first) {
+        throw Exception("DistanceShard: " + filename + " has an inconsistent pair range");
+    }
+    shard._records.reserve(nrecords);
+    for (uint64_t r = 0; r < nrecords; ++r) {
+        ShardRecord record;
+        record.pair = read_value<uint64_t>(in, filename);
+        record.distance = read_value<double>(in, filename);
+        record.variance = read_value<double>(in, filename);
+        record.converged = read_value<uint8_t>(in, filename) != 0;
+        shard._records.push_back(record);
+    }
+    return shard;
+}
+
+// Splits npairs into nshards contiguous ranges whose sizes differ by at most one
+void DistanceShard::shard_range(size_t npairs, size_t shard, size_t nshards, size_t& first_pair, size_t& last_pair) {
+    if (nshards == 0 || shard >= nshards) throw Exception("DistanceShard: shard index out of range");
+    size_t base = npairs / nshards, extra = npairs % nshards;
+    first_pair = shard * base + min(shard, extra);
+    last_pair = first_pair + base + (shard < extra ? 1 : 0);
+}
+
+// FNV-1a over the names, so shards from different alignments can't be mixed
+uint64_t DistanceShard::fingerprint(const vector<string>& names) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto& name : names) {
+        for (unsigned char c : name) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= 0xff;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+Reads shards into distances and variances, which must be sized for names.
+Checks that every shard belongs to this set of sequences and was made with
+the same method and settings, and that the shards cover each pair exactly once.
+Returns the number of pairs whose estimate did not converge.
+*/
+size_t DistanceShard::merge(const vector<string>& filenames, const vector<string>& names,
+        CondensedMatrix& distances, CondensedMatrix& variances) {
+    size_t n = names.size();
+    size_t npairs = n > 1 ? n * (n - 1) / 2 : 0;
+    uint64_t expected = fingerprint(names);
+    vector<bool> seen(npairs, false);
+    size_t covered = 0, nonconverged = 0;
+    string method, settings;
+    for (size_t f = 0; f < filenames.size(); ++f) {
+        DistanceShard shard = read(filenames[f]);
+        if (shard._nseq != n || shard._fingerprint != expected) {
+            throw Exception("DistanceShard: " + filenames[f] + " was computed from different sequences");
+        }
+        if (f == 0) {
+            method = shard._method;
+            settings = shard._settings;
+        }
+        else if (shard._method != method) {
+            throw Exception("DistanceShard: " + filenames[f] + " used method " + shard._method + ", expected " + method);
+        }
+        else if (shard._settings != settings) {
+            throw Exception("DistanceShard: " + filenames[f] + " used settings " + shard._settings + ", expected " + settings);
+        }
+        if (shard._last > npairs) throw Exception("DistanceShard: " + filenames[f] + " has pairs beyond the last");
+        for (auto& record : shard._records) {
+            if (record.pair < shard._first || record.pair >= shard._last) {
+                throw Exception("DistanceShard: " + filenames[f] + " holds a pair outside its range");
+            }
+            if (seen[record.pair]) throw Exception("DistanceShard: pair " + to_string(record.pair) + " appears in more than one shard");
+            seen[record.pair] = true;
+            ++covered;
+            size_t i, j;
+            CondensedMatrix::pair_from_index(record.pair, n, i, j);
+            distances.set(i, j, record.distance);
+            variances.set(i, j, record.variance);
+            if (!record.converged) ++nonconverged;
+        }
+    }
+    if (covered != npairs) {
+        size_t missing = find(seen.begin(), seen.end(), false) - seen.begin();
+        throw Exception("DistanceShard: shards cover " + to_string(covered) + " of " + to_string(npairs) +
+                " pairs (first missing pair is " + to_string(missing) + ")");
+    }
+    return nonconverged;
+}
@@ -0,0 +1,75 @@
+/*
+ * DistanceShard.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef DISTANCESHARD_H_
+#define DISTANCESHARD_H_
+
+#include "CondensedMatrix.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+struct ShardRecord {
+    uint64_t pair;       // Index into the condensed matrix
+    double distance;
+    double variance;
+    bool converged;
+};
+
+/*
+Partial result of a distance computation over a contiguous range
+[first_pair, last_pair) of the condensed pair index space, so that the pairs
+of one alignment can be split over independent processes.
+The file is a fixed header followed by one record per pair:
+    magic "PDSHARD\0", uint32 version, uint32 byte order mark,
+    uint64 number of sequences, uint64 fingerprint of the sequence names,
+    uint64 first_pair, uint64 last_pair, uint64 number of records,
+    uint32 method length, method name, uint32 settings length, settings,
+    records of uint64 pair, double distance, double variance, uint8 converged.
+Values are in native byte order; reading a file with the other byte order fails.
+The settings describe everything else the distances depend on (the model and
+rate parameters for ML, alpha for the analytic methods), so that shards made
+under different settings are not merged.
+*/
+class DistanceShard {
+public:
+    DistanceShard();
+    DistanceShard(const vector<string>& names, size_t first_pair, size_t last_pair, string method,
+            string settings="");
+    virtual ~DistanceShard();
+    size_t get_number_of_sequences() const;
+    uint64_t get_fingerprint() const;
+    size_t get_first_pair() const;
+    size_t get_last_pair() const;
+    string get_method() const;
+    string get_settings() const;
+    vector<ShardRecord>& get_records();
+    const vector<ShardRecord>& get_records() const;
+    void write(string filename) const;
+    static DistanceShard read(string filename);
+    static void shard_range(size_t npairs, size_t shard, size_t nshards, size_t& first_pair, size_t& last_pair);
+    static uint64_t fingerprint(const vector<string>& names);
+    static size_t merge(const vector<string>& filenames, const vector<string>& names,
+            CondensedMatrix& distances, CondensedMatrix& variances);
+
+private:
+    size_t _nseq;
+    uint64_t _fingerprint;
+    size_t _first;
+    size_t _last;
+    string _method;
+    string _settings;
+    vector<ShardRecord> _records;
+};
+
+#endif /* DISTANCESHARD_H_ */
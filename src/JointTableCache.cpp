@@ -0,0 +1,55 @@
+/*
+ * JointTableCache.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "JointTableCache.h"
+
+JointTableCache::JointTableCache(size_t npairs, size_t nthreads, size_t max_bytes) :
+        _locations(npairs), _entries(nthreads), _max_bytes(max_bytes),
+        _bytes(npairs * sizeof(Location)), _stored(0), _overflow(npairs * sizeof(Location) > max_bytes) {}
+
+JointTableCache::~JointTableCache() {}
+
+bool JointTableCache::is_complete() const {
+    return !_overflow && _stored == _locations.size();
+}
+
+// Each pair must be stored once, and only by the thread that passes its thread_id
+void JointTableCache::store(size_t pair, size_t thread_id, const vector<double>& table, size_t differences, size_t comparable) {
+    if (_overflow) return;
+    size_t nonzero = 0;
+    for (double count : table) {
+        if (count > 0) ++nonzero;
+    }
+    if (_bytes.fetch_add(nonzero * sizeof(Entry)) + nonzero * sizeof(Entry) > _max_bytes) {
+        _overflow = true;
+        return;
+    }
+    vector<Entry>& buffer = _entries[thread_id];
+    Location& location = _locations[pair];
+    location.offset = buffer.size();
+    location.thread = static_cast<uint32_t>(thread_id);
+    location.length = static_cast<uint32_t>(nonzero);
+    location.differences = static_cast<uint32_t>(differences);
+    location.comparable = static_cast<uint32_t>(comparable);
+    for (size_t c = 0; c < table.size(); ++c) {
+        if (table[c] > 0) buffer.push_back({static_cast<uint32_t>(c), static_cast<uint32_t>(table[c])});
+    }
+    ++_stored;
+}
+
+void JointTableCache::load(size_t pair, vector<size_t>& cells, vector<double>& counts, size_t& differences, size_t& comparable) const {
+    const Location& location = _locations[pair];
+    const Entry* entries = _entries[location.thread].data() + location.offset;
+    cells.clear();
+    counts.clear();
+    for (uint32_t e = 0; e < location.length; ++e) {
+        cells.push_back(entries[e].cell);
+        counts.push_back(entries[e].count);
+    }
+    differences = location.differences;
+    comparable = location.comparable;
+}
@@ -0,0 +1,53 @@
+/*
+ * JointTableCache.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef JOINTTABLECACHE_H_
+#define JOINTTABLECACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/*
+Sparse copy of every pair's joint code table, with its difference counts, so
+that ML distances can be re-estimated under new model parameters without
+going back to the sequences.
+Pairs are stored from several threads at once: each thread appends to its own
+buffer and records where the pair went. Storage is capped at max_bytes; once
+the cap is hit, later pairs are dropped and is_complete() stays false.
+*/
+class JointTableCache {
+public:
+    JointTableCache(size_t npairs, size_t nthreads, size_t max_bytes);
+    virtual ~JointTableCache();
+    bool is_complete() const;
+    void store(size_t pair, size_t thread_id, const vector<double>& table, size_t differences, size_t comparable);
+    void load(size_t pair, vector<size_t>& cells, vector<double>& counts, size_t& differences, size_t& comparable) const;
+
+private:
+    struct Location {
+        uint64_t offset;
+        uint32_t thread;
+        uint32_t length;
+        uint32_t differences;
+        uint32_t comparable;
+    };
+    struct Entry {
+        uint32_t cell;
+        uint32_t count;
+    };
+    vector<Location> _locations;
+    vector<vector<Entry>> _entries;  // One buffer per thread
+    size_t _max_bytes;
+    atomic<size_t> _bytes;
+    atomic<size_t> _stored;
+    atomic<bool> _overflow;
+};
+
+#endif /* JOINTTABLECACHE_H_ */
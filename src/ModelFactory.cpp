@@ -6,6 +6,7 @@
  */
 
 #include "ModelFactory.h"
+#include <algorithm>
 #include <map>
 #include <string>
 
@@ -150,3 +151,19 @@ shared_ptr<AbstractSubstitutionModel> ModelFactory::create(string model_name, ve
         throw Exception("ModelFactory::create() - unknown model. ");
     }
 }
+
+/*
+One name for each model in ModelMap, leaving out aliases (the first name in
+map order is kept) and the +F variants
+*/
+vector<string> ModelFactory::get_model_names() {
+    vector<string> names;
+    vector<Model> seen;
+    for (auto& entry : ModelMap) {
+        if (hasEnding(entry.first, "+F")) continue;
+        if (find(seen.begin(), seen.end(), entry.second) != seen.end()) continue;
+        seen.push_back(entry.second);
+        names.push_back(entry.first);
+    }
+    return names;
+}
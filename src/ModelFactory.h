@@ -29,6 +29,7 @@
 #include <memory>
 #include <map>
 #include <string>
+#include <vector>
 
 using namespace bpp;
 using namespace std;
@@ -59,6 +60,7 @@ public:
     static shared_ptr<AbstractSubstitutionModel> create(string model_name) throw (Exception);
     static shared_ptr<AbstractSubstitutionModel> create(Model model, bool parameterise_freqs) throw (Exception);
     static shared_ptr<AbstractSubstitutionModel> create(string model_name, vector<double> freqs) throw (Exception);
+    static vector<string> get_model_names();
 };
 
 #endif /* MODELFACTORY_H_ */
@@ -0,0 +1,170 @@
+/*
+ * ModelSelection.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "ModelSelection.h"
+#include "ModelFactory.h"
+
+#include <Bpp/Exceptions.h>
+#include <Bpp/Phyl/Model/FrequenciesSet/FrequenciesSet.h>
+#include <Bpp/Numeric/Prob/ConstantDistribution.h>
+#include <Bpp/Numeric/Prob/GammaDiscreteDistribution.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#define GAMMA_CATEGORIES 4
+#define SKIP_MARGIN 1.0
+
+ModelSelection::ModelSelection(const PackedSequences& packed, const vector<string>& names, const PhyloTree& tree,
+        const vector<double>& empirical_freqs, ThreadPool* pool) :
+        _empirical_freqs(empirical_freqs), _nsites(packed.get_number_of_sites()), _pool(pool) {
+    size_t nstates = packed.get_number_of_states();
+    shared_ptr<AbstractSubstitutionModel> first;
+    for (auto& name : ModelFactory::get_model_names()) {
+        auto model = ModelFactory::create(name);
+        if (model->getNumberOfStates() != nstates) continue;
+        if (!first) first = model;
+        for (bool gamma : {true, false}) {
+            for (bool freqs : {false, true}) {
+                if (freqs && nstates != 20) continue;
+                _candidates.push_back({name, freqs, gamma});
+            }
+        }
+    }
+    if (!first) throw Exception("ModelSelection: no models for this alphabet");
+    if (_empirical_freqs.size() != nstates) throw Exception("ModelSelection: expected one frequency per state");
+    _patterns = make_unique<ParallelTreeLikelihood>(packed, names, tree, first, make_shared<ConstantDistribution>(1.0), pool);
+}
+
+ModelSelection::~ModelSelection() {}
+
+vector<string> ModelSelection::get_candidate_names() const {
+    vector<string> names;
+    for (auto& candidate : _candidates) names.push_back(_name(candidate));
+    return names;
+}
+
+/*
+Fits the candidates and returns them best first by criterion ("aic", "aicc"
+or "bic"), with any skipped at the end. tolerance is the gain in lnL at which
+each fit stops.
+*/
+vector<ModelFit> ModelSelection::run(string criterion, bool skip, double tolerance) {
+    if (criterion != "aic" && criterion != "aicc" && criterion != "bic") {
+        throw Exception("ModelSelection: unrecognised criterion " + criterion);
+    }
+    size_t ncandidates = _candidates.size();
+    vector<ModelFit> fits(ncandidates);
+    vector<size_t> with_gamma, without_gamma;
+    for (size_t i = 0; i < ncandidates; ++i) {
+        fits[i] = {_name(_candidates[i]), NAN, 0, NAN, NAN, NAN, false};
+        (_candidates[i].gamma ? with_gamma : without_gamma).push_back(i);
+    }
+    _fit(with_gamma, tolerance, fits);
+
+    vector<size_t> remaining;
+    double best = numeric_limits<double>::infinity();
+    for (size_t i : with_gamma) best = min(best, _score(fits[i], fits[i].log_likelihood, criterion));
+    for (size_t i : without_gamma) {
+        const Candidate& candidate = _candidates[i];
+        if (skip) {
+            auto counterpart = find_if(with_gamma.begin(), with_gamma.end(), [&](size_t j) {
+                return _candidates[j].model == candidate.model && _candidates[j].freqs == candidate.freqs;
+            });
+            ModelFit& bound = fits[*counterpart];
+            // One parameter fewer than the counterpart: the gamma shape
+            fits[i].parameters = bound.parameters - 1;
+            if (_score(fits[i], bound.log_likelihood + SKIP_MARGIN, criterion) > best) {
+                fits[i].skipped = true;
+                continue;
+            }
+        }
+        remaining.push_back(i);
+    }
+    _fit(remaining, tolerance, fits);
+
+    auto key = [&](const ModelFit& fit) {
+        return fit.skipped ? numeric_limits<double>::infinity() : _score(fit, fit.log_likelihood, criterion);
+    };
+    stable_sort(fits.begin(), fits.end(), [&](const ModelFit& a, const ModelFit& b) { return key(a) < key(b); });
+    return fits;
+}
+
+/*
+Fits the candidates indexed by which, in parallel, filling in their entries
+in fits. The models are made beforehand, on this thread.
+*/
+void ModelSelection::_fit(const vector<size_t>& which, double tolerance, vector<ModelFit>& fits) {
+    size_t n = which.size();
+    vector<shared_ptr<AbstractSubstitutionModel>> models(n);
+    vector<shared_ptr<DiscreteDistribution>> rates(n);
+    for (size_t j = 0; j < n; ++j) {
+        const Candidate& candidate = _candidates[which[j]];
+        models[j] = candidate.freqs ? ModelFactory::create(candidate.model, _empirical_freqs)
+                                    : ModelFactory::create(candidate.model);
+        if (candidate.gamma) {
+            auto gamma = make_shared<GammaDiscreteDistribution>(GAMMA_CATEGORIES, 1.0, 1.0, 1e-12, 1e-12);
+            gamma->aliasParameters("alpha", "beta");
+            rates[j] = gamma;
+        }
+        else {
+            rates[j] = make_shared<ConstantDistribution>(1.0);
+        }
+    }
+    auto run = [&](size_t j, size_t) {
+        const Candidate& candidate = _candidates[which[j]];
+        ModelFit& fit = fits[which[j]];
+        ParameterList parameters = _free_parameters(*models[j], candidate.freqs);
+        if (candidate.gamma) parameters.addParameters(rates[j]->getIndependentParameters());
+        ParallelTreeLikelihood likelihood(*_patterns, models[j], rates[j]);
+        fit.log_likelihood = likelihood.optimise_parameters(parameters, false, tolerance);
+        fit.parameters = likelihood.get_number_of_branches() + parameters.size();
+        if (candidate.freqs) fit.parameters += models[j]->getNumberOfStates() - 1;
+        fit.aic = _score(fit, fit.log_likelihood, "aic");
+        fit.aicc = _score(fit, fit.log_likelihood, "aicc");
+        fit.bic = _score(fit, fit.log_likelihood, "bic");
+    };
+    if (_pool && _pool->size() > 1 && n > 1) {
+        _pool->parallel_for(0, n, run);
+    }
+    else {
+        for (size_t j = 0; j < n; ++j) run(j, 0);
+    }
+}
+
+/*
+The model's independent parameters, less those of its frequency set if
+fixed_freqs: +F frequencies stay at their empirical values.
+*/
+ParameterList ModelSelection::_free_parameters(const SubstitutionModel& model, bool fixed_freqs) const {
+    ParameterList all = model.getIndependentParameters();
+    if (!fixed_freqs) return all;
+    const FrequenciesSet* freqs = model.getFrequenciesSet();
+    if (!freqs) throw Exception("ModelSelection: " + model.getName() + " has no frequency set");
+    ParameterList parameters;
+    for (size_t i = 0; i < all.size(); ++i) {
+        if (!freqs->getParameters().hasParameter(all[i].getName())) parameters.addParameter(all[i]);
+    }
+    return parameters;
+}
+
+string ModelSelection::_name(const Candidate& candidate) const {
+    return candidate.model + (candidate.freqs ? "+F" : "") + (candidate.gamma ? "+G" : "");
+}
+
+// The criterion for fit's number of parameters, at log_likelihood; lower is better
+double ModelSelection::_score(const ModelFit& fit, double log_likelihood, const string& criterion) const {
+    double k = fit.parameters;
+    double n = _nsites;
+    double aic = 2 * k - 2 * log_likelihood;
+    if (criterion == "aic") return aic;
+    if (criterion == "aicc") {
+        return n - k - 1 > 0 ? aic + 2 * k * (k + 1) / (n - k - 1) : numeric_limits<double>::infinity();
+    }
+    return k * log(n) - 2 * log_likelihood;
+}
@@ -0,0 +1,75 @@
+/*
+ * ModelSelection.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef MODELSELECTION_H_
+#define MODELSELECTION_H_
+
+#include "PackedSequences.h"
+#include "ParallelTreeLikelihood.h"
+#include "PhyloTree.h"
+#include "ThreadPool.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+// One candidate's fit, from ModelSelection::run
+struct ModelFit {
+    string name;               // A ModelFactory name, with +F and +G as fitted
+    double log_likelihood;     // NaN if skipped
+    size_t parameters;         // Branch lengths, model and rate parameters, and frequencies for +F
+    double aic;
+    double aicc;
+    double bic;
+    bool skipped;
+};
+
+/*
+Fits every substitution model that suits the alignment's alphabet, from
+ModelFactory::get_model_names, with and without gamma rates (+G, with
+GAMMA_CATEGORIES categories), and, for proteins, with and without empirical
+frequencies (+F: held fixed, but counted as nstates - 1 parameters), on one
+fixed tree topology. Branch lengths and the other model parameters are
+optimised for each.
+The sites are compressed into patterns once, and each candidate's likelihood
+copies them. Candidates are fitted in parallel on the pool, each also
+splitting its own chunks across it.
+The +G candidates are fitted first. With skip set, a candidate without +G is
+then left out if, scored with its +G counterpart's lnL (an upper bound, as
+gamma rates tend to constant ones as alpha grows), it would still lose to the
+best so far by more than SKIP_MARGIN. Which candidates are skipped does not
+depend on timing.
+*/
+class ModelSelection {
+public:
+    ModelSelection(const PackedSequences& packed, const vector<string>& names, const PhyloTree& tree,
+            const vector<double>& empirical_freqs, ThreadPool* pool);
+    virtual ~ModelSelection();
+    vector<string> get_candidate_names() const;
+    vector<ModelFit> run(string criterion="bic", bool skip=true, double tolerance=0.001);
+
+private:
+    struct Candidate {
+        string model;
+        bool freqs;
+        bool gamma;
+    };
+    void _fit(const vector<size_t>& which, double tolerance, vector<ModelFit>& fits);
+    ParameterList _free_parameters(const SubstitutionModel& model, bool fixed_freqs) const;
+    string _name(const Candidate& candidate) const;
+    double _score(const ModelFit& fit, double log_likelihood, const string& criterion) const;
+    unique_ptr<ParallelTreeLikelihood> _patterns;    // Holds the compressed patterns and tree
+    vector<Candidate> _candidates;
+    vector<double> _empirical_freqs;
+    size_t _nsites;
+    ThreadPool* _pool;
+};
+
+#endif /* MODELSELECTION_H_ */
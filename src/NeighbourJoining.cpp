@@ -0,0 +1,384 @@
+/*
+ * NeighbourJoining.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "NeighbourJoining.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#define MIN_BRANCH_LENGTH 0.000001
+#define MIN_CANDIDATES 64
+#define PARALLEL_ROWS 512
+
+NeighbourJoining::NeighbourJoining(const CondensedMatrix& distances, const CondensedMatrix& variances, ThreadPool* pool) :
+        _names(distances.get_names()), _n(_names.size()), _active(_n), _pool(pool), _bounded(false), _max_candidates(0),
+        _visited(0), _cells(0), _built(false) {
+    if (variances.size() != _n) throw Exception("NeighbourJoining: distances and variances differ in size");
+    if (_n < 2) throw Exception("NeighbourJoining: at least two sequences are needed to build a tree");
+    _dists.resize(_n * (_n - 1) / 2);
+    _vars.resize(_dists.size());
+    _sums.assign(_n, 0);
+    _for_each_row(_n, [&](size_t i, size_t) {
+        for (size_t j = 0; j < i; ++j) {
+            _dists[_cell(i, j)] = distances(j, i);
+            _vars[_cell(i, j)] = variances(j, i);
+        }
+        for (size_t j = 0; j < _n; ++j) {
+            if (j != i) _sums[i] += distances(i, j);
+        }
+    });
+    for (size_t i = 0; i < _n; ++i) {
+        _ids.push_back(i);
+        _nodes.push_back(i);
+    }
+    _q.assign(_pool ? _pool->size() : 1, vector<double>(_n));
+    _row_of_node.assign(2 * _n, string::npos);
+    for (size_t i = 0; i < _n; ++i) _row_of_node[i] = i;
+}
+
+NeighbourJoining::~NeighbourJoining() {}
+
+/*
+Use the bounded search, with max_bytes for the sorted rows; call before
+get_tree. Rows keep at least MIN_CANDIDATES entries whatever max_bytes is:
+shorter lists are used up before a row can be abandoned, and every row then
+falls back to a full scan.
+*/
+void NeighbourJoining::set_bounded_search(size_t max_bytes) {
+    if (_built) throw Exception("NeighbourJoining: the tree has already been built");
+    _bounded = true;
+    _max_candidates = min(max(max_bytes / (_n * sizeof(Candidate)), static_cast<size_t>(MIN_CANDIDATES)), _n - 1);
+}
+
+// Newick string of the BioNJ tree, unrooted unless there are only two sequences
+string NeighbourJoining::get_tree() {
+    return get_phylo_tree().to_newick();
+}
+
+PhyloTree NeighbourJoining::get_phylo_tree() {
+    _build();
+    return PhyloTree(_to_tree());
+}
+
+/*
+The tree as (parent, child) edges. Taxa are nodes 0..n-1, the joins follow in
+order, and the root, which has the last two or three clusters as children,
+comes last.
+*/
+vector<pair<size_t, size_t>> NeighbourJoining::get_edges() {
+    _build();
+    vector<pair<size_t, size_t>> edges;
+    for (size_t k = 0; k < _joins.size(); ++k) {
+        edges.push_back(make_pair(_n + k, _joins[k].left));
+        edges.push_back(make_pair(_n + k, _joins[k].right));
+    }
+    for (size_t r = 0; r < _active; ++r) {
+        edges.push_back(make_pair(_n + _joins.size(), _nodes[r]));
+    }
+    return edges;
+}
+
+// Fraction of the criterion evaluations of a full scan that the search made
+double NeighbourJoining::get_visited_fraction() const {
+    return _cells == 0 ? 1 : static_cast<double>(_visited) / static_cast<double>(_cells);
+}
+
+// Joins clusters down to the last two or three; only the first call does anything
+void NeighbourJoining::_build() {
+    if (_built) return;
+    if (_bounded) {
+        _candidates.resize(_n);
+        _truncated.resize(_n);
+        for (size_t i = 0; i < _active; ++i) _sort_row(i);
+    }
+    while (_active > 3) {
+        size_t a, b;
+        _cells += _active * (_active - 1) / 2;
+        if (_bounded) _find_best_pair_bounded(a, b);
+        else _find_best_pair(a, b);
+        _join(a, b);
+    }
+    _built = true;
+}
+
+/*
+Maximises S_i + S_j - (r - 2) D_ij over active rows i > j. Only rows whose
+maximum reaches the best so far are searched again for the pair.
+With a pool, rows are shared out (longest first) and each thread keeps its
+own best. The order _offer imposes is total, so merging the threads' bests
+gives the serial answer whatever the split.
+*/
+void NeighbourJoining::_find_best_pair(size_t& a, size_t& b) {
+    double m = static_cast<double>(_active - 2);
+    vector<BestPair> bests(_q.size(), {-numeric_limits<double>::infinity(), 0, 0, false});
+    _for_each_row(_active, [&](size_t k, size_t t) {
+        size_t i = _active - 1 - k;
+        if (i > 0) _offer_row(bests[t], i, i, _fill_row(i, i, m, _q[t].data()), _q[t].data());
+    });
+    _visited += _active * (_active - 1) / 2;
+    _merge_bests(bests, a, b);
+}
+
+/*
+Same maximum as _find_best_pair. A first pass takes each row's nearest live
+neighbour to get a good bound, then each row is read in distance order until
+S_i + max(S) - (r - 2) D_ij drops below the best. Since S_j <= max(S), and
+rounding is monotonic, the bound is never below the criterion it stands for.
+With a pool, each thread prunes against its own best, which can only be
+lower than the overall one: the pair found is the same, though the number
+of pairs visited can vary from run to run.
+*/
+void NeighbourJoining::_find_best_pair_bounded(size_t& a, size_t& b) {
+    double m = static_cast<double>(_active - 2);
+    double smax = *max_element(_sums.begin(), _sums.begin() + _active);
+    BestPair seed = {-numeric_limits<double>::infinity(), 0, 0, false};
+    for (size_t i = 0; i < _active; ++i) {
+        for (auto& candidate : _candidates[i]) {
+            size_t j = _row_of_node[candidate.node];
+            if (j == string::npos) continue;
+            ++_visited;
+            _offer(seed, i, j, _sums[i] + _sums[j] - m * candidate.distance);
+            break;
+        }
+    }
+
+    vector<BestPair> bests(_q.size(), seed);
+    vector<size_t> visited(_q.size(), 0);
+    _for_each_row(_active, [&](size_t i, size_t t) {
+        BestPair& best = bests[t];
+        double si = _sums[i];
+        size_t live = 0, stale = 0;
+        bool abandoned = false;
+        for (auto& candidate : _candidates[i]) {
+            size_t j = _row_of_node[candidate.node];
+            if (j == string::npos) {
+                ++stale;
+                continue;
+            }
+            if (si + smax - m * candidate.distance < best.criterion) {
+                abandoned = true;
+                break;
+            }
+            ++live;
+            _offer(best, i, j, si + _sums[j] - m * candidate.distance);
+        }
+        visited[t] += live;
+        if (!abandoned && _truncated[i]) {
+            _offer_row(best, i, _active, _fill_row(i, _active, m, _q[t].data()), _q[t].data());
+            visited[t] += _active - 1;
+        }
+        if (stale > live + 16) _drop_stale(i);
+    });
+    for (size_t v : visited) _visited += v;
+    _merge_bests(bests, a, b);
+}
+
+/*
+Fills q[j] with the criterion of rows (i, j) for j < last, j != i, and
+returns the largest. The part of the row below the diagonal is contiguous
+and is filled with four running maxima, so consecutive cells don't wait on
+each other.
+*/
+double NeighbourJoining::_fill_row(size_t i, size_t last, double m, double* q) const {
+    const double* sums = _sums.data();
+    double si = sums[i];
+    double lanes[4];
+    fill(lanes, lanes + 4, -numeric_limits<double>::infinity());
+    const double* row = i > 0 ? &_dists[i * (i - 1) / 2] : nullptr;
+    size_t below = min(i, last);
+    size_t j = 0;
+    for (; j + 4 <= below; j += 4) {
+        for (size_t k = 0; k < 4; ++k) {
+            double v = si + sums[j + k] - m * row[j + k];
+            q[j + k] = v;
+            lanes[k] = v > lanes[k] ? v : lanes[k];
+        }
+    }
+    for (; j < below; ++j) {
+        double v = si + sums[j] - m * row[j];
+        q[j] = v;
+        lanes[0] = v > lanes[0] ? v : lanes[0];
+    }
+    if (i < last) q[i] = -numeric_limits<double>::infinity();
+    for (j = i + 1; j < last; ++j) {
+        double v = si + sums[j] - m * _dists[_cell(j, i)];
+        q[j] = v;
+        lanes[j % 4] = v > lanes[j % 4] ? v : lanes[j % 4];
+    }
+    return *max_element(lanes, lanes + 4);
+}
+
+// Offers the cells of q[0..last) equal to rowmax, the maximum of row i
+void NeighbourJoining::_offer_row(BestPair& best, size_t i, size_t last, double rowmax, const double* q) const {
+    if (!(rowmax > best.criterion || (best.found && rowmax == best.criterion))) return;
+    for (size_t j = 0; j < last; ++j) {
+        if (q[j] == rowmax) _offer(best, i, j, rowmax);
+    }
+}
+
+void NeighbourJoining::_offer(BestPair& best, size_t i, size_t j, double criterion) const {
+    if (criterion > best.criterion || (best.found && criterion == best.criterion && _before(i, j, best.a, best.b))) {
+        best = {criterion, i, j, true};
+    }
+}
+
+void NeighbourJoining::_merge_bests(const vector<BestPair>& bests, size_t& a, size_t& b) const {
+    BestPair best = {-numeric_limits<double>::infinity(), 0, 0, false};
+    for (auto& other : bests) {
+        if (other.found) _offer(best, other.a, other.b, other.criterion);
+    }
+    if (!best.found) throw Exception("Unexpected error: no maximum criterium found.");
+    a = best.a;
+    b = best.b;
+}
+
+// f(row, thread_id) for rows [0, count), on the pool if there is one and the rows are worth it
+void NeighbourJoining::_for_each_row(size_t count, const function<void(size_t, size_t)>& f) {
+    if (_pool && _pool->size() > 1 && count >= PARALLEL_ROWS) {
+        _pool->parallel_for(0, count, f, 8);
+    }
+    else {
+        for (size_t i = 0; i < count; ++i) f(i, 0);
+    }
+}
+
+// Rebuilds a row's list of the nearest active clusters
+void NeighbourJoining::_sort_row(size_t row) {
+    vector<Candidate>& candidates = _candidates[row];
+    candidates.clear();
+    for (size_t k = 0; k < _active; ++k) {
+        if (k != row) candidates.push_back({_dists[_cell(row, k)], _nodes[k]});
+    }
+    auto closer = [](const Candidate& x, const Candidate& y) { return x.distance < y.distance; };
+    _truncated[row] = candidates.size() > _max_candidates;
+    if (_truncated[row]) {
+        nth_element(candidates.begin(), candidates.begin() + _max_candidates, candidates.end(), closer);
+        candidates.resize(_max_candidates);
+    }
+    sort(candidates.begin(), candidates.end(), closer);
+    candidates.shrink_to_fit();
+}
+
+// Removes joined clusters from a row's list, re-sorting it if too little is left
+void NeighbourJoining::_drop_stale(size_t row) {
+    vector<Candidate>& candidates = _candidates[row];
+    auto stale = [&](const Candidate& c) { return _row_of_node[c.node] == string::npos; };
+    candidates.erase(remove_if(candidates.begin(), candidates.end(), stale), candidates.end());
+    if (_truncated[row] && candidates.size() < _max_candidates / 2) _sort_row(row);
+}
+
+// Whether the pair of clusters in rows (i, j) sorts before the pair in rows (a, b)
+bool NeighbourJoining::_before(size_t i, size_t j, size_t a, size_t b) const {
+    pair<size_t, size_t> ij = minmax(_ids[i], _ids[j]);
+    pair<size_t, size_t> ab = minmax(_ids[a], _ids[b]);
+    return ij < ab;
+}
+
+void NeighbourJoining::_join(size_t a, size_t b) {
+    if (_ids[b] < _ids[a]) swap(a, b);
+    double m = static_cast<double>(_active - 2);
+    double dab = _dists[_cell(a, b)];
+    double vab = _vars[_cell(a, b)];
+    double ratio = (_sums[a] - _sums[b]) / m;
+    double la = max(.5 * (dab + ratio), MIN_BRANCH_LENGTH);
+    double lb = max(.5 * (dab - ratio), MIN_BRANCH_LENGTH);
+    _joins.push_back({_nodes[a], _nodes[b], la, lb});
+
+    // BioNJ weight of a against b, from the variances
+    double lambda = .5;
+    if (vab != 0) {
+        lambda = 0;
+        for (size_t k = 0; k < _active; ++k) {
+            if (k != a && k != b) lambda += _vars[_cell(b, k)] - _vars[_cell(a, k)];
+        }
+        lambda /= 2 * m * vab;
+        lambda += .5;
+    }
+    lambda = min(max(lambda, 0.), 1.);
+
+    // Rows are independent; the new row's sum is taken afterwards, in order
+    _for_each_row(_active, [&](size_t k, size_t) {
+        if (k == a || k == b) return;
+        size_t ak = _cell(a, k), bk = _cell(b, k);
+        double dak = _dists[ak], dbk = _dists[bk];
+        double d = max(lambda * (dak - la) + (1 - lambda) * (dbk - lb), 0.);
+        _vars[ak] = lambda * _vars[ak] + (1 - lambda) * _vars[bk] - lambda * (1 - lambda) * vab;
+        _dists[ak] = d;
+        _sums[k] += d - dak - dbk;
+    });
+    double sum = 0;
+    for (size_t k = 0; k < _active; ++k) {
+        if (k != a && k != b) sum += _dists[_cell(a, k)];
+    }
+    _sums[a] = sum;
+    size_t node = _n + _joins.size() - 1;
+    _row_of_node[_nodes[a]] = _row_of_node[_nodes[b]] = string::npos;
+    _nodes[a] = node;
+    _row_of_node[node] = a;
+    _remove_row(b);
+    if (_bounded) _sort_row(_row_of_node[node]);
+}
+
+// Moves the last active row into row, and drops the last row
+void NeighbourJoining::_remove_row(size_t row) {
+    size_t last = --_active;
+    if (row != last) {
+        for (size_t k = 0; k < last; ++k) {
+            if (k == row) continue;
+            _dists[_cell(row, k)] = _dists[_cell(last, k)];
+            _vars[_cell(row, k)] = _vars[_cell(last, k)];
+        }
+        _sums[row] = _sums[last];
+        _ids[row] = _ids[last];
+        _nodes[row] = _nodes[last];
+        _row_of_node[_nodes[row]] = row;
+        if (_bounded) {
+            _candidates[row].swap(_candidates[last]);
+            _truncated[row] = _truncated[last];
+        }
+    }
+    if (_bounded) vector<Candidate>().swap(_candidates[last]);
+}
+
+TreeTemplate<Node>* NeighbourJoining::_to_tree() const {
+    vector<Node*> nodes;
+    for (size_t i = 0; i < _n; ++i) nodes.push_back(new Node(static_cast<int>(i), _names[i]));
+    for (auto& join : _joins) {
+        Node* parent = new Node(static_cast<int>(nodes.size()));
+        nodes[join.left]->setDistanceToFather(join.left_length);
+        nodes[join.right]->setDistanceToFather(join.right_length);
+        parent->addSon(nodes[join.left]);
+        parent->addSon(nodes[join.right]);
+        nodes.push_back(parent);
+    }
+
+    // The remaining clusters hang from the root in cluster id order
+    vector<size_t> rows(_active);
+    for (size_t k = 0; k < _active; ++k) rows[k] = k;
+    sort(rows.begin(), rows.end(), [&](size_t x, size_t y) { return _ids[x] < _ids[y]; });
+    Node* root = new Node(static_cast<int>(nodes.size()));
+    if (_active == 2) {
+        double d = _dists[_cell(rows[0], rows[1])] / 2;
+        for (size_t r : rows) {
+            nodes[_nodes[r]]->setDistanceToFather(d);
+            root->addSon(nodes[_nodes[r]]);
+        }
+    }
+    else {
+        for (size_t k = 0; k < 3; ++k) {
+            size_t x = rows[k], y = rows[(k + 1) % 3], z = rows[(k + 2) % 3];
+            double d = max(_dists[_cell(x, y)] + _dists[_cell(x, z)] - _dists[_cell(y, z)], MIN_BRANCH_LENGTH);
+            nodes[_nodes[x]]->setDistanceToFather(d / 2.);
+            root->addSon(nodes[_nodes[x]]);
+        }
+    }
+
+    return new TreeTemplate<Node>(root);
+}
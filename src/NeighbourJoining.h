@@ -0,0 +1,110 @@
+/*
+ * NeighbourJoining.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef NEIGHBOURJOINING_H_
+#define NEIGHBOURJOINING_H_
+
+#include "CondensedMatrix.h"
+#include "PhyloTree.h"
+#include "ThreadPool.h"
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+BioNJ (Gascuel 1997) over flat arrays.
+The distances and variances of the active clusters are kept as packed lower
+triangles indexed by row position, rather than by cluster. When two clusters
+are joined the new cluster takes the row of the one with the smaller id, and
+the last active row is moved into the freed row, so the active rows are
+always 0..r-1 and the Q-criterion scan runs over contiguous memory.
+Row sums are updated after each join instead of being recomputed.
+Ties in the criterion go to the pair with the smallest cluster ids, which is
+the pair the std::map-based implementation picked, so the tree is the same.
+Given a pool, the criterion scan and the row updates after a join are split
+across its threads; the tree is identical to the one built without a pool.
+The pool must not be running another parallel_for on this thread.
+
+set_bounded_search switches from scanning every pair to the RapidNJ search
+(Simonsen, Mailund & Pedersen 2008). Each row keeps its distances sorted
+ascending, so a row can be abandoned as soon as S_i + max(S) - (r - 2) D_ij
+falls below the best criterion found; the bound is exact, so the tree is the
+same as with the full scan. The sorted lists share max_bytes: a row whose
+list was cut short and not abandoned is finished from the matrix. Entries for
+clusters that have since been joined are skipped, and dropped from a list
+once they outnumber the live ones it has served.
+*/
+class NeighbourJoining {
+public:
+    NeighbourJoining(const CondensedMatrix& distances, const CondensedMatrix& variances, ThreadPool* pool=nullptr);
+    virtual ~NeighbourJoining();
+    void set_bounded_search(size_t max_bytes);
+    string get_tree();
+    PhyloTree get_phylo_tree();
+    vector<pair<size_t, size_t>> get_edges();
+    double get_visited_fraction() const;
+
+private:
+    struct Candidate {
+        double distance;
+        size_t node;
+    };
+    struct BestPair {
+        double criterion;
+        size_t a;
+        size_t b;
+        bool found;
+    };
+    struct Join {
+        size_t left;
+        size_t right;
+        double left_length;
+        double right_length;
+    };
+    size_t _cell(size_t i, size_t j) const {
+        return i > j ? i * (i - 1) / 2 + j : j * (j - 1) / 2 + i;
+    }
+    void _build();
+    void _find_best_pair(size_t& a, size_t& b);
+    void _find_best_pair_bounded(size_t& a, size_t& b);
+    double _fill_row(size_t i, size_t last, double m, double* q) const;
+    void _offer_row(BestPair& best, size_t i, size_t last, double rowmax, const double* q) const;
+    void _offer(BestPair& best, size_t i, size_t j, double criterion) const;
+    void _merge_bests(const vector<BestPair>& bests, size_t& a, size_t& b) const;
+    void _for_each_row(size_t count, const function<void(size_t, size_t)>& f);
+    void _sort_row(size_t row);
+    void _drop_stale(size_t row);
+    void _join(size_t a, size_t b);
+    void _remove_row(size_t row);
+    bool _before(size_t i, size_t j, size_t a, size_t b) const;
+    TreeTemplate<Node>* _to_tree() const;
+    vector<string> _names;
+    size_t _n;
+    size_t _active;
+    vector<double> _dists;    // Lower triangle of the active rows
+    vector<double> _vars;
+    vector<double> _sums;     // Row sums of _dists
+    vector<size_t> _ids;      // Cluster id of each row: the smallest taxon index it holds
+    vector<size_t> _nodes;    // Tree node of each row: taxa are 0..n-1, joins n, n+1, ...
+    vector<vector<double>> _q;  // Criterion for one row per thread, see _fill_row
+    vector<size_t> _row_of_node;  // Inverse of _nodes, npos once a node is joined
+    vector<Join> _joins;
+    ThreadPool* _pool;
+    bool _bounded;
+    size_t _max_candidates;       // Sorted list length per row
+    vector<vector<Candidate>> _candidates;
+    vector<char> _truncated;      // Whether a row's sorted list was cut short
+    size_t _visited;              // Criterion evaluations
+    size_t _cells;                // Evaluations the full scan would make
+    bool _built;
+};
+
+#endif /* NEIGHBOURJOINING_H_ */
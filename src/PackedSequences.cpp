@@ -0,0 +1,264 @@
+/*
+ * PackedSequences.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "PackedSequences.h"
+
+#include <Bpp/Exceptions.h>
+#include <Bpp/Seq/Site.h>
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PACKED_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#define DNA_PLANES 4
+#define PROTEIN_PLANES 5
+
+/*
+Kernel arguments: a and b point at the first plane of two sequences, planes
+are `stride` words apart and the validity plane follows the state planes.
+Counts are accumulated over words [first, last).
+For DNA the planes are one-hot masks, so two valid sites agree if they share
+a set bit; for protein the planes hold code bits, so they differ if any
+plane differs.
+*/
+typedef void (*DifferenceKernel)(const uint64_t*, const uint64_t*, size_t, size_t, size_t, size_t&, size_t&);
+
+template<bool OneHot, size_t NPlanes>
+inline void count_word(const uint64_t* a, const uint64_t* b, size_t stride, size_t w, uint64_t& diff_word, uint64_t& comp_word) {
+    comp_word = a[NPlanes * stride + w] & b[NPlanes * stride + w];
+    uint64_t acc = 0;
+    for (size_t p = 0; p < NPlanes; ++p) {
+        if (OneHot) acc |= a[p * stride + w] & b[p * stride + w];
+        else acc |= a[p * stride + w] ^ b[p * stride + w];
+    }
+    diff_word = OneHot ? comp_word & ~acc : comp_word & acc;
+}
+
+template<bool OneHot, size_t NPlanes>
+void scalar_kernel(const uint64_t* a, const uint64_t* b, size_t stride, size_t first, size_t last, size_t& differences, size_t& comparable) {
+    size_t d = 0, c = 0;
+    uint64_t diff_word, comp_word;
+    for (size_t w = first; w < last; ++w) {
+        count_word<OneHot, NPlanes>(a, b, stride, w, diff_word, comp_word);
+        d += __builtin_popcountll(diff_word);
+        c += __builtin_popcountll(comp_word);
+    }
+    differences += d;
+    comparable += c;
+}
+
+#ifdef PACKED_X86_KERNELS
+// Same loop as the scalar kernel, compiled to use the POPCNT instruction
+template<bool OneHot, size_t NPlanes>
+__attribute__((target("popcnt")))
+void popcnt_kernel(const uint64_t* a, const uint64_t* b, size_t stride, size_t first, size_t last, size_t& differences, size_t& comparable) {
+    size_t d = 0, c = 0;
+    uint64_t diff_word, comp_word;
+    for (size_t w = first; w < last; ++w) {
+        count_word<OneHot, NPlanes>(a, b, stride, w, diff_word, comp_word);
+        d += _mm_popcnt_u64(diff_word);
+        c += _mm_popcnt_u64(comp_word);
+    }
+    differences += d;
+    comparable += c;
+}
+
+// Per-byte popcount by nibble lookup, summed into four 64-bit lanes
+__attribute__((target("avx2")))
+inline __m256i popcount256(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+template<bool OneHot, size_t NPlanes>
+__attribute__((target("avx2,popcnt")))
+void avx2_kernel(const uint64_t* a, const uint64_t* b, size_t stride, size_t first, size_t last, size_t& differences, size_t& comparable) {
+    size_t w = first;
+    __m256i dsum = _mm256_setzero_si256();
+    __m256i csum = _mm256_setzero_si256();
+    for (; w + 4 <= last; w += 4) {
+        __m256i comp = _mm256_and_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + NPlanes * stride + w)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + NPlanes * stride + w)));
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t p = 0; p < NPlanes; ++p) {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + p * stride + w));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + p * stride + w));
+            acc = _mm256_or_si256(acc, OneHot ? _mm256_and_si256(va, vb) : _mm256_xor_si256(va, vb));
+        }
+        __m256i diff = OneHot ? _mm256_andnot_si256(acc, comp) : _mm256_and_si256(acc, comp);
+        dsum = _mm256_add_epi64(dsum, popcount256(diff));
+        csum = _mm256_add_epi64(csum, popcount256(comp));
+    }
+    uint64_t d[4], c[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(d), dsum);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(c), csum);
+    differences += d[0] + d[1] + d[2] + d[3];
+    comparable += c[0] + c[1] + c[2] + c[3];
+    popcnt_kernel<OneHot, NPlanes>(a, b, stride, w, last, differences, comparable);
+}
+#endif
+
+struct KernelChoice {
+    DifferenceKernel dna;
+    DifferenceKernel protein;
+    string name;
+};
+
+KernelChoice choose_kernels() {
+#ifdef PACKED_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return {avx2_kernel<true, DNA_PLANES>, avx2_kernel<false, PROTEIN_PLANES>, "avx2"};
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return {popcnt_kernel<true, DNA_PLANES>, popcnt_kernel<false, PROTEIN_PLANES>, "popcnt"};
+    }
+#endif
+    return {scalar_kernel<true, DNA_PLANES>, scalar_kernel<false, PROTEIN_PLANES>, "scalar"};
+}
+
+const KernelChoice& get_kernels() {
+    static const KernelChoice kernels = choose_kernels();
+    return kernels;
+}
+
+const uint8_t PackedSequences::NO_CODE;
+
+PackedSequences::PackedSequences(const VectorSiteContainer& sites) {
+    const Alphabet* alphabet = sites.getAlphabet();
+    _nseq = sites.getNumberOfSequences();
+    _nsites = sites.getNumberOfSites();
+    _nstates = alphabet->getSize();
+    if (_nstates == 4) _nplanes = DNA_PLANES;
+    else if (_nstates == 20) _nplanes = PROTEIN_PLANES;
+    else throw Exception("PackedSequences: only DNA and protein alignments can be packed");
+    _nwords = ((_nsites + 63) / 64 + 3) / 4 * 4;
+    _data.assign(_nseq * (_nplanes + 1) * _nwords, 0);
+
+    int nstates = static_cast<int>(_nstates);
+    int unknown = alphabet->getUnknownCharacterCode();
+    bool dna = is_dna();
+    _codes.assign(_nseq * _nsites, NO_CODE);
+    _ncodes = _nstates;
+    for (size_t j = 0; j < _nsites; ++j) {
+        const Site& site = sites.getSite(j);
+        size_t w = j / 64;
+        uint64_t bit = static_cast<uint64_t>(1) << (j % 64);
+        for (size_t i = 0; i < _nseq; ++i) {
+            int code = site[i];
+            if (code >= 0 && code != unknown && code < NO_CODE) {
+                _codes[i * _nsites + j] = static_cast<uint8_t>(code);
+                _ncodes = max(_ncodes, static_cast<size_t>(code) + 1);
+            }
+            if (code < 0 || code >= nstates) continue;  // Gap, unknown or ambiguous
+            uint64_t* seq = &_data[i * (_nplanes + 1) * _nwords];
+            if (dna) {
+                seq[code * _nwords + w] |= bit;
+            }
+            else {
+                for (size_t p = 0; p < _nplanes; ++p) {
+                    if (code & (1 << p)) seq[p * _nwords + w] |= bit;
+                }
+            }
+            seq[_nplanes * _nwords + w] |= bit;
+        }
+    }
+
+    _code_masks.assign(_ncodes, 0);
+    for (size_t c = 0; c < _ncodes; ++c) {
+        if (static_cast<int>(c) == unknown) continue;
+        for (int state : alphabet->getAlias(static_cast<int>(c))) {
+            if (state >= 0 && state < nstates) _code_masks[c] |= static_cast<uint32_t>(1) << state;
+        }
+    }
+}
+
+PackedSequences::~PackedSequences() {}
+
+size_t PackedSequences::get_number_of_sequences() const {
+    return _nseq;
+}
+
+size_t PackedSequences::get_number_of_sites() const {
+    return _nsites;
+}
+
+size_t PackedSequences::get_number_of_states() const {
+    return _nstates;
+}
+
+size_t PackedSequences::get_number_of_words() const {
+    return _nwords;
+}
+
+bool PackedSequences::is_dna() const {
+    return _nplanes == DNA_PLANES;
+}
+
+size_t PackedSequences::get_number_of_codes() const {
+    return _ncodes;
+}
+
+const uint8_t* PackedSequences::get_codes(size_t i) const {
+    return &_codes[i * _nsites];
+}
+
+const vector<uint32_t>& PackedSequences::get_code_masks() const {
+    return _code_masks;
+}
+
+/*
+Adds the joint code counts of sequences i and j to table, a row-major
+get_number_of_codes() x get_number_of_codes() matrix (row = code in i).
+Sites where either sequence has a gap or unknown character are skipped.
+*/
+void PackedSequences::count_joint(size_t i, size_t j, vector<double>& table) const {
+    count_joint(i, j, 0, _nsites, table);
+}
+
+// Range version over sites [first_site, last_site), for callers that tile the sites
+void PackedSequences::count_joint(size_t i, size_t j, size_t first_site, size_t last_site, vector<double>& table) const {
+    const uint8_t* a = get_codes(i);
+    const uint8_t* b = get_codes(j);
+    for (size_t k = first_site; k < last_site; ++k) {
+        if (a[k] != NO_CODE && b[k] != NO_CODE) table[a[k] * _ncodes + b[k]] += 1;
+    }
+}
+
+/*
+Counts the sites where both sequences hold a resolved state (comparable),
+and how many of those differ (differences).
+*/
+void PackedSequences::count_differences(size_t i, size_t j, size_t& differences, size_t& comparable) const {
+    differences = 0;
+    comparable = 0;
+    count_differences(i, j, 0, _nwords, differences, comparable);
+}
+
+// Accumulating version over a range of words, for callers that tile the sites
+void PackedSequences::count_differences(size_t i, size_t j, size_t first_word, size_t last_word, size_t& differences, size_t& comparable) const {
+    const KernelChoice& kernels = get_kernels();
+    DifferenceKernel kernel = is_dna() ? kernels.dna : kernels.protein;
+    kernel(_plane(i, 0), _plane(j, 0), _nwords, first_word, last_word, differences, comparable);
+}
+
+string PackedSequences::get_kernel_name() {
+    return get_kernels().name;
+}
+
+const uint64_t* PackedSequences::_plane(size_t seq, size_t plane) const {
+    return &_data[(seq * (_nplanes + 1) + plane) * _nwords];
+}
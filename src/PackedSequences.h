@@ -0,0 +1,66 @@
+/*
+ * PackedSequences.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef PACKEDSEQUENCES_H_
+#define PACKEDSEQUENCES_H_
+
+#include <Bpp/Seq/Container/VectorSiteContainer.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+/*
+Bit-sliced copy of an alignment for fast pairwise counting.
+Each sequence is stored as a set of bit planes, 64 sites per word:
+  DNA     - 4 planes holding the nucleotide mask of each site (A, C, G, T)
+  Protein - 5 planes holding the bits of the amino acid code (0-19)
+plus a validity plane marking the sites that hold a single resolved state.
+Gaps, unknown and ambiguous characters are invalid, and sites where either
+sequence is invalid are ignored by the counting kernels.
+A byte per site is also kept for joint-state counting: resolved states and
+ambiguity codes keep their alphabet code, gaps and unknowns become NO_CODE.
+get_code_masks gives the set of states compatible with each code.
+The counting kernel (AVX2, hardware popcount or portable scalar) is picked
+once at runtime from what the CPU supports.
+*/
+class PackedSequences {
+public:
+    PackedSequences(const VectorSiteContainer& sites);
+    virtual ~PackedSequences();
+    size_t get_number_of_sequences() const;
+    size_t get_number_of_sites() const;
+    size_t get_number_of_states() const;
+    size_t get_number_of_words() const;
+    bool is_dna() const;
+    size_t get_number_of_codes() const;
+    const uint8_t* get_codes(size_t i) const;
+    const vector<uint32_t>& get_code_masks() const;
+    void count_joint(size_t i, size_t j, vector<double>& table) const;
+    void count_joint(size_t i, size_t j, size_t first_site, size_t last_site, vector<double>& table) const;
+    void count_differences(size_t i, size_t j, size_t& differences, size_t& comparable) const;
+    void count_differences(size_t i, size_t j, size_t first_word, size_t last_word, size_t& differences, size_t& comparable) const;
+    static string get_kernel_name();
+    static const uint8_t NO_CODE = 0xff;
+
+private:
+    const uint64_t* _plane(size_t seq, size_t plane) const;
+    size_t _nseq;
+    size_t _nsites;
+    size_t _nstates;
+    size_t _nwords;   // Words per plane, padded to a multiple of 4
+    size_t _nplanes;  // Not counting the validity plane, which is stored last
+    size_t _ncodes;
+    vector<uint64_t> _data;
+    vector<uint8_t> _codes;
+    vector<uint32_t> _code_masks;
+};
+
+#endif /* PACKEDSEQUENCES_H_ */
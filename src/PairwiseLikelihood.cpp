@@ -0,0 +1,180 @@
+/*
+ * PairwiseLikelihood.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "PairwiseLikelihood.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#define MAX_NEWTON_ITERATIONS 100
+#define MAX_STEP_HALVINGS 30
+
+const double PairwiseLikelihood::MIN_DISTANCE = 0.000001;
+const double PairwiseLikelihood::MAX_DISTANCE = 10000;
+
+PairwiseLikelihood::PairwiseLikelihood(const SubstitutionModel& model, const DiscreteDistribution& rates, const vector<uint32_t>& code_masks) {
+    if (!model.isDiagonalizable()) throw Exception("PairwiseLikelihood: the substitution model is not diagonalizable");
+    _nstates = model.getNumberOfStates();
+    _ncodes = code_masks.size();
+    const Vdouble& eigenvalues = model.getEigenValues();
+    const Matrix<double>& right = model.getColumnRightEigenVectors();
+    const Matrix<double>& left = model.getRowLeftEigenVectors();
+    const Vdouble& freqs = model.getFrequencies();
+    double rate = model.getRate();
+    for (size_t k = 0; k < _nstates; ++k) {
+        _eigenvalues.push_back(eigenvalues[k] * rate);
+    }
+    for (size_t c = 0; c < rates.getNumberOfCategories(); ++c) {
+        _category_rates.push_back(rates.getCategory(c));
+        _category_probs.push_back(rates.getProbability(c));
+    }
+
+    // P_ab(t) = sum_k right(a, k) exp(lambda_k t) left(k, b)
+    _coefficients.assign(_ncodes * _ncodes * _nstates, 0);
+    for (size_t x = 0; x < _ncodes; ++x) {
+        for (size_t y = 0; y < _ncodes; ++y) {
+            double* coef = &_coefficients[(x * _ncodes + y) * _nstates];
+            for (size_t a = 0; a < _nstates; ++a) {
+                if (!(code_masks[x] >> a & 1)) continue;
+                for (size_t b = 0; b < _nstates; ++b) {
+                    if (!(code_masks[y] >> b & 1)) continue;
+                    for (size_t k = 0; k < _nstates; ++k) {
+                        coef[k] += freqs[a] * right(a, k) * left(k, b);
+                    }
+                }
+            }
+        }
+    }
+}
+
+PairwiseLikelihood::~PairwiseLikelihood() {}
+
+size_t PairwiseLikelihood::get_number_of_codes() const {
+    return _ncodes;
+}
+
+/*
+Log likelihood of a joint count table at distance t, with its first and
+second derivatives with respect to t.
+*/
+void PairwiseLikelihood::evaluate(const vector<double>& table, double t, double& lnl, double& d1, double& d2) const {
+    vector<size_t> cells;
+    vector<double> counts;
+    nonzero_cells(table, cells, counts);
+    vector<double> e(3 * _nstates);
+    _evaluate(cells, counts, t, e, lnl, d1, d2);
+}
+
+/*
+Maximises the likelihood of a joint count table over the distance, by Newton's
+method with step halving, starting from `initial` and stopping once a step is
+shorter than `tolerance`. The variance is the inverse of the observed
+information at the estimate.
+*/
+DistanceEstimate PairwiseLikelihood::estimate(const vector<double>& table, double initial, double tolerance) const {
+    vector<size_t> cells;
+    vector<double> counts;
+    nonzero_cells(table, cells, counts);
+    return estimate(cells, counts, initial, tolerance);
+}
+
+/*
+As above, for a table given as its nonzero cells and their counts.
+With screen_tolerance > 0, `initial` is taken as a previous estimate: if the
+Newton step from it is shorter than screen_tolerance it is returned as is,
+after a single evaluation.
+*/
+DistanceEstimate PairwiseLikelihood::estimate(const vector<size_t>& cells, const vector<double>& counts, double initial,
+        double tolerance, double screen_tolerance) const {
+    vector<double> e(3 * _nstates);
+    double t = min(max(initial, MIN_DISTANCE), MAX_DISTANCE);
+    double lnl, d1, d2;
+    _evaluate(cells, counts, t, e, lnl, d1, d2);
+    if (screen_tolerance > 0 && d2 < 0 && fabs(d1 / d2) < screen_tolerance) {
+        return {t, -1.0 / d2, true};
+    }
+
+    bool converged = false;
+    for (size_t iter = 0; iter < MAX_NEWTON_ITERATIONS; ++iter) {
+        double step;
+        if (d2 < 0) step = -d1 / d2;
+        else step = d1 > 0 ? t : -t / 2;  // Not concave here, so just move uphill
+        double t_new = min(max(t + step, MIN_DISTANCE), MAX_DISTANCE);
+        if (t_new == t) {
+            converged = true;  // Pinned against a bound
+            break;
+        }
+        double lnl_new, d1_new, d2_new;
+        _evaluate(cells, counts, t_new, e, lnl_new, d1_new, d2_new);
+        size_t halvings = 0;
+        while (!(lnl_new >= lnl) && halvings < MAX_STEP_HALVINGS) {
+            step /= 2;
+            t_new = min(max(t + step, MIN_DISTANCE), MAX_DISTANCE);
+            _evaluate(cells, counts, t_new, e, lnl_new, d1_new, d2_new);
+            ++halvings;
+        }
+        if (!(lnl_new >= lnl)) break;
+        bool done = fabs(t_new - t) < tolerance;
+        t = t_new;
+        lnl = lnl_new;
+        d1 = d1_new;
+        d2 = d2_new;
+        if (done) {
+            converged = true;
+            break;
+        }
+    }
+    return {t, -1.0 / d2, converged};
+}
+
+// Sparse form of a joint count table, as used by estimate
+void PairwiseLikelihood::nonzero_cells(const vector<double>& table, vector<size_t>& cells, vector<double>& counts) {
+    cells.clear();
+    counts.clear();
+    for (size_t c = 0; c < table.size(); ++c) {
+        if (table[c] > 0) {
+            cells.push_back(c);
+            counts.push_back(table[c]);
+        }
+    }
+}
+
+void PairwiseLikelihood::_evaluate(const vector<size_t>& cells, const vector<double>& counts, double t, vector<double>& e, double& lnl, double& d1, double& d2) const {
+    size_t s = _nstates;
+    for (size_t k = 0; k < s; ++k) {
+        double e0 = 0, e1 = 0, e2 = 0;
+        for (size_t c = 0; c < _category_rates.size(); ++c) {
+            double lr = _eigenvalues[k] * _category_rates[c];
+            double x = _category_probs[c] * exp(lr * t);
+            e0 += x;
+            e1 += lr * x;
+            e2 += lr * lr * x;
+        }
+        e[k] = e0;
+        e[s + k] = e1;
+        e[2 * s + k] = e2;
+    }
+    lnl = d1 = d2 = 0;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const double* coef = &_coefficients[cells[i] * s];
+        double l0 = 0, l1 = 0, l2 = 0;
+        for (size_t k = 0; k < s; ++k) {
+            l0 += coef[k] * e[k];
+            l1 += coef[k] * e[s + k];
+            l2 += coef[k] * e[2 * s + k];
+        }
+        // Rounding in the eigenvectors can push tiny probabilities below zero
+        l0 = max(l0, numeric_limits<double>::min());
+        double g = l1 / l0;
+        lnl += counts[i] * log(l0);
+        d1 += counts[i] * g;
+        d2 += counts[i] * (l2 / l0 - g * g);
+    }
+}
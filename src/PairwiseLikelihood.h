@@ -0,0 +1,60 @@
+/*
+ * PairwiseLikelihood.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef PAIRWISELIKELIHOOD_H_
+#define PAIRWISELIKELIHOOD_H_
+
+#include <Bpp/Phyl/Model/SubstitutionModel.h>
+#include <Bpp/Numeric/Prob/DiscreteDistribution.h>
+
+#include <cstdint>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+struct DistanceEstimate {
+    double distance;
+    double variance;
+    bool converged;
+};
+
+/*
+Maximum likelihood distance between two sequences, computed from the table of
+joint code counts of the pair rather than from the sites themselves.
+The model's eigendecomposition is expanded once into one coefficient vector per
+cell of the table, so that for codes x, y and time t
+    L_xy(t) = sum_k A_xyk E_k(t),   E_k(t) = sum_c w_c exp(lambda_k r_c t)
+where w_c, r_c are the gamma categories. Ambiguity codes sum over their
+compatible states. lnL and its first and second derivatives in t then cost
+O(cells x states) per evaluation, independent of alignment length.
+Instances are read-only after construction and can be shared between threads.
+*/
+class PairwiseLikelihood {
+public:
+    PairwiseLikelihood(const SubstitutionModel& model, const DiscreteDistribution& rates, const vector<uint32_t>& code_masks);
+    virtual ~PairwiseLikelihood();
+    size_t get_number_of_codes() const;
+    void evaluate(const vector<double>& table, double t, double& lnl, double& d1, double& d2) const;
+    DistanceEstimate estimate(const vector<double>& table, double initial, double tolerance=1e-6) const;
+    DistanceEstimate estimate(const vector<size_t>& cells, const vector<double>& counts, double initial,
+            double tolerance=1e-6, double screen_tolerance=0) const;
+    static void nonzero_cells(const vector<double>& table, vector<size_t>& cells, vector<double>& counts);
+    static const double MIN_DISTANCE;
+    static const double MAX_DISTANCE;
+
+private:
+    void _evaluate(const vector<size_t>& cells, const vector<double>& counts, double t, vector<double>& e, double& lnl, double& d1, double& d2) const;
+    size_t _nstates;
+    size_t _ncodes;
+    vector<double> _eigenvalues;      // Scaled by the model rate
+    vector<double> _category_rates;
+    vector<double> _category_probs;
+    vector<double> _coefficients;     // ncodes x ncodes x nstates
+};
+
+#endif /* PAIRWISELIKELIHOOD_H_ */
@@ -0,0 +1,1780 @@
+/*
+ * ParallelTreeLikelihood.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "ParallelTreeLikelihood.h"
+
+#include <Bpp/Exceptions.h>
+#include <Bpp/Numeric/AutoParameter.h>
+#include <Bpp/Numeric/Function/Functions.h>
+#include <Bpp/Numeric/Function/SimpleMultiDimensions.h>
+#include <Bpp/Numeric/Number.h>
+#include <Bpp/Phyl/Node.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Phyl/TreeTools.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+#include <tuple>
+#include <unordered_map>
+
+#define PATTERN_CHUNK 256
+#define SCALE_EXPONENT 256
+#define MIN_BRANCH_LENGTH 0.000001
+#define MAX_BRANCH_LENGTH 100
+#define MAX_NEWTON_ITERATIONS 30
+#define NEWTON_TOLERANCE 0.000001
+#define MAX_EVALUATIONS 1000000
+#define SUPPORT_TOLERANCE 0.0001
+#define LBFGS_MEMORY 10
+#define LBFGS_FIRST_STEP 0.1
+#define ARMIJO_FRACTION 0.0001
+#define MAX_LINE_SEARCH_STEPS 30
+#define POISSON_TABLE_MEAN 64
+#define POISSON_GUIDE_SLOTS 256
+#define RELL_POISSON_MARGIN 3
+
+namespace {
+
+/*
+lnL as a bpp Function of the model and rate parameters, so that bpp's
+optimisers can drive the parameter search while the evaluations run here.
+*/
+class ModelParametersFunction : public virtual Function, public AbstractParametrizable {
+public:
+    ModelParametersFunction(ParallelTreeLikelihood& likelihood, SubstitutionModel& model,
+            DiscreteDistribution& rates, const ParameterList& parameters) :
+            AbstractParametrizable(""), _likelihood(likelihood), _model(model), _rates(rates) {
+        addParameters_(parameters);
+        _value = -_likelihood.get_log_likelihood();
+    }
+    ModelParametersFunction* clone() const { return new ModelParametersFunction(*this); }
+    void setParameters(const ParameterList& parameters) throw (ParameterNotFoundException, ConstraintException) {
+        matchParametersValues(parameters);
+    }
+    double getValue() const throw (Exception) { return _value; }
+    void fireParameterChanged(const ParameterList& parameters) {
+        _model.matchParametersValues(parameters);
+        _rates.matchParametersValues(parameters);
+        _likelihood.update_model();
+        _value = -_likelihood.get_log_likelihood();
+    }
+
+private:
+    ParallelTreeLikelihood& _likelihood;
+    SubstitutionModel& _model;
+    DiscreteDistribution& _rates;
+    double _value;
+};
+
+// SplitMix64 (Steele et al. 2014): cheap to seed, and each key gives its own stream
+struct SplitMix64 {
+    typedef uint64_t result_type;
+    uint64_t state;
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return numeric_limits<uint64_t>::max(); }
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+};
+
+/*
+Draws RELL replicates as multinomial pattern counts: as many draws as there
+are sites, each pattern taken in proportion to its weight. Each pattern gets
+an independent Poisson count with mean lambda times its weight, lambda a
+little under 1. Given their sum S these counts are multinomial with S draws,
+and the remaining sites - S draws are made site by site. A replicate with S
+over the number of sites is drawn again. That is O(patterns + sqrt(sites))
+per replicate, against O(sites) for drawing every site.
+Patterns of equal weight share a Poisson table: the cumulative probabilities
+and a guide to where each of POISSON_GUIDE_SLOTS slices of [0, 1) starts
+(Chen & Asau 1974), so most counts take one uniform and one lookup. Means
+over POISSON_TABLE_MEAN use the library sampler.
+*/
+class RellSampler {
+public:
+    RellSampler(const vector<double>& weights, const vector<size_t>& site_patterns) :
+            _site_patterns(site_patterns), _table_of_pattern(weights.size()) {
+        double nsites = static_cast<double>(site_patterns.size());
+        double lambda = nsites > 0 ? max(0.0, 1 - RELL_POISSON_MARGIN / sqrt(nsites)) : 0;
+        map<double, uint32_t> table_of_weight;
+        for (size_t p = 0; p < weights.size(); ++p) {
+            auto inserted = table_of_weight.insert(make_pair(weights[p], static_cast<uint32_t>(_tables.size())));
+            if (inserted.second) _tables.push_back(_make_table(lambda * weights[p]));
+            _table_of_pattern[p] = inserted.first->second;
+        }
+    }
+    void draw(SplitMix64& rng, uint32_t* counts) {
+        size_t nsites = _site_patterns.size();
+        size_t total;
+        do {
+            total = 0;
+            for (size_t p = 0; p < _table_of_pattern.size(); ++p) {
+                counts[p] = _poisson(_tables[_table_of_pattern[p]], rng);
+                total += counts[p];
+            }
+        } while (total > nsites);
+        uniform_int_distribution<size_t> site(0, nsites > 0 ? nsites - 1 : 0);
+        for (; total < nsites; ++total) ++counts[_site_patterns[site(rng)]];
+    }
+
+private:
+    struct PoissonTable {
+        vector<double> cdf;       // Empty if the mean is too large to tabulate
+        vector<uint32_t> guide;   // guide[j] is the smallest count whose cdf is over j / POISSON_GUIDE_SLOTS
+        poisson_distribution<uint32_t> large;
+    };
+
+    static PoissonTable _make_table(double mean) {
+        PoissonTable table;
+        if (mean > POISSON_TABLE_MEAN) {
+            table.large = poisson_distribution<uint32_t>(mean);
+            return table;
+        }
+        double pk = exp(-mean), sum = 0;
+        for (uint32_t k = 0; sum + pk > sum || k <= mean; ++k) {
+            sum += pk;
+            table.cdf.push_back(sum);
+            pk *= mean / (k + 1);
+        }
+        table.cdf.back() = 1;
+        uint32_t k = 0;
+        for (size_t j = 0; j < POISSON_GUIDE_SLOTS; ++j) {
+            while (table.cdf[k] <= static_cast<double>(j) / POISSON_GUIDE_SLOTS) ++k;
+            table.guide.push_back(k);
+        }
+        return table;
+    }
+
+    static uint32_t _poisson(PoissonTable& table, SplitMix64& rng) {
+        if (table.cdf.empty()) return table.large(rng);
+        double u = static_cast<double>(rng() >> 11) / 9007199254740992.0;  // Uniform on [0, 1), 53 bits
+        uint32_t k = table.guide[static_cast<size_t>(u * POISSON_GUIDE_SLOTS)];
+        while (u >= table.cdf[k]) ++k;
+        return k;
+    }
+
+    const vector<size_t>& _site_patterns;
+    vector<uint32_t> _table_of_pattern;
+    vector<PoissonTable> _tables;
+};
+
+}
+
+ParallelTreeLikelihood::ParallelTreeLikelihood(const PackedSequences& packed, const vector<string>& names, const PhyloTree& tree,
+        shared_ptr<SubstitutionModel> model, shared_ptr<DiscreteDistribution> rates, ThreadPool* pool) :
+        _model(model), _rates(rates), _pool(pool), _ncat(0), _reference_kernels(false), _root(0), _stats(), _lnl(0), _dirty(true) {
+    if (names.size() != packed.get_number_of_sequences()) {
+        throw Exception("ParallelTreeLikelihood: expected one name per sequence");
+    }
+    if (model->getNumberOfStates() != packed.get_number_of_states()) {
+        throw Exception("ParallelTreeLikelihood: the model and the alignment have different alphabets");
+    }
+    _names = names;
+    _nseq = names.size();
+    _nstates = packed.get_number_of_states();
+    _compress_patterns(packed);
+    update_model();
+    set_tree(tree);
+}
+
+/*
+A likelihood on the patterns and tree of other, with its own model and rates
+and on the same pool, so that many models can be fitted to data compressed
+once.
+*/
+ParallelTreeLikelihood::ParallelTreeLikelihood(const ParallelTreeLikelihood& other, shared_ptr<SubstitutionModel> model,
+        shared_ptr<DiscreteDistribution> rates) :
+        _model(model), _rates(rates), _pool(other._pool), _ncat(0), _reference_kernels(other._reference_kernels),
+        _root(0), _stats(), _lnl(0), _dirty(true) {
+    if (model->getNumberOfStates() != other._nstates) {
+        throw Exception("ParallelTreeLikelihood: the model and the alignment have different alphabets");
+    }
+    _names = other._names;
+    _nseq = other._nseq;
+    _nstates = other._nstates;
+    _code_masks = other._code_masks;
+    _ncodes = other._ncodes;
+    _site_patterns = other._site_patterns;
+    _pattern_weights = other._pattern_weights;
+    _npatterns = other._npatterns;
+    _tip_codes = other._tip_codes;
+    _chunk_sums.assign(_number_of_chunks(), 0);
+    update_model();
+    _parent = other._parent;
+    _children = other._children;
+    _lengths = other._lengths;
+    _index_tree();
+}
+
+ParallelTreeLikelihood::~ParallelTreeLikelihood() {}
+
+void ParallelTreeLikelihood::set_thread_pool(ThreadPool* pool) {
+    _pool = pool;
+}
+
+/*
+Replaces the topology and branch lengths. Every leaf of the tree must be a
+sequence of the alignment and vice versa. Branches with no length start at
+MIN_BRANCH_LENGTH.
+*/
+void ParallelTreeLikelihood::set_tree(const PhyloTree& tree) {
+    const TreeTemplate<Node>& t = tree.get_tree();
+    const Node* top = t.getRootNode();
+    if (top->isLeaf()) throw Exception("ParallelTreeLikelihood: the tree is rooted on a leaf");
+    auto length = [](const Node* node) {
+        return node->hasDistanceToFather() ? max(node->getDistanceToFather(), MIN_BRANCH_LENGTH) : MIN_BRANCH_LENGTH;
+    };
+    // Unroot by hanging one side of a bifurcating root from the other
+    const Node* extra = nullptr;
+    double extra_length = 0;
+    if (top->getNumberOfSons() == 2) {
+        for (size_t k = 0; k < 2; ++k) {
+            if (!top->getSon(k)->isLeaf()) {
+                extra = top->getSon(1 - k);
+                extra_length = length(top->getSon(0)) + length(top->getSon(1));
+                top = top->getSon(k);
+                break;
+            }
+        }
+    }
+
+    map<string, size_t> index;
+    for (size_t i = 0; i < _nseq; ++i) index[_names[i]] = i;
+    const size_t npos = numeric_limits<size_t>::max();
+    _parent.assign(_nseq, npos);
+    _children.assign(_nseq, vector<size_t>());
+    _lengths.assign(_nseq, 0);
+    vector<bool> seen(_nseq, false);
+    vector<tuple<const Node*, size_t, double>> todo{make_tuple(top, npos, 0.0)};
+    while (!todo.empty()) {
+        const Node* node;
+        size_t parent;
+        double t;
+        tie(node, parent, t) = todo.back();
+        todo.pop_back();
+        size_t v;
+        if (node->isLeaf()) {
+            auto it = index.find(node->getName());
+            if (it == index.end()) throw Exception("ParallelTreeLikelihood: " + node->getName() + " is not in the alignment");
+            v = it->second;
+            if (seen[v]) throw Exception("ParallelTreeLikelihood: " + node->getName() + " is in the tree twice");
+            seen[v] = true;
+        }
+        else {
+            v = _children.size();
+            _parent.push_back(npos);
+            _children.push_back(vector<size_t>());
+            _lengths.push_back(0);
+        }
+        _parent[v] = parent;
+        _lengths[v] = t;
+        if (parent != npos) _children[parent].push_back(v);
+        // Pushed in reverse, so that children keep their order
+        if (node == top && extra) todo.push_back(make_tuple(extra, v, extra_length));
+        for (size_t k = node->getNumberOfSons(); k > 0; --k) {
+            const Node* son = node->getSon(k - 1);
+            if (son != extra) todo.push_back(make_tuple(son, v, length(son)));
+        }
+    }
+    if (find(seen.begin(), seen.end(), false) != seen.end()) {
+        throw Exception("ParallelTreeLikelihood: the tree does not contain every sequence");
+    }
+    _index_tree();
+}
+
+/*
+Replaces the model and rate distribution, keeping the tree and the
+compressed patterns.
+*/
+void ParallelTreeLikelihood::set_model(shared_ptr<SubstitutionModel> model, shared_ptr<DiscreteDistribution> rates) {
+    if (model->getNumberOfStates() != _nstates) {
+        throw Exception("ParallelTreeLikelihood: the model and the alignment have different alphabets");
+    }
+    _model = model;
+    _rates = rates;
+    update_model();
+}
+
+/*
+Reads the model's eigendecomposition and the rate categories again, after
+their parameters have changed, and recomputes the transition matrices. If
+nothing the likelihood depends on has changed, the partials and lnL from the
+last traversal stay valid.
+*/
+void ParallelTreeLikelihood::update_model() {
+    const SubstitutionModel& model = *_model;
+    if (!model.isDiagonalizable()) throw Exception("ParallelTreeLikelihood: the substitution model is not diagonalizable");
+    vector<double> previous = _model_values();
+    size_t s = _nstates;
+    const Vdouble& eigenvalues = model.getEigenValues();
+    const Matrix<double>& right = model.getColumnRightEigenVectors();
+    const Matrix<double>& left = model.getRowLeftEigenVectors();
+    const Vdouble& freqs = model.getFrequencies();
+    double rate = model.getRate();
+    _eigenvalues.resize(s);
+    _freqs.resize(s);
+    _right.resize(s * s);
+    _left.resize(s * s);
+    for (size_t k = 0; k < s; ++k) {
+        _eigenvalues[k] = eigenvalues[k] * rate;
+        _freqs[k] = freqs[k];
+        for (size_t a = 0; a < s; ++a) {
+            _right[k * s + a] = right(k, a);
+            _left[k * s + a] = left(k, a);
+        }
+    }
+    _right_columns.resize(s * s);
+    _left_columns.resize(s * s);
+    for (size_t a = 0; a < s; ++a) {
+        for (size_t k = 0; k < s; ++k) {
+            _right_columns[a * s + k] = _freqs[a] * _right[a * s + k];
+            _left_columns[a * s + k] = _left[k * s + a];
+        }
+    }
+    _tip_left.assign(_ncodes * s, 0);
+    for (size_t x = 0; x < _ncodes; ++x) {
+        for (size_t k = 0; k < s; ++k) {
+            for (size_t b = 0; b < s; ++b) {
+                if (_code_masks[x] >> b & 1) _tip_left[x * s + k] += _left[k * s + b];
+            }
+        }
+    }
+    size_t ncat = _rates->getNumberOfCategories();
+    _category_rates.resize(ncat);
+    _category_probs.resize(ncat);
+    for (size_t c = 0; c < ncat; ++c) {
+        _category_rates[c] = _rates->getCategory(c);
+        _category_probs[c] = _rates->getProbability(c);
+    }
+    bool resized = ncat != _ncat;
+    if (!resized && !_children.empty() && _model_values() == previous) return;
+    _ncat = ncat;
+    _kernels = get_pruning_kernels(_nstates, _ncat, _reference_kernels);
+    if (_children.empty()) return;
+    if (resized) _allocate();
+    for (size_t v = 0; v < _children.size(); ++v) {
+        if (v != _root) _update_transitions(v);
+    }
+    _dirty = true;
+}
+
+// The tree, with the leaves named after the sequences
+PhyloTree ParallelTreeLikelihood::get_phylo_tree() const {
+    return get_phylo_tree(vector<double>());
+}
+
+/*
+The tree with support values on its branches, support[v] being the value for
+the branch above node v, as filled by compute_branch_support. NaN entries are
+left unlabelled.
+*/
+PhyloTree ParallelTreeLikelihood::get_phylo_tree(const vector<double>& support) const {
+    vector<Node*> nodes(_children.size());
+    for (size_t v = 0; v < nodes.size(); ++v) {
+        nodes[v] = _is_leaf(v) ? new Node(static_cast<int>(v), _names[v]) : new Node(static_cast<int>(v));
+    }
+    for (size_t v = 0; v < nodes.size(); ++v) {
+        for (size_t u : _children[v]) {
+            nodes[v]->addSon(nodes[u]);
+            nodes[u]->setDistanceToFather(_lengths[u]);
+            if (u < support.size() && !std::isnan(support[u])) {
+                nodes[u]->setBranchProperty(TreeTools::BOOTSTRAP, Number<double>(support[u]));
+            }
+        }
+    }
+    return PhyloTree(new TreeTemplate<Node>(nodes[_root]), !support.empty());
+}
+
+size_t ParallelTreeLikelihood::get_number_of_patterns() const {
+    return _npatterns;
+}
+
+size_t ParallelTreeLikelihood::get_number_of_branches() const {
+    return _children.size() - 1;
+}
+
+size_t ParallelTreeLikelihood::get_number_of_sites() const {
+    return _site_patterns.size();
+}
+
+size_t ParallelTreeLikelihood::get_number_of_categories() const {
+    return _ncat;
+}
+
+// The pattern of each site of the alignment
+const vector<size_t>& ParallelTreeLikelihood::get_site_patterns() const {
+    return _site_patterns;
+}
+
+// The number of sites showing each pattern
+const vector<double>& ParallelTreeLikelihood::get_pattern_weights() const {
+    return _pattern_weights;
+}
+
+double ParallelTreeLikelihood::get_log_likelihood() {
+    if (!_dirty) return _lnl;
+    ++_stats.evaluations;
+    _for_each_chunk([&](size_t chunk, size_t begin, size_t end) {
+        for (size_t v : _postorder) _update_partials(v, begin, end);
+        _chunk_sums[chunk] = _root_log_likelihood(begin, end);
+    });
+    _lnl = 0;
+    for (double x : _chunk_sums) _lnl += x;
+    _dirty = false;
+    return _lnl;
+}
+
+/*
+lnL of each site of the alignment, and the posterior probability of each rate
+category at each site (nsites x ncat, a row per site), as found by the pass
+that computes lnL. Rescaling is undone in the log, so these stay finite
+however long the tree.
+*/
+void ParallelTreeLikelihood::fill_site_likelihoods(double* log_likelihoods, double* posteriors) {
+    get_log_likelihood();
+    for (size_t i = 0; i < _site_patterns.size(); ++i) {
+        size_t p = _site_patterns[i];
+        log_likelihoods[i] = _pattern_log_likelihoods[p];
+        copy_n(&_pattern_posteriors[p * _ncat], _ncat, posteriors + i * _ncat);
+    }
+}
+
+/*
+Sweeps over the branches until a sweep improves lnL by less than tolerance.
+Returns the final lnL.
+*/
+double ParallelTreeLikelihood::optimise_branch_lengths(double tolerance, size_t max_sweeps) {
+    auto start = chrono::steady_clock::now();
+    _stats = OptimisationStats();
+    _stats.log_likelihood = optimise_shared_branch_lengths({this}, tolerance, max_sweeps);
+    _stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return _stats.log_likelihood;
+}
+
+/*
+Optimises all branch lengths together by projected L-BFGS, within
+[MIN_BRANCH_LENGTH, MAX_BRANCH_LENGTH]. Lengths held at a bound by the
+gradient are frozen for the iteration. The rest move along the quasi-Newton
+direction built from the last LBFGS_MEMORY steps restricted to them, and the
+step is halved, clamping to the bounds, until it gains at least
+ARMIJO_FRACTION of what the gradient promised. Unlike L-BFGS-B there is no
+generalised Cauchy point: the free set is chosen from the gradient alone.
+Stops once an iteration gains less than tolerance, then, if polish, runs one
+sweep of per-branch Newton steps. Returns the final lnL.
+*/
+double ParallelTreeLikelihood::optimise_branch_lengths_lbfgs(double tolerance, size_t max_iterations, bool polish) {
+    auto start = chrono::steady_clock::now();
+    _stats = OptimisationStats();
+    size_t nnodes = _children.size();
+    const double lower = MIN_BRANCH_LENGTH;
+    const double upper = MAX_BRANCH_LENGTH;
+    vector<bool> free(nnodes);
+    auto dot = [&](const vector<double>& a, const vector<double>& b) {
+        double sum = 0;
+        for (size_t v = 0; v < nnodes; ++v) sum += a[v] * b[v];
+        return sum;
+    };
+    auto free_dot = [&](const vector<double>& a, const vector<double>& b) {
+        double sum = 0;
+        for (size_t v = 0; v < nnodes; ++v) {
+            if (free[v]) sum += a[v] * b[v];
+        }
+        return sum;
+    };
+    // The gradient is of lnL, and the direction uphill, but steps and changes are kept as for minimising -lnL
+    vector<double> x = _lengths, gradient, x_new(nnodes), gradient_new, direction(nnodes);
+    double lnl = _gradient(gradient);
+    vector<vector<double>> steps, changes;    // s and y, oldest first
+    vector<double> rhos, alphas;
+    for (size_t iteration = 0; iteration < max_iterations; ++iteration) {
+        ++_stats.iterations;
+        for (size_t v = 0; v < nnodes; ++v) {
+            free[v] = v != _root && !(x[v] <= lower && gradient[v] < 0) && !(x[v] >= upper && gradient[v] > 0);
+        }
+        // Two-loop recursion in the free lengths only, skipping pairs without curvature there
+        rhos.assign(steps.size(), 0);
+        size_t newest = steps.size();
+        for (size_t k = 0; k < steps.size(); ++k) {
+            double sy = free_dot(steps[k], changes[k]);
+            if (sy > 0) {
+                rhos[k] = 1 / sy;
+                newest = k;
+            }
+        }
+        vector<double> q(nnodes);
+        for (size_t v = 0; v < nnodes; ++v) q[v] = free[v] ? -gradient[v] : 0;
+        alphas.assign(steps.size(), 0);
+        for (size_t k = steps.size(); k > 0; --k) {
+            if (rhos[k - 1] == 0) continue;
+            alphas[k - 1] = rhos[k - 1] * free_dot(steps[k - 1], q);
+            for (size_t v = 0; v < nnodes; ++v) {
+                if (free[v]) q[v] -= alphas[k - 1] * changes[k - 1][v];
+            }
+        }
+        if (newest < steps.size()) {
+            double scale = 1 / (rhos[newest] * free_dot(changes[newest], changes[newest]));
+            for (double& d : q) d *= scale;
+        }
+        for (size_t k = 0; k < steps.size(); ++k) {
+            if (rhos[k] == 0) continue;
+            double beta = rhos[k] * free_dot(changes[k], q);
+            for (size_t v = 0; v < nnodes; ++v) {
+                if (free[v]) q[v] += steps[k][v] * (alphas[k] - beta);
+            }
+        }
+        for (size_t v = 0; v < nnodes; ++v) direction[v] = free[v] ? -q[v] : 0;
+        if (!(dot(gradient, direction) > 0)) {
+            // Not uphill: start again from steepest ascent
+            steps.clear();
+            changes.clear();
+            for (size_t v = 0; v < nnodes; ++v) direction[v] = free[v] ? gradient[v] : 0;
+        }
+        if (steps.empty()) {
+            double largest = 0;
+            for (double d : direction) largest = max(largest, fabs(d));
+            if (largest == 0) break;
+            for (double& d : direction) d *= LBFGS_FIRST_STEP / largest;
+        }
+
+        double step = 1;
+        double lnl_new = lnl;
+        bool accepted = false;
+        for (size_t k = 0; k < MAX_LINE_SEARCH_STEPS && !accepted; ++k, step /= 2) {
+            double promised = 0;
+            for (size_t v = 0; v < nnodes; ++v) {
+                x_new[v] = free[v] ? min(max(x[v] + step * direction[v], lower), upper) : x[v];
+                promised += gradient[v] * (x_new[v] - x[v]);
+            }
+            lnl_new = _set_lengths(x_new);
+            accepted = lnl_new >= lnl + ARMIJO_FRACTION * promised;
+        }
+        if (!accepted) {
+            _set_lengths(x);
+            break;
+        }
+        _gradient(gradient_new);
+        vector<double> s(nnodes), y(nnodes);
+        for (size_t v = 0; v < nnodes; ++v) {
+            s[v] = x_new[v] - x[v];
+            y[v] = gradient[v] - gradient_new[v];
+        }
+        // Kept only where -lnL curves upwards along the step, which keeps the implied Hessian positive definite
+        if (dot(s, y) > 0) {
+            steps.push_back(s);
+            changes.push_back(y);
+            if (steps.size() > LBFGS_MEMORY) {
+                steps.erase(steps.begin());
+                changes.erase(changes.begin());
+            }
+        }
+        double gain = lnl_new - lnl;
+        x = x_new;
+        gradient = gradient_new;
+        lnl = lnl_new;
+        if (gain < tolerance) break;
+    }
+    if (polish) lnl = optimise_shared_branch_lengths({this}, tolerance, 1);
+    _stats.log_likelihood = lnl;
+    _stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return lnl;
+}
+
+// What the last branch length optimisation cost
+const OptimisationStats& ParallelTreeLikelihood::get_optimisation_stats() const {
+    return _stats;
+}
+
+/*
+Summed lnL of partitions of one analysis: likelihoods of different data on
+the same tree (see optimise_shared_branch_lengths), sharing a thread pool.
+The partitions are handed out in the order given, largest first being best,
+and each one's chunks are stolen by threads that run out of partitions.
+*/
+double ParallelTreeLikelihood::get_total_log_likelihood(const vector<ParallelTreeLikelihood*>& partitions) {
+    _check_partitions(partitions);
+    vector<double> lnls(partitions.size());
+    _for_each_partition(partitions, [&](size_t i) { lnls[i] = partitions[i]->get_log_likelihood(); });
+    double lnl = 0;
+    for (double x : lnls) lnl += x;
+    return lnl;
+}
+
+/*
+optimise_branch_lengths for partitions whose branch lengths are linked, each
+with its own data, model and rates. They must have the same sequence names,
+in the same order, and the same tree, and share a thread pool. Each branch
+is optimised on the summed lnL and its derivatives, with the work for each
+partition scheduled as in get_total_log_likelihood. Returns the summed lnL.
+*/
+double ParallelTreeLikelihood::optimise_shared_branch_lengths(const vector<ParallelTreeLikelihood*>& partitions,
+        double tolerance, size_t max_sweeps) {
+    double lnl = get_total_log_likelihood(partitions);
+    size_t nbranches = partitions[0]->get_number_of_branches();
+    for (size_t sweep = 0; sweep < max_sweeps; ++sweep) {
+        _sweep(partitions, tolerance / nbranches);
+        for (ParallelTreeLikelihood* partition : partitions) ++partition->_stats.sweeps;
+        for (ParallelTreeLikelihood* partition : partitions) partition->_dirty = true;
+        double next = get_total_log_likelihood(partitions);
+        bool done = next - lnl < tolerance;
+        lnl = next;
+        if (done) break;
+    }
+    return lnl;
+}
+
+/*
+Optimises the free parameters of the model (and the gamma shape, if rates are
+gamma distributed) with bpp's one-parameter-at-a-time Brent search, then,
+unless fix_branch_lengths, the branch lengths, and repeats until a round
+improves lnL by less than tolerance. Returns the final lnL.
+*/
+double ParallelTreeLikelihood::optimise_parameters(bool fix_branch_lengths, double tolerance, size_t max_rounds) {
+    ParameterList parameters = _model->getIndependentParameters();
+    if (_rates->getName() == "Gamma") parameters.addParameters(_rates->getIndependentParameters());
+    return optimise_parameters(parameters, fix_branch_lengths, tolerance, max_rounds);
+}
+
+// As above, over only the given model and rate parameters; the rest keep their values
+double ParallelTreeLikelihood::optimise_parameters(const ParameterList& initial, bool fix_branch_lengths, double tolerance,
+        size_t max_rounds) {
+    ParameterList parameters = initial;
+    double lnl = get_log_likelihood();
+    for (size_t round = 0; round < max_rounds; ++round) {
+        if (parameters.size() > 0) {
+            ModelParametersFunction function(*this, *_model, *_rates, parameters);
+            SimpleMultiDimensions optimiser(&function);
+            optimiser.setVerbose(0);
+            optimiser.setProfiler(0);
+            optimiser.setMessageHandler(0);
+            optimiser.setConstraintPolicy(AutoParameter::CONSTRAINTS_AUTO);
+            optimiser.getStopCondition()->setTolerance(tolerance);
+            optimiser.setMaximumNumberOfEvaluations(MAX_EVALUATIONS);
+            optimiser.init(parameters);
+            optimiser.optimize();
+            // The last evaluation need not have been at the optimum
+            parameters = optimiser.getParameters();
+            function.setParameters(parameters);
+        }
+        if (!fix_branch_lengths) optimise_branch_lengths(tolerance);
+        double next = get_log_likelihood();
+        bool done = fix_branch_lengths || next - lnl < tolerance;
+        lnl = next;
+        if (done) break;
+    }
+    return lnl;
+}
+
+/*
+Support for each internal branch against the two NNI rearrangements around
+it, indexed by the node below the branch and NaN for branches without one
+(leaves, and branches next to a multifurcation).
+The four subtrees around each branch are read from the partials and from
+upper vectors made for every internal node in one pre-order pass, and each
+of the three topologies is scored with only the central branch length
+optimised, as bpp's testNNI does. Branches are shared out across the pool.
+- abayes: aBayes, the current topology's share of the summed likelihoods of
+  the three.
+- alrt: SH-like aLRT (Guindon et al. 2010) from nreplicates RELL bootstraps
+  of the three topologies' per-site lnL: the fraction of replicates whose
+  centred gap between the best and second best topology is below the
+  observed gap from the current topology to the best alternative, and 0 if
+  an alternative is better. Left NaN if nreplicates is 0. Replicate b is
+  drawn from a generator seeded with (seed, b), so every branch sees the same
+  replicates without their all being held at once.
+*/
+void ParallelTreeLikelihood::compute_branch_support(vector<double>& abayes, vector<double>& alrt, size_t nreplicates, uint64_t seed) {
+    size_t nnodes = _children.size();
+    get_log_likelihood();
+    _update_node_uppers();
+
+    abayes.assign(nnodes, NAN);
+    alrt.assign(nnodes, NAN);
+    vector<BranchScratch> scratch(_pool ? _pool->size() : 1);
+    auto run = [&](size_t i, size_t thread) {
+        size_t v = _root + 1 + i;
+        double lnl[3], lengths[3];
+        size_t around[4];
+        if (!_score_nni(v, scratch[thread], lnl, lengths, around)) return;
+        abayes[v] = 1 / (1 + exp(lnl[1] - lnl[0]) + exp(lnl[2] - lnl[0]));
+        if (nreplicates > 0) alrt[v] = _sh_alrt(lnl, scratch[thread], nreplicates, seed);
+    };
+    size_t nbranches = nnodes - _root - 1;
+    if (_pool && _pool->size() > 1 && nbranches > 1) {
+        _pool->parallel_for(0, nbranches, run);
+    }
+    else {
+        for (size_t i = 0; i < nbranches; ++i) run(i, 0);
+    }
+    _node_uppers.clear();
+    _node_upper_scales.clear();
+}
+
+/*
+Hill-climbing search over topologies. Each round scores, in parallel, every
+NNI and, if spr_radius is not zero, every regraft of a subtree onto a branch
+at most spr_radius branches away from where it was pruned, optimising only
+the branch the move creates. The improving moves are taken best first,
+skipping any that shares a node with one already taken, and applied together;
+the branches around each are then re-optimised. If the batch gains less than
+its best move promised alone, it is undone and that move applied by itself.
+Branch lengths are optimised before the first round and after the last.
+Stops once a round gains less than tolerance, appending each round to the
+topology log. Returns the final lnL.
+*/
+double ParallelTreeLikelihood::optimise_topology(size_t spr_radius, double tolerance, size_t max_rounds) {
+    auto start = chrono::steady_clock::now();
+    auto elapsed = [&]() { return chrono::duration<double>(chrono::steady_clock::now() - start).count(); };
+    double lnl = optimise_branch_lengths(tolerance);
+    _topology_log.push_back({lnl, 0, 0, 0, elapsed()});
+    for (size_t round = 0; round < max_rounds; ++round) {
+        vector<TopologyMove> moves = _find_moves(spr_radius, tolerance);
+        vector<TopologyMove> batch;
+        vector<bool> used(_children.size(), false);
+        for (const TopologyMove& move : moves) {
+            bool clash = false;
+            for (size_t v : move.nodes) clash = clash || used[v];
+            if (clash) continue;
+            for (size_t v : move.nodes) used[v] = true;
+            batch.push_back(move);
+        }
+        double next = lnl;
+        if (!batch.empty()) {
+            vector<size_t> parent = _parent;
+            vector<vector<size_t>> children = _children;
+            vector<double> lengths = _lengths;
+            auto restore = [&]() {
+                _parent = parent;
+                _children = children;
+                _lengths = lengths;
+                _index_tree();
+            };
+            next = _apply_moves(batch, tolerance);
+            if (batch.size() > 1 && next < lnl + batch[0].gain) {
+                restore();
+                batch.resize(1);
+                next = _apply_moves(batch, tolerance);
+            }
+            if (!(next > lnl)) {
+                restore();
+                batch.clear();
+                next = get_log_likelihood();
+            }
+        }
+        size_t nspr = count_if(batch.begin(), batch.end(), [](const TopologyMove& move) { return move.spr; });
+        _topology_log.push_back({next, moves.size(), batch.size() - nspr, nspr, elapsed()});
+        bool done = next - lnl < tolerance;
+        lnl = next;
+        if (done) break;
+    }
+    return optimise_branch_lengths(tolerance);
+}
+
+/*
+One entry per round of optimise_topology, and one for the branch length
+optimisation that starts each call, since the log was last cleared
+*/
+const vector<TopologyRound>& ParallelTreeLikelihood::get_topology_log() const {
+    return _topology_log;
+}
+
+void ParallelTreeLikelihood::clear_topology_log() {
+    _topology_log.clear();
+}
+
+/*
+Switches between the vectorised kernels and the scalar reference ones, which
+give the same results up to rounding.
+*/
+void ParallelTreeLikelihood::set_reference_kernels(bool reference) {
+    _reference_kernels = reference;
+    _kernels = get_pruning_kernels(_nstates, _ncat, _reference_kernels);
+    _dirty = true;
+}
+
+string ParallelTreeLikelihood::get_kernel_name() const {
+    return _kernels.name;
+}
+
+// Everything update_model reads from the model and rates, in one vector for comparison
+vector<double> ParallelTreeLikelihood::_model_values() const {
+    vector<double> values;
+    for (const vector<double>* v : {&_eigenvalues, &_right, &_left, &_freqs, &_category_rates, &_category_probs}) {
+        values.insert(values.end(), v->begin(), v->end());
+    }
+    return values;
+}
+
+size_t ParallelTreeLikelihood::_number_of_chunks() const {
+    return (_npatterns + PATTERN_CHUNK - 1) / PATTERN_CHUNK;
+}
+
+// Calls f(chunk, first pattern, last pattern + 1) for every chunk, on the pool
+void ParallelTreeLikelihood::_for_each_chunk(const function<void(size_t, size_t, size_t)>& f) {
+    size_t nchunks = _number_of_chunks();
+    auto run = [&](size_t chunk, size_t) {
+        size_t begin = chunk * PATTERN_CHUNK;
+        f(chunk, begin, min(begin + PATTERN_CHUNK, _npatterns));
+    };
+    if (_pool && _pool->size() > 1 && nchunks > 1) {
+        _pool->parallel_for(0, nchunks, run);
+    }
+    else {
+        for (size_t chunk = 0; chunk < nchunks; ++chunk) run(chunk, 0);
+    }
+}
+
+/*
+Collapses identical columns into patterns. Gaps and unknown characters are
+given the extra code _ncodes - 1, compatible with every state.
+*/
+void ParallelTreeLikelihood::_compress_patterns(const PackedSequences& packed) {
+    _code_masks = packed.get_code_masks();
+    _code_masks.push_back((static_cast<uint32_t>(1) << _nstates) - 1);
+    _ncodes = _code_masks.size();
+    uint8_t missing = static_cast<uint8_t>(_ncodes - 1);
+    size_t nsites = packed.get_number_of_sites();
+    vector<const uint8_t*> codes(_nseq);
+    for (size_t i = 0; i < _nseq; ++i) codes[i] = packed.get_codes(i);
+
+    unordered_map<string, size_t> patterns;
+    vector<uint8_t> columns;    // npatterns x nseq
+    string column(_nseq, '\0');
+    _site_patterns.resize(nsites);
+    _pattern_weights.clear();
+    for (size_t k = 0; k < nsites; ++k) {
+        for (size_t i = 0; i < _nseq; ++i) {
+            uint8_t code = codes[i][k];
+            column[i] = static_cast<char>(code == PackedSequences::NO_CODE ? missing : code);
+        }
+        auto inserted = patterns.insert(make_pair(column, _pattern_weights.size()));
+        if (inserted.second) {
+            _pattern_weights.push_back(0);
+            columns.insert(columns.end(), column.begin(), column.end());
+        }
+        _site_patterns[k] = inserted.first->second;
+        _pattern_weights[inserted.first->second] += 1;
+    }
+    _npatterns = _pattern_weights.size();
+    _tip_codes.resize(_nseq * _npatterns);
+    for (size_t p = 0; p < _npatterns; ++p) {
+        for (size_t i = 0; i < _nseq; ++i) _tip_codes[i * _npatterns + p] = columns[p * _nseq + i];
+    }
+    _chunk_sums.assign(_number_of_chunks(), 0);
+}
+
+/*
+Sets up what depends on the topology, once _parent, _children and _lengths
+hold a tree whose internal nodes are numbered in pre-order from the root,
+node _nseq.
+*/
+void ParallelTreeLikelihood::_index_tree() {
+    _root = _nseq;
+    _postorder.clear();
+    for (size_t v = _children.size(); v > _nseq; --v) _postorder.push_back(v - 1);
+    _allocate();
+    for (size_t v = 0; v < _children.size(); ++v) {
+        if (v != _root) _update_transitions(v);
+    }
+    _dirty = true;
+}
+
+void ParallelTreeLikelihood::_allocate() {
+    size_t nnodes = _children.size();
+    size_t size = _ncat * _npatterns * _nstates;
+    _transitions.assign(nnodes, AlignedVector());
+    _tip_tables.assign(_nseq, AlignedVector());
+    _partials.assign(nnodes, AlignedVector());
+    _scales.assign(nnodes, vector<int>());
+    for (size_t v = _nseq; v < nnodes; ++v) {
+        _partials[v].resize(size);
+        _scales[v].resize(_npatterns);
+    }
+    _uppers.clear();
+    _projections.clear();
+    _pattern_log_likelihoods.assign(_npatterns, 0);
+    _pattern_posteriors.assign(_npatterns * _ncat, 0);
+}
+
+// P(t_v) for branch v, and for a leaf its tip table
+void ParallelTreeLikelihood::_update_transitions(size_t v) {
+    _transition_matrices(_lengths[v], _transitions[v]);
+    if (_is_leaf(v)) _tip_table(_transitions[v], _tip_tables[v]);
+}
+
+// P(t) in each category, stored by columns (entry b * s + a is P_ab)
+void ParallelTreeLikelihood::_transition_matrices(double t, AlignedVector& p) const {
+    size_t s = _nstates;
+    p.assign(_ncat * s * s, 0);
+    vector<double> e(s);
+    for (size_t c = 0; c < _ncat; ++c) {
+        for (size_t k = 0; k < s; ++k) e[k] = exp(_eigenvalues[k] * _category_rates[c] * t);
+        double* pc = &p[c * s * s];
+        for (size_t a = 0; a < s; ++a) {
+            for (size_t k = 0; k < s; ++k) {
+                double x = _right[a * s + k] * e[k];
+                for (size_t b = 0; b < s; ++b) pc[b * s + a] += x * _left[k * s + b];
+            }
+        }
+    }
+}
+
+// The sums of the columns of P over each code's states, for the tip_message kernel
+void ParallelTreeLikelihood::_tip_table(const AlignedVector& p, AlignedVector& table) const {
+    size_t s = _nstates;
+    table.assign(_ncat * _ncodes * s, 0);
+    for (size_t c = 0; c < _ncat; ++c) {
+        for (size_t x = 0; x < _ncodes; ++x) {
+            double* row = &table[(c * _ncodes + x) * s];
+            for (size_t b = 0; b < s; ++b) {
+                if (!(_code_masks[x] >> b & 1)) continue;
+                for (size_t a = 0; a < s; ++a) row[a] += p[(c * s + b) * s + a];
+            }
+        }
+    }
+}
+
+/*
+Multiplies out (or, if first, sets it) by the message passed up branch v,
+P(t_v) applied to the conditional likelihoods below it: v's tip table for a
+leaf, otherwise `below`, which is laid out like the partials.
+*/
+void ParallelTreeLikelihood::_multiply_message(size_t v, const double* below, double* out, bool first, size_t begin, size_t end) const {
+    if (_is_leaf(v)) {
+        _kernels.tip_message(_tip_tables[v].data(), &_tip_codes[v * _npatterns], out, first,
+                _nstates, _ncat, _ncodes, _npatterns, begin, end);
+    }
+    else {
+        _kernels.message(_transitions[v].data(), below, out, first, _nstates, _ncat, _npatterns, begin, end);
+    }
+}
+
+// Scales up patterns whose largest entry has fallen below 2^-SCALE_EXPONENT, counting into scales if given
+void ParallelTreeLikelihood::_rescale(double* partials, int* scales, size_t begin, size_t end) const {
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    const double threshold = ldexp(1.0, -SCALE_EXPONENT);
+    for (size_t p = begin; p < end; ++p) {
+        double largest = 0;
+        for (size_t c = 0; c < _ncat; ++c) {
+            const double* x = partials + (c * n + p) * s;
+            for (size_t a = 0; a < s; ++a) largest = max(largest, x[a]);
+        }
+        while (largest > 0 && largest < threshold) {
+            for (size_t c = 0; c < _ncat; ++c) {
+                double* x = partials + (c * n + p) * s;
+                for (size_t a = 0; a < s; ++a) x[a] = ldexp(x[a], SCALE_EXPONENT);
+            }
+            largest = ldexp(largest, SCALE_EXPONENT);
+            if (scales) ++scales[p];
+        }
+    }
+}
+
+void ParallelTreeLikelihood::_update_partials(size_t v, size_t begin, size_t end) {
+    double* out = _partials[v].data();
+    int* scales = _scales[v].data();
+    fill(scales + begin, scales + end, 0);
+    bool first = true;
+    for (size_t u : _children[v]) {
+        if (!_is_leaf(u)) {
+            const int* below = _scales[u].data();
+            for (size_t p = begin; p < end; ++p) scales[p] += below[p];
+        }
+        _multiply_message(u, _is_leaf(u) ? nullptr : _partials[u].data(), out, first, begin, end);
+        first = false;
+    }
+    _rescale(out, scales, begin, end);
+}
+
+// Also records each pattern's lnL and rate category posteriors
+double ParallelTreeLikelihood::_root_log_likelihood(size_t begin, size_t end) {
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    const double* partials = _partials[_root].data();
+    const int* scales = _scales[_root].data();
+    const double scale_log = SCALE_EXPONENT * log(2.0);
+    double lnl = 0;
+    for (size_t p = begin; p < end; ++p) {
+        double* posteriors = &_pattern_posteriors[p * _ncat];
+        double l = 0;
+        for (size_t c = 0; c < _ncat; ++c) {
+            const double* x = partials + (c * n + p) * s;
+            double sum = 0;
+            for (size_t a = 0; a < s; ++a) sum += _freqs[a] * x[a];
+            posteriors[c] = _category_probs[c] * sum;
+            l += posteriors[c];
+        }
+        for (size_t c = 0; c < _ncat; ++c) posteriors[c] /= l;
+        _pattern_log_likelihoods[p] = log(l) - scales[p] * scale_log;
+        lnl += _pattern_weights[p] * _pattern_log_likelihoods[p];
+    }
+    return lnl;
+}
+
+/*
+Conditional likelihood, at v's parent, of the data outside the subtree below
+v, into _uppers[depth]. The parent's own upper vector is _uppers[depth - 1].
+*/
+void ParallelTreeLikelihood::_update_upper(size_t v, size_t depth) {
+    if (_uppers.size() <= depth) _uppers.resize(depth + 1);
+    AlignedVector& upper = _uppers[depth];
+    upper.resize(_ncat * _npatterns * _nstates);
+    const double* parent_upper = _parent[v] != _root ? _uppers[depth - 1].data() : nullptr;
+    _for_each_chunk([&](size_t, size_t begin, size_t end) {
+        _upper_message(v, parent_upper, upper.data(), begin, end);
+    });
+}
+
+/*
+The upper vector of v, from parent_upper, the upper vector of v's parent
+(null if the parent is the root), and the partials of v's siblings.
+Rescaling counts are kept in scales, from parent_scales, only if it is given:
+they just shift lnL by a constant for each pattern while the branch above v
+is changed.
+*/
+void ParallelTreeLikelihood::_upper_message(size_t v, const double* parent_upper, double* upper, size_t begin, size_t end,
+        const int* parent_scales, int* scales) const {
+    size_t parent = _parent[v];
+    if (scales) {
+        for (size_t p = begin; p < end; ++p) scales[p] = parent != _root ? parent_scales[p] : 0;
+        for (size_t u : _children[parent]) {
+            if (u == v || _is_leaf(u)) continue;
+            for (size_t p = begin; p < end; ++p) scales[p] += _scales[u][p];
+        }
+    }
+    bool first = true;
+    if (parent != _root) {
+        _multiply_message(parent, parent_upper, upper, first, begin, end);
+        first = false;
+    }
+    for (size_t u : _children[parent]) {
+        if (u == v) continue;
+        _multiply_message(u, _is_leaf(u) ? nullptr : _partials[u].data(), upper, first, begin, end);
+        first = false;
+    }
+    _rescale(upper, scales, begin, end);
+}
+
+/*
+Optimises the length of branch v, given its upper vector. With the data on
+either side of the branch projected onto the eigenbasis,
+L(t) = sum_c w_c sum_k z_k exp(lambda_k r_c t) for each pattern.
+*/
+void ParallelTreeLikelihood::_optimise_branch(size_t v, const double* upper, double tolerance) {
+    _project_branch(v, upper);
+    double t = _newton(_lengths[v], [&](double x, double& lnl, double& d1, double& d2) {
+        _evaluate_branch(x, lnl, d1, d2);
+    }, tolerance);
+    _set_branch_length(v, t);
+}
+
+// Projects the data either side of branch v into _projections, for _evaluate_branch
+void ParallelTreeLikelihood::_project_branch(size_t v, const double* upper) {
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    _projections.resize(_ncat * n * s);
+    bool leaf = _is_leaf(v);
+    _for_each_chunk([&](size_t, size_t begin, size_t end) {
+        _kernels.project(upper, leaf ? nullptr : _partials[v].data(), _tip_left.data(), leaf ? &_tip_codes[v * n] : nullptr,
+                _right_columns.data(), _left_columns.data(), _projections.data(), s, _ncat, n, begin, end);
+    });
+}
+
+void ParallelTreeLikelihood::_set_branch_length(size_t v, double t) {
+    if (t != _lengths[v]) {
+        _lengths[v] = t;
+        _update_transitions(v);
+    }
+}
+
+/*
+Newton's method on a branch length, from t, with step halving. evaluate
+gives lnL and its first two derivatives at a length. Stops once the step is
+shorter than NEWTON_TOLERANCE or the gain it promises is below tolerance,
+which saves a long crawl along the flat lnL of a saturated branch. Returns
+the best length found.
+*/
+double ParallelTreeLikelihood::_newton(double t, const function<void(double, double&, double&, double&)>& evaluate,
+        double tolerance) const {
+    double lnl, d1, d2;
+    evaluate(t, lnl, d1, d2);
+    for (size_t iter = 0; iter < MAX_NEWTON_ITERATIONS; ++iter) {
+        double step;
+        if (d2 < 0) step = -d1 / d2;
+        else step = d1 > 0 ? t : -t / 2;  // Not concave here, so just move uphill
+        double t_new = min(max(t + step, static_cast<double>(MIN_BRANCH_LENGTH)), static_cast<double>(MAX_BRANCH_LENGTH));
+        if (fabs(t_new - t) < NEWTON_TOLERANCE) break;  // Converged, or pinned against a bound
+        if (d2 < 0 && d1 * d1 / (-2 * d2) < tolerance) break;
+        double lnl_new, d1_new, d2_new;
+        evaluate(t_new, lnl_new, d1_new, d2_new);
+        while (!(lnl_new >= lnl)) {
+            step /= 2;
+            t_new = min(max(t + step, static_cast<double>(MIN_BRANCH_LENGTH)), static_cast<double>(MAX_BRANCH_LENGTH));
+            if (fabs(t_new - t) < NEWTON_TOLERANCE) break;
+            evaluate(t_new, lnl_new, d1_new, d2_new);
+        }
+        if (!(lnl_new >= lnl)) break;
+        t = t_new;
+        lnl = lnl_new;
+        d1 = d1_new;
+        d2 = d2_new;
+    }
+    return t;
+}
+
+// e, e g and e g^2 for each category and eigenvalue, where g is the eigenvalue's rate and e its weight at t
+void ParallelTreeLikelihood::_branch_exponentials(double t, AlignedVector& e, AlignedVector& eg, AlignedVector& egg) const {
+    size_t s = _nstates;
+    e.resize(_ncat * s);
+    eg.resize(_ncat * s);
+    egg.resize(_ncat * s);
+    for (size_t c = 0; c < _ncat; ++c) {
+        for (size_t k = 0; k < s; ++k) {
+            double g = _eigenvalues[k] * _category_rates[c];
+            size_t i = c * s + k;
+            e[i] = _category_probs[c] * exp(g * t);
+            eg[i] = e[i] * g;
+            egg[i] = eg[i] * g;
+        }
+    }
+}
+
+// lnL (up to a constant) and its derivatives in the length of the branch held in _projections
+void ParallelTreeLikelihood::_evaluate_branch(double t, double& lnl, double& d1, double& d2) {
+    ++_stats.branch_evaluations;
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    AlignedVector e, eg, egg;
+    _branch_exponentials(t, e, eg, egg);
+    size_t nchunks = _number_of_chunks();
+    vector<double> sums(3 * nchunks, 0);
+    _for_each_chunk([&](size_t chunk, size_t begin, size_t end) {
+        _kernels.evaluate(_projections.data(), e.data(), eg.data(), egg.data(), _pattern_weights.data(),
+                s, _ncat, n, begin, end, sums[3 * chunk], sums[3 * chunk + 1], sums[3 * chunk + 2]);
+    });
+    lnl = d1 = d2 = 0;
+    for (size_t chunk = 0; chunk < nchunks; ++chunk) {
+        lnl += sums[3 * chunk];
+        d1 += sums[3 * chunk + 1];
+        d2 += sums[3 * chunk + 2];
+    }
+}
+
+/*
+lnL, and its derivative in the length of every branch into gradient, indexed
+by the node below the branch (0 for the root). After the pruning pass, one
+pre-order pass makes the upper vectors; each branch's data is then projected
+as for _evaluate_branch, chunk by chunk, so all branches are done in a
+single split of the patterns across the pool. The projection and a leaf's
+upper vector are written over only the chunk's own patterns.
+*/
+double ParallelTreeLikelihood::_gradient(vector<double>& gradient) {
+    ++_stats.gradients;
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    size_t nnodes = _children.size();
+    double lnl = get_log_likelihood();
+    _update_node_uppers();
+    vector<AlignedVector> e(nnodes), eg(nnodes), egg(nnodes);
+    for (size_t v = 0; v < nnodes; ++v) {
+        if (v != _root) _branch_exponentials(_lengths[v], e[v], eg[v], egg[v]);
+    }
+    AlignedVector leaf_upper(_ncat * n * s);
+    _projections.resize(_ncat * n * s);
+    vector<double> sums(_number_of_chunks() * nnodes, 0);
+    _for_each_chunk([&](size_t chunk, size_t begin, size_t end) {
+        for (size_t v = 0; v < nnodes; ++v) {
+            if (v == _root) continue;
+            bool leaf = _is_leaf(v);
+            const double* upper = _node_uppers[v].data();
+            if (leaf) {
+                size_t parent = _parent[v];
+                _upper_message(v, parent != _root ? _node_uppers[parent].data() : nullptr, leaf_upper.data(), begin, end);
+                upper = leaf_upper.data();
+            }
+            _kernels.project(upper, leaf ? nullptr : _partials[v].data(), _tip_left.data(), leaf ? &_tip_codes[v * n] : nullptr,
+                    _right_columns.data(), _left_columns.data(), _projections.data(), s, _ncat, n, begin, end);
+            double l0 = 0, l2 = 0;
+            _kernels.evaluate(_projections.data(), e[v].data(), eg[v].data(), egg[v].data(), _pattern_weights.data(),
+                    s, _ncat, n, begin, end, l0, sums[chunk * nnodes + v], l2);
+        }
+    });
+    gradient.assign(nnodes, 0);
+    for (size_t chunk = 0; chunk < _number_of_chunks(); ++chunk) {
+        for (size_t v = 0; v < nnodes; ++v) gradient[v] += sums[chunk * nnodes + v];
+    }
+    _node_uppers.clear();
+    _node_upper_scales.clear();
+    return lnl;
+}
+
+// Sets every branch length, indexed by the node below the branch, and returns lnL
+double ParallelTreeLikelihood::_set_lengths(const vector<double>& lengths) {
+    for (size_t v = 0; v < _children.size(); ++v) {
+        if (v != _root) _set_branch_length(v, lengths[v]);
+    }
+    _dirty = true;
+    return get_log_likelihood();
+}
+
+/*
+One pass over every branch in pre-order. Entering a node, the upper vector
+of each child is formed from the node's own and the child's siblings, the
+child's branch is optimised, and its subtree visited; leaving the node, its
+partials are recomputed from its now optimised subtrees. Each upper vector is
+kept only while its subtree is being visited, one per level of the tree.
+With several partitions, each step runs on all of them, and a branch length
+is optimised on their summed lnL.
+tolerance is the gain in lnL below which a branch is not moved further.
+*/
+void ParallelTreeLikelihood::_sweep(const vector<ParallelTreeLikelihood*>& partitions, double tolerance) {
+    const ParallelTreeLikelihood& first = *partitions[0];
+    size_t npartitions = partitions.size();
+    vector<double> sums(3 * npartitions);
+    auto optimise = [&](size_t v, size_t depth) {
+        _for_each_partition(partitions, [&](size_t i) {
+            ParallelTreeLikelihood& partition = *partitions[i];
+            partition._update_upper(v, depth);
+            partition._project_branch(v, partition._uppers[depth].data());
+        });
+        double t = first._newton(first._lengths[v], [&](double x, double& lnl, double& d1, double& d2) {
+            _for_each_partition(partitions, [&](size_t i) {
+                partitions[i]->_evaluate_branch(x, sums[3 * i], sums[3 * i + 1], sums[3 * i + 2]);
+            });
+            lnl = d1 = d2 = 0;
+            for (size_t i = 0; i < npartitions; ++i) {
+                lnl += sums[3 * i];
+                d1 += sums[3 * i + 1];
+                d2 += sums[3 * i + 2];
+            }
+        }, tolerance);
+        for (ParallelTreeLikelihood* partition : partitions) partition->_set_branch_length(v, t);
+    };
+    struct Frame {
+        size_t node;
+        size_t depth;
+        size_t next;    // Next child to visit
+    };
+    vector<Frame> stack;
+    for (size_t v : first._children[first._root]) {
+        optimise(v, 0);
+        stack.push_back({v, 0, 0});
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            size_t node = frame.node;
+            if (first._is_leaf(node) || frame.next == first._children[node].size()) {
+                if (!first._is_leaf(node)) {
+                    _for_each_partition(partitions, [&](size_t i) {
+                        ParallelTreeLikelihood& partition = *partitions[i];
+                        partition._for_each_chunk([&](size_t, size_t begin, size_t end) {
+                            partition._update_partials(node, begin, end);
+                        });
+                    });
+                }
+                stack.pop_back();
+                continue;
+            }
+            size_t u = first._children[node][frame.next++];
+            size_t depth = frame.depth + 1;
+            optimise(u, depth);
+            stack.push_back({u, depth, 0});
+        }
+    }
+}
+
+// Calls f(i) for each partition, on their pool, which the chunk loops inside f then share
+void ParallelTreeLikelihood::_for_each_partition(const vector<ParallelTreeLikelihood*>& partitions,
+        const function<void(size_t)>& f) {
+    ThreadPool* pool = partitions[0]->_pool;
+    if (partitions.size() > 1 && pool && pool->size() > 1) {
+        pool->parallel_for(0, partitions.size(), [&](size_t i, size_t) { f(i); });
+    }
+    else {
+        for (size_t i = 0; i < partitions.size(); ++i) f(i);
+    }
+}
+
+void ParallelTreeLikelihood::_check_partitions(const vector<ParallelTreeLikelihood*>& partitions) {
+    if (partitions.empty()) throw Exception("ParallelTreeLikelihood: no partitions");
+    const ParallelTreeLikelihood& first = *partitions[0];
+    for (const ParallelTreeLikelihood* partition : partitions) {
+        if (partition->_pool != first._pool) throw Exception("ParallelTreeLikelihood: partitions must share a thread pool");
+        if (partition->_names != first._names || partition->_parent != first._parent) {
+            throw Exception("ParallelTreeLikelihood: partitions must have the same sequences and tree");
+        }
+    }
+}
+
+double ParallelTreeLikelihood::_branch_length(size_t x, size_t y) const {
+    return _lengths[_parent[x] == y ? x : y];
+}
+
+// Neighbours of x in the unrooted tree: its children, then its parent
+vector<size_t> ParallelTreeLikelihood::_neighbours(size_t x) const {
+    vector<size_t> neighbours = _children[x];
+    if (x != _root) neighbours.push_back(_parent[x]);
+    return neighbours;
+}
+
+/*
+Upper vectors, with their rescaling counts, of every internal node but the
+root, in one pre-order pass split across the pool. Internal nodes are
+numbered in pre-order, so each parent's comes first.
+*/
+void ParallelTreeLikelihood::_update_node_uppers() {
+    size_t nnodes = _children.size();
+    _node_uppers.assign(nnodes, AlignedVector());
+    _node_upper_scales.assign(nnodes, vector<int>());
+    for (size_t v = _root + 1; v < nnodes; ++v) {
+        _node_uppers[v].resize(_ncat * _npatterns * _nstates);
+        _node_upper_scales[v].resize(_npatterns);
+    }
+    _for_each_chunk([&](size_t, size_t begin, size_t end) {
+        for (size_t v = _root + 1; v < nnodes; ++v) {
+            size_t parent = _parent[v];
+            bool top = parent == _root;
+            _upper_message(v, top ? nullptr : _node_uppers[parent].data(), _node_uppers[v].data(), begin, end,
+                    top ? nullptr : _node_upper_scales[parent].data(), _node_upper_scales[v].data());
+        }
+    });
+}
+
+/*
+Multiplies out (or, if first, sets it) by the message from node y to its
+neighbour x over every pattern: the conditional likelihood on y's side of
+their branch, brought across it. transitions, if given, stands in for the
+branch's own P(t), with table as space for a leaf's tip table. Adds y's
+side's rescaling counts into scales, if given. Uses the node upper vectors
+when y is x's parent.
+*/
+void ParallelTreeLikelihood::_send_message(size_t y, size_t x, const AlignedVector* transitions, AlignedVector& table,
+        double* out, int* scales, bool first) const {
+    size_t n = _npatterns;
+    bool down = _parent[x] == y;
+    const double* below = down ? _node_uppers[x].data() : _is_leaf(y) ? nullptr : _partials[y].data();
+    const int* below_scales = down ? _node_upper_scales[x].data() : _is_leaf(y) ? nullptr : _scales[y].data();
+    if (scales) {
+        if (first) fill(scales, scales + n, 0);
+        if (below_scales) {
+            for (size_t p = 0; p < n; ++p) scales[p] += below_scales[p];
+        }
+    }
+    if (!transitions) {
+        if (down) _kernels.message(_transitions[x].data(), below, out, first, _nstates, _ncat, n, 0, n);
+        else _multiply_message(y, below, out, first, 0, n);
+    }
+    else if (below) {
+        _kernels.message(transitions->data(), below, out, first, _nstates, _ncat, n, 0, n);
+    }
+    else {
+        _tip_table(*transitions, table);
+        _kernels.tip_message(table.data(), &_tip_codes[y * n], out, first, _nstates, _ncat, _ncodes, n, 0, n);
+    }
+}
+
+/*
+Optimises the length, from t, of a branch whose two sides are projected into
+scratch.z, and returns it, with lnL at that length. The rescaling counts of
+the two sides, where given, are taken off each pattern's lnL, which goes into
+sites if that is given.
+*/
+double ParallelTreeLikelihood::_optimise_projected(double t, BranchScratch& scratch, const int* scales_a, const int* scales_b,
+        double* sites, double& lnl) const {
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    t = _newton(t, [&](double x, double& l0, double& l1, double& l2) {
+        _branch_exponentials(x, scratch.e, scratch.eg, scratch.egg);
+        l0 = l1 = l2 = 0;
+        _kernels.evaluate(scratch.z.data(), scratch.e.data(), scratch.eg.data(), scratch.egg.data(), _pattern_weights.data(),
+                s, _ncat, n, 0, n, l0, l1, l2);
+    }, SUPPORT_TOLERANCE);
+    _branch_exponentials(t, scratch.e, scratch.eg, scratch.egg);
+    const double scale_log = SCALE_EXPONENT * log(2.0);
+    lnl = 0;
+    for (size_t p = 0; p < n; ++p) {
+        double f = 0;
+        for (size_t c = 0; c < _ncat; ++c) {
+            const double* z = &scratch.z[(c * n + p) * s];
+            for (size_t a = 0; a < s; ++a) f += z[a] * scratch.e[c * s + a];
+        }
+        double site = log(max(f, numeric_limits<double>::min()));
+        if (scales_a) site -= scales_a[p] * scale_log;
+        if (scales_b) site -= scales_b[p] * scale_log;
+        if (sites) sites[p] = site;
+        lnl += _pattern_weights[p] * site;
+    }
+    return t;
+}
+
+/*
+Scores the three topologies around the branch above v, on a single thread,
+with only the central branch optimised. around gets the four subtrees: A and
+B below v, C and D on the parent's side (D the parent itself, or the root's
+other child); the topologies join A with B, C and D in turn. lnl and lengths
+get each one's lnL and central branch length, and scratch.sites its lnL per
+pattern. These are only comparable between the three: rescalings inside the
+subtrees are left out. Returns false, with nothing scored, if v is a leaf or
+next to a multifurcation.
+*/
+bool ParallelTreeLikelihood::_score_nni(size_t v, BranchScratch& scratch, double* lnl, double* lengths, size_t* around) const {
+    if (_is_leaf(v) || v == _root) return false;
+    size_t parent = _parent[v];
+    vector<size_t> others;
+    for (size_t u : _neighbours(parent)) {
+        if (u != v) others.push_back(u);
+    }
+    if (_children[v].size() != 2 || others.size() != 2) return false;
+    around[0] = _children[v][0];
+    around[1] = _children[v][1];
+    around[2] = others[0];
+    around[3] = others[1];
+    size_t n = _npatterns;
+    size_t size = _ncat * n * _nstates;
+    for (size_t k = 0; k < 4; ++k) {
+        scratch.messages[k].resize(size);
+        _send_message(around[k], k < 2 ? v : parent, nullptr, scratch.table, scratch.messages[k].data(), nullptr, true);
+    }
+    scratch.x.resize(size);
+    scratch.y.resize(size);
+    scratch.z.resize(size);
+    scratch.scales.resize(2 * n);
+    scratch.sites.resize(3 * n);
+
+    const size_t topologies[3][4] = {{0, 1, 2, 3}, {0, 2, 1, 3}, {0, 3, 1, 2}};
+    int* x_scales = &scratch.scales[0];
+    int* y_scales = &scratch.scales[n];
+    for (size_t k = 0; k < 3; ++k) {
+        const size_t* q = topologies[k];
+        const double* m0 = scratch.messages[q[0]].data();
+        const double* m1 = scratch.messages[q[1]].data();
+        const double* m2 = scratch.messages[q[2]].data();
+        const double* m3 = scratch.messages[q[3]].data();
+        for (size_t i = 0; i < size; ++i) {
+            scratch.x[i] = m0[i] * m1[i];
+            scratch.y[i] = m2[i] * m3[i];
+        }
+        fill(scratch.scales.begin(), scratch.scales.end(), 0);
+        _rescale(scratch.x.data(), x_scales, 0, n);
+        _rescale(scratch.y.data(), y_scales, 0, n);
+        _kernels.project(scratch.x.data(), scratch.y.data(), nullptr, nullptr, _right_columns.data(), _left_columns.data(),
+                scratch.z.data(), _nstates, _ncat, n, 0, n);
+        lengths[k] = _optimise_projected(_lengths[v], scratch, x_scales, y_scales, &scratch.sites[k * n], lnl[k]);
+    }
+    return true;
+}
+
+/*
+SH-like aLRT of the current topology from the per-pattern lnL of the three
+topologies around a branch, in scratch.sites. Each RELL replicate's pattern
+counts are drawn into scratch.counts by a RellSampler, from a generator
+keyed by (seed, b).
+*/
+double ParallelTreeLikelihood::_sh_alrt(const double* lnl, BranchScratch& scratch, size_t nreplicates, uint64_t seed) const {
+    size_t n = _npatterns;
+    double gap = lnl[0] - max(lnl[1], lnl[2]);
+    if (!(gap > 0)) return 0;
+    const double* sites0 = &scratch.sites[0];
+    const double* sites1 = &scratch.sites[n];
+    const double* sites2 = &scratch.sites[2 * n];
+    RellSampler sampler(_pattern_weights, _site_patterns);
+    uint64_t key = SplitMix64{seed}();
+    scratch.counts.resize(n);
+    const uint32_t* row = scratch.counts.data();
+    size_t supported = 0;
+    for (size_t b = 0; b < nreplicates; ++b) {
+        SplitMix64 rng{key ^ SplitMix64{b}()};
+        sampler.draw(rng, scratch.counts.data());
+        // Centred replicate lnL of topologies 1 and 2, less that of topology 0
+        double c1 = lnl[0] - lnl[1];
+        double c2 = lnl[0] - lnl[2];
+        for (size_t p = 0; p < n; ++p) {
+            c1 += row[p] * (sites1[p] - sites0[p]);
+            c2 += row[p] * (sites2[p] - sites0[p]);
+        }
+        double best = max(0.0, max(c1, c2));
+        double second = max(min(0.0, c1), min(max(0.0, c1), c2));
+        if (gap > best - second) ++supported;
+    }
+    return static_cast<double>(supported) / nreplicates;
+}
+
+/*
+Candidate moves for a round of optimise_topology that gain more than
+tolerance, best first. Ties are broken on the nodes involved, so the order
+does not depend on the number of threads.
+*/
+vector<ParallelTreeLikelihood::TopologyMove> ParallelTreeLikelihood::_find_moves(size_t spr_radius, double tolerance) {
+    double lnl = get_log_likelihood();
+    _update_node_uppers();
+    size_t nnodes = _children.size();
+    vector<size_t> tasks;   // v for the NNIs around branch v, nnodes + v for the regrafts of v's subtree
+    for (size_t v = _root + 1; v < nnodes; ++v) tasks.push_back(v);
+    if (spr_radius > 0) {
+        for (size_t v = 0; v < nnodes; ++v) {
+            if (v != _root) tasks.push_back(nnodes + v);
+        }
+    }
+    size_t nthreads = _pool ? _pool->size() : 1;
+    vector<BranchScratch> scratch(nthreads);
+    vector<vector<TopologyMove>> found(nthreads);
+    auto run = [&](size_t i, size_t thread) {
+        size_t task = tasks[i];
+        if (task < nnodes) _nni_moves(task, tolerance, scratch[thread], found[thread]);
+        else _spr_moves(task - nnodes, spr_radius, lnl, tolerance, scratch[thread], found[thread]);
+    };
+    if (_pool && nthreads > 1 && tasks.size() > 1) {
+        _pool->parallel_for(0, tasks.size(), run);
+    }
+    else {
+        for (size_t i = 0; i < tasks.size(); ++i) run(i, 0);
+    }
+    _node_uppers.clear();
+    _node_upper_scales.clear();
+
+    vector<TopologyMove> moves;
+    for (auto& thread_moves : found) moves.insert(moves.end(), thread_moves.begin(), thread_moves.end());
+    sort(moves.begin(), moves.end(), [](const TopologyMove& a, const TopologyMove& b) {
+        if (a.gain != b.gain) return a.gain > b.gain;
+        return make_tuple(a.spr, a.v, a.x, a.y) < make_tuple(b.spr, b.v, b.x, b.y);
+    });
+    return moves;
+}
+
+// The two NNIs around the branch above v, if they gain more than tolerance
+void ParallelTreeLikelihood::_nni_moves(size_t v, double tolerance, BranchScratch& scratch, vector<TopologyMove>& moves) const {
+    double lnl[3], lengths[3];
+    size_t around[4];
+    if (!_score_nni(v, scratch, lnl, lengths, around)) return;
+    size_t u = _parent[v];
+    for (size_t k = 1; k < 3; ++k) {
+        double gain = lnl[k] - lnl[0];
+        // B swaps with C, or with D
+        size_t y = around[k + 1];
+        if (gain > tolerance) moves.push_back({gain, false, v, u, around[1], y, lengths[k], {v, u, around[1], y}});
+    }
+}
+
+/*
+Regrafts of the subtree below v onto each branch at most radius branches
+from where it was pruned, if they gain more than tolerance over lnl. Pruning
+v joins the two other branches at its parent u into one; the walk then runs
+outwards from either end of that branch, carrying the conditional likelihood
+of the pruned tree behind it. A regraft is scored with the new node halfway
+along its branch and only v's branch optimised.
+*/
+void ParallelTreeLikelihood::_spr_moves(size_t v, size_t radius, double lnl, double tolerance, BranchScratch& scratch,
+        vector<TopologyMove>& moves) const {
+    size_t u = _parent[v];
+    vector<size_t> others;
+    for (size_t w : _neighbours(u)) {
+        if (w != v) others.push_back(w);
+    }
+    if (others.size() != 2) return;
+    size_t n = _npatterns;
+    size_t size = _ncat * n * _nstates;
+    if (scratch.behind.size() < radius) {
+        scratch.behind.resize(radius);
+        scratch.behind_scales.resize(radius);
+    }
+    for (size_t d = 0; d < radius; ++d) {
+        scratch.behind[d].resize(size);
+        scratch.behind_scales[d].resize(n);
+    }
+    scratch.x.resize(size);
+    scratch.y.resize(size);
+    scratch.z.resize(size);
+    scratch.scales.resize(2 * n);
+    _transition_matrices(_branch_length(u, others[0]) + _branch_length(u, others[1]), scratch.merged);
+    vector<size_t> path{v, u, others[0], others[1]};
+    for (size_t side = 0; side < 2; ++side) {
+        // Everything beyond the far end, brought across the joined branch
+        size_t far = others[1 - side];
+        int* scales = scratch.behind_scales[0].data();
+        _send_message(far, u, &scratch.merged, scratch.table, scratch.behind[0].data(), scales, true);
+        _rescale(scratch.behind[0].data(), scales, 0, n);
+        _spr_targets(v, others[side], u, 0, radius, lnl, tolerance, scratch, path, moves);
+    }
+}
+
+/*
+Scores regrafting v's subtree onto each branch from x other than the one back
+to from, then walks on past them while within radius. scratch.behind[depth]
+holds the conditional likelihood at x of the pruned tree on from's side; path
+holds the nodes passed through, for the moves' footprints.
+*/
+void ParallelTreeLikelihood::_spr_targets(size_t v, size_t x, size_t from, size_t depth, size_t radius, double lnl,
+        double tolerance, BranchScratch& scratch, vector<size_t>& path, vector<TopologyMove>& moves) const {
+    if (_is_leaf(x)) return;
+    size_t s = _nstates;
+    size_t n = _npatterns;
+    size_t size = _ncat * n * s;
+    vector<size_t> ahead;
+    for (size_t w : _neighbours(x)) {
+        if (w != from) ahead.push_back(w);
+    }
+    path.push_back(x);
+    int* y_scales = &scratch.scales[0];
+    int* x_scales = &scratch.scales[n];
+    for (size_t c : ahead) {
+        // The conditional likelihood at x of everything but c's side
+        copy_n(scratch.behind[depth].data(), size, scratch.y.data());
+        copy_n(scratch.behind_scales[depth].data(), n, y_scales);
+        for (size_t w : ahead) {
+            if (w != c) _send_message(w, x, nullptr, scratch.table, scratch.y.data(), y_scales, false);
+        }
+        _rescale(scratch.y.data(), y_scales, 0, n);
+
+        // With v's subtree hung from the middle of x-c
+        double t = _branch_length(x, c);
+        _transition_matrices(t / 2, scratch.half);
+        _kernels.message(scratch.half.data(), scratch.y.data(), scratch.x.data(), true, s, _ncat, n, 0, n);
+        copy_n(y_scales, n, x_scales);
+        _send_message(c, x, &scratch.half, scratch.table, scratch.x.data(), x_scales, false);
+        _rescale(scratch.x.data(), x_scales, 0, n);
+        bool leaf = _is_leaf(v);
+        _kernels.project(scratch.x.data(), leaf ? nullptr : _partials[v].data(), _tip_left.data(), leaf ? &_tip_codes[v * n] : nullptr,
+                _right_columns.data(), _left_columns.data(), scratch.z.data(), s, _ncat, n, 0, n);
+        double regrafted;
+        double length = _optimise_projected(_lengths[v], scratch, x_scales, leaf ? nullptr : _scales[v].data(), nullptr, regrafted);
+        if (regrafted - lnl > tolerance) {
+            vector<size_t> nodes = path;
+            nodes.push_back(c);
+            moves.push_back({regrafted - lnl, true, v, _parent[v], x, c, length, nodes});
+        }
+
+        if (depth + 1 < radius) {
+            double* next = scratch.behind[depth + 1].data();
+            _kernels.message(_transitions[_parent[c] == x ? c : x].data(), scratch.y.data(), next, true, s, _ncat, n, 0, n);
+            copy_n(y_scales, n, scratch.behind_scales[depth + 1].data());
+            _spr_targets(v, c, x, depth + 1, radius, lnl, tolerance, scratch, path, moves);
+        }
+    }
+    path.pop_back();
+}
+
+/*
+Applies moves, which share no nodes, to the tree, then re-optimises each
+branch they created or changed, all from the partials and upper vectors of
+the new tree before any of those branches moved. Returns the new lnL.
+*/
+double ParallelTreeLikelihood::_apply_moves(const vector<TopologyMove>& moves, double tolerance) {
+    // The tree as an unrooted list of (neighbour, length) for each node, edited in place
+    size_t nnodes = _children.size();
+    vector<vector<pair<size_t, double>>> adjacency(nnodes);
+    for (size_t v = 0; v < nnodes; ++v) {
+        for (size_t u : _children[v]) {
+            adjacency[v].push_back(make_pair(u, _lengths[u]));
+            adjacency[u].push_back(make_pair(v, _lengths[u]));
+        }
+    }
+    auto length = [&](size_t x, size_t y) {
+        for (auto& edge : adjacency[x]) {
+            if (edge.first == y) return edge.second;
+        }
+        throw Exception("ParallelTreeLikelihood: no such branch");
+    };
+    auto relink = [&](size_t x, size_t from, size_t to, double t) {
+        for (auto& edge : adjacency[x]) {
+            if (edge.first == from) edge = make_pair(to, t);
+        }
+    };
+    vector<pair<size_t, size_t>> changed;
+    for (const TopologyMove& move : moves) {
+        size_t v = move.v;
+        size_t u = move.u;
+        if (!move.spr) {
+            double tx = length(v, move.x);
+            double ty = length(u, move.y);
+            relink(v, move.x, move.y, ty);
+            relink(move.y, u, v, ty);
+            relink(u, move.y, move.x, tx);
+            relink(move.x, v, u, tx);
+            relink(v, u, u, move.length);
+            relink(u, v, v, move.length);
+            for (auto& edge : adjacency[v]) changed.push_back(make_pair(v, edge.first));
+            for (auto& edge : adjacency[u]) changed.push_back(make_pair(u, edge.first));
+        }
+        else {
+            vector<pair<size_t, double>> others;
+            for (auto& edge : adjacency[u]) {
+                if (edge.first != v) others.push_back(edge);
+            }
+            size_t a = others[0].first;
+            size_t b = others[1].first;
+            double joined = others[0].second + others[1].second;
+            relink(a, u, b, joined);
+            relink(b, u, a, joined);
+            double half = length(move.x, move.y) / 2;
+            relink(move.x, move.y, u, half);
+            relink(move.y, move.x, u, half);
+            adjacency[u] = {make_pair(v, move.length), make_pair(move.x, half), make_pair(move.y, half)};
+            relink(v, u, u, move.length);
+            for (auto& edge : adjacency[u]) changed.push_back(make_pair(u, edge.first));
+            changed.push_back(make_pair(a, b));
+        }
+    }
+
+    // Back to a rooted tree, renumbering the internal nodes in pre-order from the same root
+    const size_t npos = numeric_limits<size_t>::max();
+    vector<size_t> index(nnodes, npos);
+    _parent.assign(nnodes, npos);
+    _children.assign(nnodes, vector<size_t>());
+    _lengths.assign(nnodes, 0);
+    size_t next = _nseq;
+    vector<tuple<size_t, size_t, double>> todo{make_tuple(_root, npos, 0.0)};
+    while (!todo.empty()) {
+        size_t node, above;
+        double t;
+        tie(node, above, t) = todo.back();
+        todo.pop_back();
+        size_t w = node < _nseq ? node : next++;
+        index[node] = w;
+        if (above != npos) {
+            size_t parent = index[above];
+            _parent[w] = parent;
+            _lengths[w] = t;
+            _children[parent].push_back(w);
+        }
+        // Pushed in reverse, so that neighbours keep their order
+        for (size_t k = adjacency[node].size(); k > 0; --k) {
+            const auto& edge = adjacency[node][k - 1];
+            if (edge.first != above) todo.push_back(make_tuple(edge.first, node, edge.second));
+        }
+    }
+    _index_tree();
+
+    vector<size_t> branches;
+    for (auto& edge : changed) {
+        size_t x = index[edge.first];
+        size_t y = index[edge.second];
+        branches.push_back(_parent[x] == y ? x : y);
+    }
+    sort(branches.begin(), branches.end());
+    branches.erase(unique(branches.begin(), branches.end()), branches.end());
+    get_log_likelihood();
+    _update_node_uppers();
+    _uppers.resize(1);
+    _uppers[0].resize(_ncat * _npatterns * _nstates);
+    for (size_t v : branches) {
+        size_t parent = _parent[v];
+        _for_each_chunk([&](size_t, size_t begin, size_t end) {
+            _upper_message(v, parent != _root ? _node_uppers[parent].data() : nullptr, _uppers[0].data(), begin, end);
+        });
+        _optimise_branch(v, _uppers[0].data(), tolerance / branches.size());
+    }
+    _node_uppers.clear();
+    _node_upper_scales.clear();
+    _dirty = true;
+    return get_log_likelihood();
+}
@@ -0,0 +1,230 @@
+/*
+ * ParallelTreeLikelihood.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef PARALLELTREELIKELIHOOD_H_
+#define PARALLELTREELIKELIHOOD_H_
+
+#include "PackedSequences.h"
+#include "PhyloTree.h"
+#include "PruningKernels.h"
+#include "ThreadPool.h"
+
+#include <Bpp/Numeric/Prob/DiscreteDistribution.h>
+#include <Bpp/Phyl/Model/SubstitutionModel.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+// One round of ParallelTreeLikelihood::optimise_topology
+struct TopologyRound {
+    double log_likelihood;     // At the end of the round
+    size_t improving_moves;    // Candidates found that would gain more than the tolerance
+    size_t nni_moves;          // Accepted
+    size_t spr_moves;          // Accepted
+    double seconds;            // Since the call started
+};
+
+// Work done by the last call to optimise_branch_lengths or optimise_branch_lengths_lbfgs
+struct OptimisationStats {
+    double log_likelihood;      // At the end of the call
+    size_t iterations;          // L-BFGS iterations
+    size_t sweeps;              // Newton sweeps over every branch
+    size_t evaluations;         // Full traversals for lnL
+    size_t gradients;           // Gradient passes, each a pre-order traversal on top of lnL
+    size_t branch_evaluations;  // lnL and its derivatives in one branch length
+    double seconds;
+};
+
+/*
+Tree likelihood over the distinct site patterns of an alignment, computed by
+Felsenstein's pruning with the patterns split into chunks of PATTERN_CHUNK.
+The thread pool hands out whole chunks, and each thread runs the complete
+post-order pass over its chunk, so threads never wait on each other within a
+traversal. lnL is summed per chunk and the chunk sums added in chunk order, so
+the result is the same whatever the number of threads.
+Transition matrices come from the model's eigendecomposition. Conditional
+likelihoods are stored category-major (category, pattern, state) in aligned
+memory, and are rescaled per pattern when they drop below 2^-256. The inner
+loops run in PruningKernels, vectorised for 4 and 20 states.
+Branch lengths are optimised one at a time by Newton's method, in a pre-order
+sweep that carries the conditional likelihood of the rest of the tree down to
+each branch; lnL and its derivatives in a branch length are then sums over
+patterns of O(categories x states) terms, split across the pool like the
+pruning pass. A sweep costs about two traversals. Alternatively, they are
+optimised jointly by projected L-BFGS on the gradient in every branch
+length, which one pre-order pass after the pruning pass gives.
+Branch supports (aBayes, SH-like aLRT) score the NNI neighbours of every
+internal branch in parallel, from the partials and one pass of upper vectors.
+The topology search scores NNI and radius-limited SPR moves the same way,
+each from messages already at hand, and applies non-conflicting improving
+moves in batches.
+Several likelihoods on the same tree and pool can act as partitions of one
+analysis, with linked branch lengths (optimise_shared_branch_lengths): the
+pool's work stealing then spreads chunks of large partitions over threads
+that have run out of partitions.
+The tree is held unrooted: a bifurcating root is merged into one branch.
+The model and rate distribution are shared with the caller, who must call
+update_model after changing their parameters, or set_model to replace them;
+either keeps the tree and patterns, and recomputes only the transition
+matrices, and nothing at all if the values are unchanged.
+*/
+class ParallelTreeLikelihood {
+public:
+    ParallelTreeLikelihood(const PackedSequences& packed, const vector<string>& names, const PhyloTree& tree,
+            shared_ptr<SubstitutionModel> model, shared_ptr<DiscreteDistribution> rates, ThreadPool* pool=nullptr);
+    ParallelTreeLikelihood(const ParallelTreeLikelihood& other, shared_ptr<SubstitutionModel> model,
+            shared_ptr<DiscreteDistribution> rates);
+    virtual ~ParallelTreeLikelihood();
+    void set_thread_pool(ThreadPool* pool);
+    void set_tree(const PhyloTree& tree);
+    void set_model(shared_ptr<SubstitutionModel> model, shared_ptr<DiscreteDistribution> rates);
+    void update_model();
+    PhyloTree get_phylo_tree() const;
+    PhyloTree get_phylo_tree(const vector<double>& support) const;
+    size_t get_number_of_patterns() const;
+    size_t get_number_of_branches() const;
+    size_t get_number_of_sites() const;
+    size_t get_number_of_categories() const;
+    const vector<size_t>& get_site_patterns() const;
+    const vector<double>& get_pattern_weights() const;
+    double get_log_likelihood();
+    void fill_site_likelihoods(double* log_likelihoods, double* posteriors);
+    double optimise_branch_lengths(double tolerance=0.001, size_t max_sweeps=100);
+    double optimise_branch_lengths_lbfgs(double tolerance=0.001, size_t max_iterations=1000, bool polish=true);
+    const OptimisationStats& get_optimisation_stats() const;
+    static double get_total_log_likelihood(const vector<ParallelTreeLikelihood*>& partitions);
+    static double optimise_shared_branch_lengths(const vector<ParallelTreeLikelihood*>& partitions,
+            double tolerance=0.001, size_t max_sweeps=100);
+    double optimise_parameters(bool fix_branch_lengths, double tolerance=0.001, size_t max_rounds=100);
+    double optimise_parameters(const ParameterList& parameters, bool fix_branch_lengths, double tolerance=0.001,
+            size_t max_rounds=100);
+    void compute_branch_support(vector<double>& abayes, vector<double>& alrt, size_t nreplicates=1000, uint64_t seed=1);
+    double optimise_topology(size_t spr_radius=0, double tolerance=0.001, size_t max_rounds=100);
+    const vector<TopologyRound>& get_topology_log() const;
+    void clear_topology_log();
+    void set_reference_kernels(bool reference);
+    string get_kernel_name() const;
+
+private:
+    // Per-thread work space for scoring rearrangements
+    struct BranchScratch {
+        AlignedVector messages[4];
+        AlignedVector x, y, z, e, eg, egg;
+        vector<int> scales;                   // Rescalings of x and y
+        vector<double> sites;                 // lnL of each pattern under each of the three NNI topologies
+        vector<uint32_t> counts;              // Pattern counts of one RELL replicate
+        vector<AlignedVector> behind;         // SPR: conditional likelihood from behind, by distance walked
+        vector<vector<int>> behind_scales;
+        AlignedVector merged, half, table;    // SPR: transition matrices, and a tip table
+    };
+    // A candidate rearrangement for optimise_topology
+    struct TopologyMove {
+        double gain;
+        bool spr;
+        size_t v, u;               // NNI: the branch, u the parent; SPR: the pruned node and its parent
+        size_t x, y;               // NNI: the neighbours of v and u that swap; SPR: the branch regrafted onto
+        double length;             // New length of v-u
+        vector<size_t> nodes;      // Nodes the move changes or was scored from
+    };
+    bool _is_leaf(size_t v) const { return v < _nseq; }
+    vector<double> _model_values() const;
+    size_t _number_of_chunks() const;
+    void _for_each_chunk(const function<void(size_t, size_t, size_t)>& f);
+    void _compress_patterns(const PackedSequences& packed);
+    void _index_tree();
+    void _allocate();
+    void _update_transitions(size_t v);
+    void _transition_matrices(double t, AlignedVector& p) const;
+    void _tip_table(const AlignedVector& p, AlignedVector& table) const;
+    void _multiply_message(size_t v, const double* below, double* out, bool first, size_t begin, size_t end) const;
+    void _rescale(double* partials, int* scales, size_t begin, size_t end) const;
+    void _update_partials(size_t v, size_t begin, size_t end);
+    double _root_log_likelihood(size_t begin, size_t end);
+    void _update_upper(size_t v, size_t depth);
+    void _upper_message(size_t v, const double* parent_upper, double* upper, size_t begin, size_t end,
+            const int* parent_scales=nullptr, int* scales=nullptr) const;
+    void _optimise_branch(size_t v, const double* upper, double tolerance);
+    void _project_branch(size_t v, const double* upper);
+    void _set_branch_length(size_t v, double t);
+    double _newton(double t, const function<void(double, double&, double&, double&)>& evaluate, double tolerance) const;
+    void _branch_exponentials(double t, AlignedVector& e, AlignedVector& eg, AlignedVector& egg) const;
+    void _evaluate_branch(double t, double& lnl, double& d1, double& d2);
+    double _gradient(vector<double>& gradient);
+    double _set_lengths(const vector<double>& lengths);
+    static void _sweep(const vector<ParallelTreeLikelihood*>& partitions, double tolerance);
+    static void _for_each_partition(const vector<ParallelTreeLikelihood*>& partitions, const function<void(size_t)>& f);
+    static void _check_partitions(const vector<ParallelTreeLikelihood*>& partitions);
+    double _branch_length(size_t x, size_t y) const;
+    vector<size_t> _neighbours(size_t x) const;
+    void _update_node_uppers();
+    void _send_message(size_t y, size_t x, const AlignedVector* transitions, AlignedVector& table, double* out, int* scales,
+            bool first) const;
+    double _optimise_projected(double t, BranchScratch& scratch, const int* scales_a, const int* scales_b, double* sites,
+            double& lnl) const;
+    bool _score_nni(size_t v, BranchScratch& scratch, double* lnl, double* lengths, size_t* around) const;
+    double _sh_alrt(const double* lnl, BranchScratch& scratch, size_t nreplicates, uint64_t seed) const;
+    vector<TopologyMove> _find_moves(size_t spr_radius, double tolerance);
+    void _nni_moves(size_t v, double tolerance, BranchScratch& scratch, vector<TopologyMove>& moves) const;
+    void _spr_moves(size_t v, size_t radius, double lnl, double tolerance, BranchScratch& scratch,
+            vector<TopologyMove>& moves) const;
+    void _spr_targets(size_t v, size_t x, size_t from, size_t depth, size_t radius, double lnl, double tolerance,
+            BranchScratch& scratch, vector<size_t>& path, vector<TopologyMove>& moves) const;
+    double _apply_moves(const vector<TopologyMove>& moves, double tolerance);
+    shared_ptr<SubstitutionModel> _model;
+    shared_ptr<DiscreteDistribution> _rates;
+    ThreadPool* _pool;
+    size_t _nseq;
+    size_t _nstates;
+    size_t _ncodes;                    // Including the code for missing data, which is last
+    size_t _ncat;
+    size_t _npatterns;
+    vector<string> _names;
+    vector<uint32_t> _code_masks;
+    vector<uint8_t> _tip_codes;        // nseq x npatterns
+    vector<double> _pattern_weights;
+    vector<size_t> _site_patterns;
+    vector<double> _eigenvalues;       // Scaled by the model rate
+    vector<double> _right;             // nstates x nstates, column eigenvectors
+    vector<double> _left;              // nstates x nstates, row eigenvectors
+    vector<double> _freqs;
+    vector<double> _category_rates;
+    vector<double> _category_probs;
+    AlignedVector _right_columns;      // Columns of diag(freqs) x right, transposed: a x k
+    AlignedVector _left_columns;       // Columns of left: b x k
+    AlignedVector _tip_left;           // ncodes x nstates: left eigenvectors summed over each code's states
+    PruningKernels _kernels;
+    bool _reference_kernels;
+    // Nodes 0..nseq-1 are the leaves, in sequence order
+    size_t _root;
+    vector<size_t> _parent;            // npos for the root
+    vector<vector<size_t>> _children;
+    vector<double> _lengths;
+    vector<size_t> _postorder;         // Internal nodes only
+    vector<AlignedVector> _transitions;    // ncat x nstates x nstates per branch, by columns
+    vector<AlignedVector> _tip_tables;     // ncat x ncodes x nstates per leaf: P summed over each code's states
+    vector<AlignedVector> _partials;       // ncat x npatterns x nstates per internal node
+    vector<vector<int>> _scales;           // Rescalings per pattern, summed over the subtree
+    vector<AlignedVector> _uppers;         // Likelihood of the rest of the tree, by depth in the sweep
+    AlignedVector _projections;            // Current branch's terms in the eigenbasis
+    vector<double> _chunk_sums;
+    vector<double> _pattern_log_likelihoods;   // From the last full traversal
+    vector<double> _pattern_posteriors;        // npatterns x ncat
+    vector<AlignedVector> _node_uppers;        // Upper vector of every internal node, while scoring rearrangements
+    vector<vector<int>> _node_upper_scales;
+    vector<TopologyRound> _topology_log;
+    OptimisationStats _stats;
+    double _lnl;
+    bool _dirty;
+};
+
+#endif /* PARALLELTREELIKELIHOOD_H_ */
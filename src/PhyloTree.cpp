@@ -0,0 +1,79 @@
+/*
+ * PhyloTree.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "PhyloTree.h"
+
+#include <Bpp/Exceptions.h>
+#include <Bpp/Phyl/Io/Newick.h>
+#include <Bpp/Phyl/TreeTools.h>
+
+#include <fstream>
+#include <sstream>
+
+PhyloTree::PhyloTree() : _has_support(false) {}
+
+/*
+Takes ownership of tree. Nodes are renumbered as Newick::read numbers them,
+so node ids are the same as if the tree had been written out and read back.
+*/
+PhyloTree::PhyloTree(TreeTemplate<Node>* tree, bool has_support) :
+        _has_support(has_support) {
+    if (!tree) throw Exception("PhyloTree: no tree");
+    tree->resetNodesId();
+    _tree = shared_ptr<const TreeTemplate<Node>>(tree);
+}
+
+PhyloTree::~PhyloTree() {}
+
+/*
+Parses newick, which is either a Newick string or the name of a file holding
+one. Anything that looks like a tree is parsed as one, so the filesystem is
+only probed for strings that are not trees.
+*/
+PhyloTree PhyloTree::from_newick(string newick) {
+    newick.erase(newick.find_last_not_of(" \n\r\t")+1);
+    Newick reader(false);
+    if (!newick.empty() && newick.front() == '(' && newick.back() == ';') {
+        stringstream ss{newick};
+        return PhyloTree(reader.read(ss));
+    }
+    ifstream file(newick.c_str());
+    if (!file) throw Exception("Couldn't understand this tree: " + newick);
+    return PhyloTree(reader.read(file));
+}
+
+const TreeTemplate<Node>& PhyloTree::get_tree() const {
+    if (!_tree) throw Exception("PhyloTree: no tree");
+    return *_tree;
+}
+
+size_t PhyloTree::get_number_of_leaves() const {
+    return get_tree().getNumberOfLeaves();
+}
+
+vector<string> PhyloTree::get_leaf_names() const {
+    return get_tree().getLeavesNames();
+}
+
+bool PhyloTree::has_support() const {
+    return _has_support;
+}
+
+string PhyloTree::to_newick() const {
+    string s;
+    if (_has_support) {
+        s = TreeTools::treeToParenthesis(get_tree(), true, TreeTools::BOOTSTRAP);
+    }
+    else {
+        stringstream ss;
+        Newick treeWriter;
+        treeWriter.write(get_tree(), ss);
+        s = ss.str();
+    }
+    s.erase(s.find_last_not_of(" \n\r\t")+1);
+    return s;
+}
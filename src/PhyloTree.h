@@ -0,0 +1,45 @@
+/*
+ * PhyloTree.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef PHYLOTREE_H_
+#define PHYLOTREE_H_
+
+#include <Bpp/Phyl/Node.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+/*
+Read-only handle on a parsed tree, so that a tree built by one method can be
+handed to another without writing and re-reading Newick. Copies share the
+same tree; a default-constructed handle holds none. Trees carrying support
+values on their branches (bootstrap or aBayes) write them as internal node
+labels.
+*/
+class PhyloTree {
+public:
+    PhyloTree();
+    PhyloTree(TreeTemplate<Node>* tree, bool has_support=false);
+    virtual ~PhyloTree();
+    static PhyloTree from_newick(string newick);
+    const TreeTemplate<Node>& get_tree() const;
+    size_t get_number_of_leaves() const;
+    vector<string> get_leaf_names() const;
+    bool has_support() const;
+    string to_newick() const;
+
+private:
+    shared_ptr<const TreeTemplate<Node>> _tree;
+    bool _has_support;
+};
+
+#endif /* PHYLOTREE_H_ */
@@ -0,0 +1,273 @@
+/*
+ * PruningKernels.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "PruningKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PRUNING_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+Scalar kernels. S and C fix the number of states and categories at compile
+time; 0 leaves them to the nstates and ncat arguments.
+*/
+template<size_t S, size_t C>
+void message_scalar(const double* columns, const double* below, double* out, bool first,
+        size_t nstates, size_t ncat, size_t npatterns, size_t begin, size_t end) {
+    const size_t s = S ? S : nstates;
+    const size_t nc = C ? C : ncat;
+    for (size_t c = 0; c < nc; ++c) {
+        const double* m = columns + c * s * s;
+        for (size_t p = begin; p < end; ++p) {
+            const double* x = below + (c * npatterns + p) * s;
+            double* o = out + (c * npatterns + p) * s;
+            for (size_t a = 0; a < s; ++a) {
+                double sum = 0;
+                for (size_t b = 0; b < s; ++b) sum += m[b * s + a] * x[b];
+                o[a] = first ? sum : o[a] * sum;
+            }
+        }
+    }
+}
+
+template<size_t S, size_t C>
+void tip_message_scalar(const double* table, const uint8_t* codes, double* out, bool first,
+        size_t nstates, size_t ncat, size_t ncodes, size_t npatterns, size_t begin, size_t end) {
+    const size_t s = S ? S : nstates;
+    const size_t nc = C ? C : ncat;
+    for (size_t c = 0; c < nc; ++c) {
+        const double* t = table + c * ncodes * s;
+        for (size_t p = begin; p < end; ++p) {
+            const double* row = t + codes[p] * s;
+            double* o = out + (c * npatterns + p) * s;
+            for (size_t a = 0; a < s; ++a) o[a] = first ? row[a] : o[a] * row[a];
+        }
+    }
+}
+
+template<size_t S, size_t C>
+void project_scalar(const double* upper, const double* below, const double* tip_rows, const uint8_t* codes,
+        const double* right_columns, const double* left_columns, double* z,
+        size_t nstates, size_t ncat, size_t npatterns, size_t begin, size_t end) {
+    const size_t s = S ? S : nstates;
+    const size_t nc = C ? C : ncat;
+    for (size_t c = 0; c < nc; ++c) {
+        for (size_t p = begin; p < end; ++p) {
+            const double* w = upper + (c * npatterns + p) * s;
+            double* zr = z + (c * npatterns + p) * s;
+            for (size_t k = 0; k < s; ++k) {
+                double sum = 0;
+                for (size_t a = 0; a < s; ++a) sum += right_columns[a * s + k] * w[a];
+                zr[k] = sum;
+            }
+            if (codes) {
+                const double* y = tip_rows + codes[p] * s;
+                for (size_t k = 0; k < s; ++k) zr[k] *= y[k];
+            }
+            else {
+                const double* d = below + (c * npatterns + p) * s;
+                for (size_t k = 0; k < s; ++k) {
+                    double sum = 0;
+                    for (size_t b = 0; b < s; ++b) sum += left_columns[b * s + k] * d[b];
+                    zr[k] *= sum;
+                }
+            }
+        }
+    }
+}
+
+// Shared tail of the evaluate kernels: one pattern's contribution
+inline void accumulate_pattern(double f0, double f1, double f2, double weight, double& l0, double& l1, double& l2) {
+    // Rounding in the eigenvectors can push tiny likelihoods below zero
+    f0 = max(f0, numeric_limits<double>::min());
+    double r = f1 / f0;
+    l0 += weight * log(f0);
+    l1 += weight * r;
+    l2 += weight * (f2 / f0 - r * r);
+}
+
+template<size_t S, size_t C>
+void evaluate_scalar(const double* z, const double* e, const double* eg, const double* egg, const double* weights,
+        size_t nstates, size_t ncat, size_t npatterns, size_t begin, size_t end, double& l0, double& l1, double& l2) {
+    const size_t s = S ? S : nstates;
+    const size_t nc = C ? C : ncat;
+    double s0 = 0, s1 = 0, s2 = 0;
+    for (size_t p = begin; p < end; ++p) {
+        double f0 = 0, f1 = 0, f2 = 0;
+        for (size_t c = 0; c < nc; ++c) {
+            const double* zr = z + (c * npatterns + p) * s;
+            for (size_t k = 0; k < s; ++k) {
+                f0 += zr[k] * e[c * s + k];
+                f1 += zr[k] * eg[c * s + k];
+                f2 += zr[k] * egg[c * s + k];
+            }
+        }
+        accumulate_pattern(f0, f1, f2, weights[p], s0, s1, s2);
+    }
+    l0 += s0;
+    l1 += s1;
+    l2 += s2;
+}
+
+#ifdef PRUNING_X86_KERNELS
+/*
+AVX2/FMA kernels, for state counts that are a multiple of 4: each pattern's
+states are S / 4 vectors, kept in registers while a matrix is applied.
+*/
+__attribute__((target("avx2")))
+inline double horizontal_sum(__m256d v) {
+    __m128d lo = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+template<size_t S, size_t C>
+__attribute__((target("avx2,fma")))
+void message_avx2(const double* columns, const double* below, double* out, bool first,
+        size_t, size_t ncat, size_t npatterns, size_t begin, size_t end) {
+    const size_t V = S / 4;
+    const size_t nc = C ? C : ncat;
+    for (size_t c = 0; c < nc; ++c) {
+        const double* m = columns + c * S * S;
+        for (size_t p = begin; p < end; ++p) {
+            const double* x = below + (c * npatterns + p) * S;
+            double* o = out + (c * npatterns + p) * S;
+            __m256d acc[V];
+            for (size_t v = 0; v < V; ++v) acc[v] = _mm256_setzero_pd();
+            for (size_t b = 0; b < S; ++b) {
+                __m256d xb = _mm256_broadcast_sd(x + b);
+                for (size_t v = 0; v < V; ++v) acc[v] = _mm256_fmadd_pd(_mm256_load_pd(m + b * S + 4 * v), xb, acc[v]);
+            }
+            for (size_t v = 0; v < V; ++v) {
+                _mm256_store_pd(o + 4 * v, first ? acc[v] : _mm256_mul_pd(_mm256_load_pd(o + 4 * v), acc[v]));
+            }
+        }
+    }
+}
+
+template<size_t S, size_t C>
+__attribute__((target("avx2,fma")))
+void tip_message_avx2(const double* table, const uint8_t* codes, double* out, bool first,
+        size_t, size_t ncat, size_t ncodes, size_t npatterns, size_t begin, size_t end) {
+    const size_t V = S / 4;
+    const size_t nc = C ? C : ncat;
+    for (size_t c = 0; c < nc; ++c) {
+        const double* t = table + c * ncodes * S;
+        for (size_t p = begin; p < end; ++p) {
+            const double* row = t + codes[p] * S;
+            double* o = out + (c * npatterns + p) * S;
+            for (size_t v = 0; v < V; ++v) {
+                __m256d r = _mm256_load_pd(row + 4 * v);
+                _mm256_store_pd(o + 4 * v, first ? r : _mm256_mul_pd(_mm256_load_pd(o + 4 * v), r));
+            }
+        }
+    }
+}
+
+template<size_t S, size_t C>
+__attribute__((target("avx2,fma")))
+void project_avx2(const double* upper, const double* below, const double* tip_rows, const uint8_t* codes,
+        const double* right_columns, const double* left_columns, double* z,
+        size_t, size_t ncat, size_t npatterns, size_t begin, size_t end) {
+    const size_t V = S / 4;
+    const size_t nc = C ? C : ncat;
+    for (size_t c = 0; c < nc; ++c) {
+        for (size_t p = begin; p < end; ++p) {
+            const double* w = upper + (c * npatterns + p) * S;
+            __m256d x[V], y[V];
+            for (size_t v = 0; v < V; ++v) x[v] = _mm256_setzero_pd();
+            for (size_t a = 0; a < S; ++a) {
+                __m256d wa = _mm256_broadcast_sd(w + a);
+                for (size_t v = 0; v < V; ++v) x[v] = _mm256_fmadd_pd(_mm256_load_pd(right_columns + a * S + 4 * v), wa, x[v]);
+            }
+            if (codes) {
+                const double* row = tip_rows + codes[p] * S;
+                for (size_t v = 0; v < V; ++v) y[v] = _mm256_load_pd(row + 4 * v);
+            }
+            else {
+                const double* d = below + (c * npatterns + p) * S;
+                for (size_t v = 0; v < V; ++v) y[v] = _mm256_setzero_pd();
+                for (size_t b = 0; b < S; ++b) {
+                    __m256d db = _mm256_broadcast_sd(d + b);
+                    for (size_t v = 0; v < V; ++v) y[v] = _mm256_fmadd_pd(_mm256_load_pd(left_columns + b * S + 4 * v), db, y[v]);
+                }
+            }
+            double* zr = z + (c * npatterns + p) * S;
+            for (size_t v = 0; v < V; ++v) _mm256_store_pd(zr + 4 * v, _mm256_mul_pd(x[v], y[v]));
+        }
+    }
+}
+
+template<size_t S, size_t C>
+__attribute__((target("avx2,fma")))
+void evaluate_avx2(const double* z, const double* e, const double* eg, const double* egg, const double* weights,
+        size_t, size_t ncat, size_t npatterns, size_t begin, size_t end, double& l0, double& l1, double& l2) {
+    const size_t V = S / 4;
+    const size_t nc = C ? C : ncat;
+    double s0 = 0, s1 = 0, s2 = 0;
+    for (size_t p = begin; p < end; ++p) {
+        __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd(), a2 = _mm256_setzero_pd();
+        for (size_t c = 0; c < nc; ++c) {
+            const double* zr = z + (c * npatterns + p) * S;
+            for (size_t v = 0; v < V; ++v) {
+                __m256d zv = _mm256_load_pd(zr + 4 * v);
+                size_t offset = c * S + 4 * v;
+                a0 = _mm256_fmadd_pd(zv, _mm256_load_pd(e + offset), a0);
+                a1 = _mm256_fmadd_pd(zv, _mm256_load_pd(eg + offset), a1);
+                a2 = _mm256_fmadd_pd(zv, _mm256_load_pd(egg + offset), a2);
+            }
+        }
+        accumulate_pattern(horizontal_sum(a0), horizontal_sum(a1), horizontal_sum(a2), weights[p], s0, s1, s2);
+    }
+    l0 += s0;
+    l1 += s1;
+    l2 += s2;
+}
+
+template<size_t S, size_t C>
+PruningKernels avx2_kernels() {
+    return {message_avx2<S, C>, tip_message_avx2<S, C>, project_avx2<S, C>, evaluate_avx2<S, C>, "avx2"};
+}
+#endif
+
+template<size_t S, size_t C>
+PruningKernels scalar_kernels() {
+    return {message_scalar<S, C>, tip_message_scalar<S, C>, project_scalar<S, C>, evaluate_scalar<S, C>, "scalar"};
+}
+
+template<size_t S>
+PruningKernels kernels_for_states(size_t ncat, bool avx2) {
+#ifdef PRUNING_X86_KERNELS
+    if (avx2) {
+        if (ncat == 1) return avx2_kernels<S, 1>();
+        if (ncat == 4) return avx2_kernels<S, 4>();
+        return avx2_kernels<S, 0>();
+    }
+#endif
+    if (ncat == 1) return scalar_kernels<S, 1>();
+    if (ncat == 4) return scalar_kernels<S, 4>();
+    return scalar_kernels<S, 0>();
+}
+
+/*
+The fastest kernels for this state and category count that the CPU supports,
+or the scalar ones if reference is set.
+*/
+PruningKernels get_pruning_kernels(size_t nstates, size_t ncat, bool reference) {
+    bool avx2 = false;
+#ifdef PRUNING_X86_KERNELS
+    __builtin_cpu_init();
+    avx2 = !reference && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    if (nstates == 4) return kernels_for_states<4>(ncat, avx2);
+    if (nstates == 20) return kernels_for_states<20>(ncat, avx2);
+    return scalar_kernels<0, 0>();
+}
@@ -0,0 +1,78 @@
+/*
+ * PruningKernels.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef PRUNINGKERNELS_H_
+#define PRUNINGKERNELS_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define KERNEL_ALIGNMENT 32
+
+// Allocates on KERNEL_ALIGNMENT-byte boundaries, for aligned vector loads
+template<typename T>
+struct AlignedAllocator {
+    typedef T value_type;
+    AlignedAllocator() {}
+    template<typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, KERNEL_ALIGNMENT, n * sizeof(T)) != 0) throw bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { free(p); }
+};
+
+template<typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+
+template<typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+typedef vector<double, AlignedAllocator<double>> AlignedVector;
+
+/*
+Inner loops of the pruning algorithm, over patterns [begin, end) of every
+rate category. Conditional likelihoods are laid out category-major, then by
+pattern, then by state, so each pattern's states are contiguous and, for 4 and
+20 states, start on an aligned boundary. Square matrices are stored by
+columns, so applying one to a vector is a sum of columns scaled by its
+entries, which maps onto broadcast-and-FMA.
+- message: out = (or *=, unless first) M x, for each pattern's x in below.
+- tip_message: out = (or *=) the row of table for each pattern's code; table
+  is ncat x ncodes x nstates.
+- project: z = (R w) * (L d) elementwise, w from upper and d from below, or
+  for a leaf, (L d) is the row of tip_rows for the pattern's code.
+- evaluate: per pattern f0 = sum z e, f1 = sum z eg, f2 = sum z egg over
+  categories and states; adds sum weight log f0, sum weight f1 / f0 and
+  sum weight (f2 / f0 - (f1 / f0)^2) into l0, l1, l2.
+Kernels are instantiated for 4 and 20 states with 1, 4 or any number of
+categories, in an AVX2/FMA version picked at runtime if the CPU has it and a
+portable scalar one, which is also the reference the vector kernels can be
+checked against. Other state counts only get the scalar kernels.
+*/
+struct PruningKernels {
+    void (*message)(const double* columns, const double* below, double* out, bool first,
+            size_t nstates, size_t ncat, size_t npatterns, size_t begin, size_t end);
+    void (*tip_message)(const double* table, const uint8_t* codes, double* out, bool first,
+            size_t nstates, size_t ncat, size_t ncodes, size_t npatterns, size_t begin, size_t end);
+    void (*project)(const double* upper, const double* below, const double* tip_rows, const uint8_t* codes,
+            const double* right_columns, const double* left_columns, double* z,
+            size_t nstates, size_t ncat, size_t npatterns, size_t begin, size_t end);
+    void (*evaluate)(const double* z, const double* e, const double* eg, const double* egg, const double* weights,
+            size_t nstates, size_t ncat, size_t npatterns, size_t begin, size_t end, double& l0, double& l1, double& l2);
+    string name;
+};
+
+PruningKernels get_pruning_kernels(size_t nstates, size_t ncat, bool reference=false);
+
+#endif /* PRUNINGKERNELS_H_ */
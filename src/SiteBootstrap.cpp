@@ -0,0 +1,98 @@
+/*
+ * SiteBootstrap.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "SiteBootstrap.h"
+
+#include <random>
+#include <string>
+#include <unordered_map>
+
+SiteBootstrap::SiteBootstrap(const PackedSequences& packed, size_t nreplicates, uint64_t seed, bool include_original) :
+        _packed(packed), _nreplicates(nreplicates) {
+    size_t nseq = packed.get_number_of_sequences();
+    size_t nsites = packed.get_number_of_sites();
+
+    // Collapse identical columns
+    vector<size_t> pattern_of_site(nsites);
+    vector<double> pattern_counts;
+    unordered_map<string, size_t> patterns;
+    string column(nseq, '\0');
+    for (size_t k = 0; k < nsites; ++k) {
+        for (size_t i = 0; i < nseq; ++i) column[i] = static_cast<char>(packed.get_codes(i)[k]);
+        auto inserted = patterns.emplace(column, _pattern_sites.size());
+        if (inserted.second) {
+            _pattern_sites.push_back(k);
+            pattern_counts.push_back(0);
+        }
+        pattern_of_site[k] = inserted.first->second;
+        pattern_counts[inserted.first->second] += 1;
+    }
+
+    size_t npatterns = _pattern_sites.size();
+    _weights.assign(npatterns * nreplicates, 0);
+    mt19937_64 rng(seed);
+    uniform_int_distribution<size_t> draw(0, nsites > 0 ? nsites - 1 : 0);
+    for (size_t b = 0; b < nreplicates; ++b) {
+        if (b == 0 && include_original) {
+            for (size_t p = 0; p < npatterns; ++p) _weights[p * nreplicates] = pattern_counts[p];
+            continue;
+        }
+        for (size_t k = 0; k < nsites; ++k) {
+            _weights[pattern_of_site[draw(rng)] * nreplicates + b] += 1;
+        }
+    }
+
+    for (uint32_t mask : packed.get_code_masks()) {
+        _resolved.push_back(mask != 0 && (mask & (mask - 1)) == 0);
+    }
+}
+
+SiteBootstrap::~SiteBootstrap() {}
+
+size_t SiteBootstrap::get_number_of_replicates() const {
+    return _nreplicates;
+}
+
+size_t SiteBootstrap::get_number_of_patterns() const {
+    return _pattern_sites.size();
+}
+
+/*
+Adds the weighted joint code counts of sequences i and j for replicates
+[first, last) to tables, laid out cell-major: tables[cell * (last - first) + b],
+where cell indexes the get_number_of_codes() x get_number_of_codes() table.
+*/
+void SiteBootstrap::count_joint(size_t i, size_t j, size_t first, size_t last, vector<double>& tables) const {
+    const uint8_t* a = _packed.get_codes(i);
+    const uint8_t* c = _packed.get_codes(j);
+    size_t ncodes = _packed.get_number_of_codes();
+    size_t nb = last - first;
+    for (size_t p = 0; p < _pattern_sites.size(); ++p) {
+        size_t k = _pattern_sites[p];
+        if (a[k] == PackedSequences::NO_CODE || c[k] == PackedSequences::NO_CODE) continue;
+        double* out = &tables[(a[k] * ncodes + c[k]) * nb];
+        const double* w = &_weights[p * _nreplicates + first];
+        for (size_t b = 0; b < nb; ++b) out[b] += w[b];
+    }
+}
+
+// Weighted differences and comparable sites (both resolved) for replicates [first, last)
+void SiteBootstrap::count_differences(size_t i, size_t j, size_t first, size_t last, vector<double>& differences, vector<double>& comparable) const {
+    const uint8_t* a = _packed.get_codes(i);
+    const uint8_t* c = _packed.get_codes(j);
+    size_t nb = last - first;
+    for (size_t p = 0; p < _pattern_sites.size(); ++p) {
+        size_t k = _pattern_sites[p];
+        if (a[k] == PackedSequences::NO_CODE || c[k] == PackedSequences::NO_CODE) continue;
+        if (!_resolved[a[k]] || !_resolved[c[k]]) continue;
+        const double* w = &_weights[p * _nreplicates + first];
+        for (size_t b = 0; b < nb; ++b) comparable[b] += w[b];
+        if (a[k] != c[k]) {
+            for (size_t b = 0; b < nb; ++b) differences[b] += w[b];
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * SiteBootstrap.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef SITEBOOTSTRAP_H_
+#define SITEBOOTSTRAP_H_
+
+#include "PackedSequences.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/*
+Bootstrap replicates of an alignment held as site weights rather than as
+resampled copies of the sequences.
+The sites are first collapsed into distinct patterns. Each replicate then
+draws as many sites as the alignment has, uniformly with replacement, from
+a seeded generator. A replicate's weight for a pattern is the number of
+draws that landed on its sites. Weights are stored pattern-major, so that
+for one pair of sequences every replicate's table is filled in a single
+pass over the patterns.
+With include_original, replicate 0 holds the original pattern counts.
+*/
+class SiteBootstrap {
+public:
+    SiteBootstrap(const PackedSequences& packed, size_t nreplicates, uint64_t seed, bool include_original=false);
+    virtual ~SiteBootstrap();
+    size_t get_number_of_replicates() const;
+    size_t get_number_of_patterns() const;
+    void count_joint(size_t i, size_t j, size_t first, size_t last, vector<double>& tables) const;
+    void count_differences(size_t i, size_t j, size_t first, size_t last, vector<double>& differences, vector<double>& comparable) const;
+
+private:
+    const PackedSequences& _packed;
+    size_t _nreplicates;
+    vector<size_t> _pattern_sites;  // One representative site per pattern
+    vector<double> _weights;        // npatterns x nreplicates
+    vector<bool> _resolved;         // Codes that hold a single state
+};
+
+#endif /* SITEBOOTSTRAP_H_ */
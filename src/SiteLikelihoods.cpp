@@ -0,0 +1,37 @@
+/*
+ * SiteLikelihoods.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "SiteLikelihoods.h"
+
+SiteLikelihoods::SiteLikelihoods(size_t nsites, size_t ncat) :
+        _nsites(nsites), _ncat(ncat), _log_likelihoods(nsites, 0), _posteriors(nsites * ncat, 0) {}
+
+SiteLikelihoods::~SiteLikelihoods() {}
+
+size_t SiteLikelihoods::get_number_of_sites() const {
+    return _nsites;
+}
+
+size_t SiteLikelihoods::get_number_of_categories() const {
+    return _ncat;
+}
+
+double* SiteLikelihoods::log_likelihoods() {
+    return _log_likelihoods.data();
+}
+
+const double* SiteLikelihoods::log_likelihoods() const {
+    return _log_likelihoods.data();
+}
+
+double* SiteLikelihoods::posteriors() {
+    return _posteriors.data();
+}
+
+const double* SiteLikelihoods::posteriors() const {
+    return _posteriors.data();
+}
@@ -0,0 +1,38 @@
+/*
+ * SiteLikelihoods.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef SITELIKELIHOODS_H_
+#define SITELIKELIHOODS_H_
+
+#include <vector>
+
+using namespace std;
+
+/*
+Per-site results of a likelihood calculation, each in one contiguous buffer:
+the lnL of every site of the alignment, and the posterior probability of each
+rate category at every site, stored a row of categories per site.
+*/
+class SiteLikelihoods {
+public:
+    SiteLikelihoods(size_t nsites, size_t ncat);
+    virtual ~SiteLikelihoods();
+    size_t get_number_of_sites() const;
+    size_t get_number_of_categories() const;
+    double* log_likelihoods();
+    const double* log_likelihoods() const;
+    double* posteriors();
+    const double* posteriors() const;
+
+private:
+    size_t _nsites;
+    size_t _ncat;
+    vector<double> _log_likelihoods;
+    vector<double> _posteriors;
+};
+
+#endif /* SITELIKELIHOODS_H_ */
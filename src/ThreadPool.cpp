@@ -0,0 +1,207 @@
+/*
+ * ThreadPool.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace {
+
+// What the current thread is doing for a pool
+struct ThreadState {
+    const void* pool = nullptr;
+    size_t id = 0;
+    const void* loop = nullptr;    // The loop whose callback is running, if any
+};
+
+thread_local ThreadState current;
+
+}
+
+ThreadPool::ThreadPool(size_t nthreads) {
+    nthreads = resolve_number_of_threads(nthreads);
+    _open.resize(nthreads);
+    for (size_t i = 0; i < nthreads; ++i) _open_mutexes.emplace_back(new mutex);
+    _workers.reserve(nthreads - 1);
+    for (size_t i = 1; i < nthreads; ++i) {
+        _workers.emplace_back(&ThreadPool::_worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return _workers.size() + 1;
+}
+
+// 0 means "use every core the hardware reports"
+size_t ThreadPool::resolve_number_of_threads(size_t nthreads) {
+    if (nthreads == 0) nthreads = thread::hardware_concurrency();
+    return nthreads > 0 ? nthreads : 1;
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end, const function<void(size_t, size_t)>& f, size_t grain) {
+    if (end <= begin) return;
+    grain = max(grain, static_cast<size_t>(1));
+    bool nested = current.pool == this;
+    unique_lock<mutex> call_lock(_call_mutex, defer_lock);
+    ThreadState outside = current;
+    if (!nested) {
+        call_lock.lock();
+        current.pool = this;
+        current.id = 0;
+        current.loop = nullptr;
+    }
+    size_t thread_id = current.id;
+    if (_workers.empty() || end - begin <= grain) {
+        try {
+            for (size_t i = begin; i < end; ++i) f(i, thread_id);
+        }
+        catch (...) {
+            current = outside;
+            throw;
+        }
+        current = outside;
+        return;
+    }
+
+    Loop loop;
+    loop.job = &f;
+    loop.next = begin;
+    loop.end = end;
+    loop.grain = grain;
+    loop.remaining = end - begin;
+    loop.helpers = 0;
+    loop.parent = static_cast<const Loop*>(current.loop);
+    {
+        lock_guard<mutex> lock(*_open_mutexes[thread_id]);
+        _open[thread_id].push_back(&loop);
+    }
+    {
+        lock_guard<mutex> lock(_mutex);
+        ++_generation;
+    }
+    _wake.notify_all();
+
+    _run_loop(loop, thread_id);
+    // Help with loops nested inside this one until the last chunk is done
+    while (loop.remaining > 0) {
+        size_t seen;
+        {
+            lock_guard<mutex> lock(_mutex);
+            seen = _generation;
+        }
+        Loop* inner = _find_loop(thread_id, &loop);
+        if (inner) {
+            _run_loop(*inner, thread_id);
+            if (--inner->helpers == 0) {
+                lock_guard<mutex> lock(_mutex);
+                _wake.notify_all();
+            }
+            continue;
+        }
+        unique_lock<mutex> lock(_mutex);
+        _wake.wait(lock, [&] { return loop.remaining == 0 || _generation != seen; });
+    }
+    {
+        lock_guard<mutex> lock(*_open_mutexes[thread_id]);
+        _open[thread_id].pop_back();
+    }
+    {
+        unique_lock<mutex> lock(_mutex);
+        _wake.wait(lock, [&] { return loop.helpers == 0; });
+    }
+    current = outside;
+    if (loop.error) rethrow_exception(loop.error);
+}
+
+void ThreadPool::_worker_loop(size_t thread_id) {
+    current.pool = this;
+    current.id = thread_id;
+    while (true) {
+        size_t seen;
+        {
+            lock_guard<mutex> lock(_mutex);
+            if (_stop) return;
+            seen = _generation;
+        }
+        Loop* loop = _find_loop(thread_id, nullptr);
+        if (loop) {
+            _run_loop(*loop, thread_id);
+            if (--loop->helpers == 0) {
+                lock_guard<mutex> lock(_mutex);
+                _wake.notify_all();
+            }
+            continue;
+        }
+        unique_lock<mutex> lock(_mutex);
+        _wake.wait(lock, [&] { return _stop || _generation != seen; });
+    }
+}
+
+/*
+An open loop, on another thread, with chunks left to claim: the outermost one
+on the first thread found with any, or if ancestor is given, the outermost
+one nested inside it. The caller becomes one of its helpers.
+*/
+ThreadPool::Loop* ThreadPool::_find_loop(size_t thread_id, const Loop* ancestor) {
+    size_t nthreads = _open.size();
+    for (size_t k = 1; k < nthreads; ++k) {
+        size_t other = (thread_id + k) % nthreads;
+        lock_guard<mutex> lock(*_open_mutexes[other]);
+        for (Loop* loop : _open[other]) {
+            if (loop->next >= loop->end) continue;
+            bool inside = !ancestor;
+            for (const Loop* up = loop->parent; up && !inside; up = up->parent) inside = up == ancestor;
+            if (!inside) continue;
+            ++loop->helpers;
+            return loop;
+        }
+    }
+    return nullptr;
+}
+
+// Claims and runs chunks of loop until none are left
+void ThreadPool::_run_loop(Loop& loop, size_t thread_id) {
+    const void* outer = current.loop;
+    current.loop = &loop;
+    while (true) {
+        size_t first = loop.next.fetch_add(loop.grain);
+        if (first >= loop.end) break;
+        size_t last = min(first + loop.grain, loop.end);
+        try {
+            for (size_t i = first; i < last; ++i) (*loop.job)(i, thread_id);
+        }
+        catch (...) {
+            {
+                lock_guard<mutex> lock(_mutex);
+                if (!loop.error) loop.error = current_exception();
+            }
+            // Stop handing out work, and count what will now never run as done
+            size_t unclaimed = loop.next.exchange(loop.end);
+            if (unclaimed < loop.end) _finish(loop, loop.end - unclaimed);
+        }
+        _finish(loop, last - first);
+    }
+    current.loop = outer;
+}
+
+void ThreadPool::_finish(Loop& loop, size_t count) {
+    if (loop.remaining.fetch_sub(count) == count) {
+        lock_guard<mutex> lock(_mutex);
+        _wake.notify_all();
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * ThreadPool.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+A persistent pool of worker threads. parallel_for hands out chunks of an
+index range to the workers (and the calling thread, which acts as thread 0)
+and blocks until every index has been processed. The thread id passed to the
+callback is stable for the duration of the call, so callers can keep
+per-thread scratch space in a vector indexed by it.
+Scheduling is by work stealing, so a callback may itself call parallel_for
+on the same pool: the inner loop is published on the calling thread's stack
+of open loops, and idle threads join the outermost open loop that still has
+unclaimed chunks, anywhere in the pool. A thread waiting for the rest of its
+own loop to finish helps with the loops nested inside it, and only those, so
+a callback never runs inside another call of the same loop on one thread.
+This keeps every thread busy when a few outer tasks (genes, say) are much
+bigger than the rest. Calls from outside the pool are serialised.
+*/
+class ThreadPool {
+public:
+    ThreadPool(size_t nthreads=1);
+    virtual ~ThreadPool();
+    size_t size() const;
+    void parallel_for(size_t begin, size_t end, const function<void(size_t, size_t)>& f, size_t grain=1);
+    static size_t resolve_number_of_threads(size_t nthreads);
+
+private:
+    // One call of parallel_for, open until its last chunk has finished
+    struct Loop {
+        const function<void(size_t, size_t)>* job;
+        atomic<size_t> next;
+        size_t end;
+        size_t grain;
+        atomic<size_t> remaining;    // Indices not yet processed
+        atomic<size_t> helpers;      // Threads, other than the caller, holding a pointer to this
+        const Loop* parent;          // The loop whose callback made this call, if any
+        exception_ptr error;
+    };
+    void _worker_loop(size_t thread_id);
+    void _run_loop(Loop& loop, size_t thread_id);
+    void _finish(Loop& loop, size_t count);
+    Loop* _find_loop(size_t thread_id, const Loop* ancestor);
+    vector<thread> _workers;
+    vector<vector<Loop*>> _open;         // Open loops called from each thread, outermost first
+    vector<unique_ptr<mutex>> _open_mutexes;
+    mutex _call_mutex;
+    mutex _mutex;
+    condition_variable _wake;
+    size_t _generation = 0;              // Counts loops opened, so that sleeping threads can look again
+    bool _stop = false;
+};
+
+#endif /* THREADPOOL_H_ */
@@ -0,0 +1,88 @@
+/*
+ * TiledPairs.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef TILEDPAIRS_H_
+#define TILEDPAIRS_H_
+
+#include "CondensedMatrix.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+/*
+Cache-blocked walk over all pairs of n sequences, each ncolumns long.
+Sequences are grouped into blocks of block_size and columns into chunks of
+chunk_size, and each task handles one pair of sequence blocks: for every
+column chunk it visits all pairs in the two blocks before moving on, so the
+chunk of both blocks stays in L1/L2 while it is reused.
+The callbacks are
+    accumulate(i, j, first_column, last_column, slot, thread_id)
+    finish(i, j, slot, thread_id)
+where slot (< get_number_of_slots()) identifies the pair within its task, so
+callers can keep per-thread accumulators indexed by (thread_id, slot).
+finish is called once per pair, after all of its columns.
+*/
+class TiledPairs {
+public:
+    TiledPairs(size_t n, size_t ncolumns, size_t block_size, size_t chunk_size, size_t nthreads=1) :
+            _n(n), _ncolumns(ncolumns), _block(max(block_size, static_cast<size_t>(1))),
+            _chunk(max(chunk_size, static_cast<size_t>(1))) {
+        // Shrink the blocks until there are enough tasks to keep every thread busy
+        while (_block > 1 && _number_of_block_pairs() < 4 * nthreads) _block /= 2;
+    }
+
+    size_t get_block_size() const { return _block; }
+
+    size_t get_number_of_slots() const { return _block * _block; }
+
+    template<typename Accumulate, typename Finish>
+    void run(ThreadPool& pool, Accumulate accumulate, Finish finish) const {
+        size_t nblocks = (_n + _block - 1) / _block;
+        pool.parallel_for(0, _number_of_block_pairs(), [&](size_t task, size_t thread_id) {
+            size_t bi, bj;
+            if (nblocks == 1) {
+                bi = bj = 0;
+            }
+            else if (task < nblocks) {  // Diagonal tiles first: they only hold half as many pairs
+                bi = bj = task;
+            }
+            else {
+                CondensedMatrix::pair_from_index(task - nblocks, nblocks, bi, bj);
+            }
+            size_t i0 = bi * _block, i1 = min(i0 + _block, _n);
+            size_t j0 = bj * _block, j1 = min(j0 + _block, _n);
+            for (size_t c0 = 0; c0 < _ncolumns; c0 += _chunk) {
+                size_t c1 = min(c0 + _chunk, _ncolumns);
+                for (size_t i = i0; i < i1; ++i) {
+                    for (size_t j = max(j0, i + 1); j < j1; ++j) {
+                        accumulate(i, j, c0, c1, (i - i0) * _block + (j - j0), thread_id);
+                    }
+                }
+            }
+            for (size_t i = i0; i < i1; ++i) {
+                for (size_t j = max(j0, i + 1); j < j1; ++j) {
+                    finish(i, j, (i - i0) * _block + (j - j0), thread_id);
+                }
+            }
+        });
+    }
+
+private:
+    size_t _number_of_block_pairs() const {
+        size_t nblocks = (_n + _block - 1) / _block;
+        return nblocks * (nblocks + 1) / 2;
+    }
+
+    size_t _n;
+    size_t _ncolumns;
+    size_t _block;
+    size_t _chunk;
+};
+
+#endif /* TILEDPAIRS_H_ */
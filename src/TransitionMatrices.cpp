@@ -0,0 +1,149 @@
+/*
+ * TransitionMatrices.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#include "TransitionMatrices.h"
+
+#include <Bpp/Exceptions.h>
+
+#include <algorithm>
+#include <cmath>
+
+#define P_MATRIX_CACHE_SIZE 64
+
+TransitionMatrices::TransitionMatrices(shared_ptr<SubstitutionModel> model) :
+        _model(model), _nstates(model->getNumberOfStates()), _version(0) {
+    _refresh();
+}
+
+TransitionMatrices::~TransitionMatrices() {}
+
+const shared_ptr<SubstitutionModel>& TransitionMatrices::get_model() const {
+    return _model;
+}
+
+size_t TransitionMatrices::get_number_of_states() const {
+    return _nstates;
+}
+
+// Starts at 1, and goes up by one each time the model's parameters are found to have changed
+size_t TransitionMatrices::get_version() {
+    _refresh();
+    return _version;
+}
+
+/*
+Writes P(t) for each of times, one matrix after another, into out, which
+must have room for times.size() x nstates x nstates doubles.
+*/
+void TransitionMatrices::fill(const vector<double>& times, double* out) {
+    _refresh();
+    size_t ss = _nstates * _nstates;
+    vector<size_t> missed;
+    for (size_t i = 0; i < times.size(); ++i) {
+        if (times[i] < 0) throw Exception("TransitionMatrices: negative time");
+        auto it = _index.find(times[i]);
+        if (it == _index.end()) {
+            missed.push_back(i);
+            continue;
+        }
+        _recent.splice(_recent.begin(), _recent, it->second);
+        copy(it->second->second.begin(), it->second->second.end(), out + i * ss);
+    }
+    if (missed.empty()) return;
+    _compute(times, missed, out);
+    for (size_t i : missed) _remember(times[i], out + i * ss);
+}
+
+vector<vector<double>> TransitionMatrices::get(double time) {
+    vector<double> p(_nstates * _nstates);
+    fill({time}, p.data());
+    vector<vector<double>> rows(_nstates);
+    for (size_t a = 0; a < _nstates; ++a) rows[a].assign(p.begin() + a * _nstates, p.begin() + (a + 1) * _nstates);
+    return rows;
+}
+
+// Starts a new version, emptying the cache, if the model has changed since the last
+void TransitionMatrices::_refresh() {
+    vector<double> values = _model_values();
+    if (_version > 0 && values == _values) return;
+    _values = values;
+    ++_version;
+    _recent.clear();
+    _index.clear();
+    if (!_model->isDiagonalizable()) return;
+    size_t s = _nstates;
+    const Vdouble& eigenvalues = _model->getEigenValues();
+    const Matrix<double>& right = _model->getColumnRightEigenVectors();
+    const Matrix<double>& left = _model->getRowLeftEigenVectors();
+    double rate = _model->getRate();
+    _eigenvalues.resize(s);
+    _right.resize(s * s);
+    _left.resize(s * s);
+    for (size_t k = 0; k < s; ++k) {
+        _eigenvalues[k] = eigenvalues[k] * rate;
+        for (size_t a = 0; a < s; ++a) {
+            _right[k * s + a] = right(k, a);
+            _left[k * s + a] = left(k, a);
+        }
+    }
+}
+
+// Everything P(t) depends on, in one vector for comparison
+vector<double> TransitionMatrices::_model_values() const {
+    const ParameterList& parameters = _model->getParameters();
+    vector<double> values;
+    for (size_t i = 0; i < parameters.size(); ++i) values.push_back(parameters[i].getValue());
+    values.push_back(_model->getRate());
+    const Vdouble& freqs = _model->getFrequencies();
+    values.insert(values.end(), freqs.begin(), freqs.end());
+    return values;
+}
+
+// P(t) for times[i], each i in which, into its place in out
+void TransitionMatrices::_compute(const vector<double>& times, const vector<size_t>& which, double* out) const {
+    size_t s = _nstates;
+    size_t ss = s * s;
+    if (!_model->isDiagonalizable()) {
+        for (size_t i : which) {
+            const Matrix<double>& p = _model->getPij_t(times[i]);
+            for (size_t a = 0; a < s; ++a) {
+                for (size_t b = 0; b < s; ++b) out[i * ss + a * s + b] = p(a, b);
+            }
+        }
+        return;
+    }
+    size_t n = which.size();
+    vector<double> e(n * s);
+    for (size_t j = 0; j < n; ++j) {
+        double t = times[which[j]];
+        for (size_t k = 0; k < s; ++k) e[j * s + k] = t * _eigenvalues[k];
+    }
+    for (double& x : e) x = exp(x);
+    for (size_t j = 0; j < n; ++j) {
+        double* p = out + which[j] * ss;
+        std::fill(p, p + ss, 0.0);
+        for (size_t a = 0; a < s; ++a) {
+            double* row = p + a * s;
+            for (size_t k = 0; k < s; ++k) {
+                double x = _right[a * s + k] * e[j * s + k];
+                const double* l = &_left[k * s];
+                for (size_t b = 0; b < s; ++b) row[b] += x * l[b];
+            }
+        }
+    }
+}
+
+void TransitionMatrices::_remember(double time, const double* p) {
+    auto it = _index.find(time);
+    if (it != _index.end()) return;    // A repeat within one batch
+    _recent.emplace_front(time, vector<double>(p, p + _nstates * _nstates));
+    _index[time] = _recent.begin();
+    if (_recent.size() > P_MATRIX_CACHE_SIZE) {
+        _index.erase(_recent.back().first);
+        _recent.pop_back();
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * TransitionMatrices.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ */
+
+#ifndef TRANSITIONMATRICES_H_
+#define TRANSITIONMATRICES_H_
+
+#include <Bpp/Phyl/Model/SubstitutionModel.h>
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace bpp;
+using namespace std;
+
+/*
+P(t) for one substitution model, from its eigendecomposition:
+P_ab(t) = sum_k right(a, k) exp(lambda_k t) left(k, b). The decomposition is
+copied out of the model once per version of its parameters. The version
+changes whenever a request finds that the parameter values, rate or
+frequencies differ from those it was copied at.
+The last P_MATRIX_CACHE_SIZE matrices of the current version are kept, most
+recently used first, so a repeated time costs a copy. Batches of times that
+miss the cache are done together: their exponentials first, then each
+matrix as a sum of rank-one terms, whose inner loop runs along contiguous
+rows.
+Matrices are written row-major, nstates x nstates. Not safe to share between
+threads.
+*/
+class TransitionMatrices {
+public:
+    TransitionMatrices(shared_ptr<SubstitutionModel> model);
+    virtual ~TransitionMatrices();
+    const shared_ptr<SubstitutionModel>& get_model() const;
+    size_t get_number_of_states() const;
+    size_t get_version();
+    void fill(const vector<double>& times, double* out);
+    vector<vector<double>> get(double time);
+
+private:
+    typedef list<pair<double, vector<double>>> Recent;
+    void _refresh();
+    vector<double> _model_values() const;
+    void _compute(const vector<double>& times, const vector<size_t>& which, double* out) const;
+    void _remember(double time, const double* p);
+    shared_ptr<SubstitutionModel> _model;
+    size_t _nstates;
+    size_t _version;
+    vector<double> _values;           // What the version was read from
+    vector<double> _eigenvalues;      // Scaled by the model rate
+    vector<double> _right;            // nstates x nstates, column eigenvectors
+    vector<double> _left;             // nstates x nstates, row eigenvectors
+    Recent _recent;
+    unordered_map<double, Recent::iterator> _index;
+};
+
+#endif /* TRANSITIONMATRICES_H_ */
@@ -0,0 +1,112 @@
+/*
+ * bench_distances.cpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: kgori
+ *
+ * Times fast_compute_distances (JC and a closed-form model) and
+ * compute_distances on random alignments over a grid of sequence counts
+ * and lengths, then get_bionj_tree, get_rapid_bionj_tree and get_bme_tree
+ * on the fast distances, then get_likelihood, optimise_branch_lengths and
+ * the aBayes and SH-aLRT supports on the BME tree.
+ *   bench_distances [dna|protein] [threads]
+ */
+
+#include "Alignment.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+vector<pair<string, string>> random_alignment(size_t n, size_t length, const string& states, mt19937_64& rng) {
+    uniform_int_distribution<size_t> pick(0, states.size() - 1);
+    vector<pair<string, string>> seqs;
+    for (size_t i = 0; i < n; ++i) {
+        string seq(length, ' ');
+        for (auto& c : seq) c = states[pick(rng)];
+        seqs.push_back(make_pair("seq" + to_string(i), seq));
+    }
+    return seqs;
+}
+
+template<typename F>
+double seconds(F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    string datatype = argc > 1 ? argv[1] : "dna";
+    size_t nthreads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1;
+    string states = datatype == "protein" ? "ARNDCQEGHILKMFPSTWYV" : "ACGT";
+    string model = datatype == "protein" ? "LG08" : "GTR";
+    string analytic = datatype == "protein" ? "kimura" : "tn93";
+    mt19937_64 rng(1);
+
+    cout << datatype << ", " << nthreads << " thread(s), kernel " << PackedSequences::get_kernel_name() << endl;
+    cout << setw(8) << "n" << setw(10) << "length" << setw(12) << "pairs/s" << setw(14) << "fast (s)" << setw(14) << analytic + " (s)" << setw(14) << "ML (s)" << endl;
+    for (size_t n : {32, 128, 512}) {
+        for (size_t length : {1000, 10000, 100000}) {
+            auto seqs = random_alignment(n, length, states, rng);
+            Alignment al(seqs, datatype);
+            al.set_number_of_threads(nthreads);
+            al.set_substitution_model(model);
+            al.set_gamma_rate_model(4, 1.0);
+            double fast = seconds([&]() { al.fast_compute_distances(); });
+            double closed = seconds([&]() { al.fast_compute_distances(analytic, 1.0); });
+            double ml = seconds([&]() { al.compute_distances(); });
+            double npairs = static_cast<double>(n * (n - 1) / 2);
+            cout << setw(8) << n << setw(10) << length << setw(12) << setprecision(3) << npairs / fast
+                 << setw(14) << setprecision(4) << fast << setw(14) << closed << setw(14) << ml << endl;
+        }
+    }
+
+    cout << endl << setw(8) << "n" << setw(14) << "BioNJ (s)" << setw(14) << "RapidNJ (s)" << setw(10) << "visited" << endl;
+    for (size_t n : {1000, 4000}) {
+        auto seqs = random_alignment(n, 1000, states, rng);
+        Alignment al(seqs, datatype);
+        al.set_number_of_threads(nthreads);
+        al.fast_compute_distances();
+        double bionj = seconds([&]() { al.get_bionj_tree(); });
+        double rapid = seconds([&]() { al.get_rapid_bionj_tree(); });
+        cout << setw(8) << n << setw(14) << setprecision(4) << bionj << setw(14) << rapid
+             << setw(10) << setprecision(3) << al.get_bionj_visited_fraction() << endl;
+    }
+
+    cout << endl << setw(8) << "n" << setw(14) << "BME (s)" << setw(10) << "rounds" << setw(14) << "BioNJ length" << setw(14) << "BME length" << endl;
+    for (size_t n : {250, 1000}) {
+        auto seqs = random_alignment(n, 1000, states, rng);
+        Alignment al(seqs, datatype);
+        al.set_number_of_threads(nthreads);
+        al.fast_compute_distances();
+        double bme = seconds([&]() { al.get_bme_tree(); });
+        vector<double> lengths = al.get_bme_lengths();
+        cout << setw(8) << n << setw(14) << setprecision(4) << bme << setw(10) << lengths.size() - 1
+             << setw(14) << setprecision(6) << lengths.front() << setw(14) << lengths.back() << endl;
+    }
+
+    cout << endl << setw(8) << "n" << setw(10) << "length" << setw(14) << "lnL (s)" << setw(14) << "brlens (s)"
+         << setw(14) << "aBayes (s)" << setw(14) << "SH-aLRT (s)" << setw(16) << "lnL" << endl;
+    for (size_t length : {10000, 100000}) {
+        size_t n = 50;
+        auto seqs = random_alignment(n, length, states, rng);
+        Alignment al(seqs, datatype);
+        al.set_number_of_threads(nthreads);
+        al.set_substitution_model(model);
+        al.set_gamma_rate_model(4, 1.0);
+        al.initialise_likelihood();
+        double lnl = seconds([&]() { al.get_likelihood(); });
+        double brlens = seconds([&]() { al.optimise_branch_lengths(); });
+        double abayes = seconds([&]() { al.get_abayes_tree(); });
+        double alrt = seconds([&]() { al.get_alrt_tree(); });
+        cout << setw(8) << n << setw(10) << length << setw(14) << setprecision(4) << lnl << setw(14) << brlens
+             << setw(14) << abayes << setw(14) << alrt << setw(16) << setprecision(10) << al.get_likelihood() << endl;
+    }
+}